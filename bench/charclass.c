@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "charclass.h"
+
+/* charclass: the line scanning mysh does on every command, the old way and the new way
+
+Builds command lines like the ones our scripts end up with after a wildcard expands
+("ls -l big/file0.dat big/file1.dat ... | wc -l"), at a few different sizes. Then it
+times the checks processLine() and masterDirectory() make on each line: ifAllSpaces(),
+makeSpaceForJesus(), and hasPipe() and hasCaret() a handful of times over. "bytewise"
+is how mysh.c used to do them, with strlen() in every loop condition. The others are
+the same checks reading from one charclass.h map, with each of the kernels */
+
+#define CHECKS 8    // About how many hasPipe()/hasCaret() calls a line gets on its way through
+
+/* ===================================================== The old way */
+
+int bytewiseHasPipe(char* line) {
+    for ( int i = 0; i < strlen(line); i++ ) {
+        if ( line[i] == '|' ) return 0;
+    }
+    return 1;
+}
+
+int bytewiseHasCaret(char* line) {
+    for ( int i = 0; i < strlen(line); i++ ) {
+        if ( line[i] == '<' || line[i] == '>' ) return 0;
+    }
+    return 1;
+}
+
+int bytewiseAllSpaces(char* line) {
+    for ( int i = 0; i < strlen(line); i++ ) {
+        if ( isspace(line[i]) == 0 ) return 0;
+    }
+    return 1;
+}
+
+char* bytewiseSpace(char* line) {
+    int len = strlen(line);
+    int newSize = len + 2;
+    for ( int i = 0; i < len; i++ ) {
+        if ( line[i] == '<' || line[i] == '>' || line[i] == '|' ) newSize += 2;
+    }
+    char* temp = malloc(newSize);
+    int j = 0;
+    for ( int i = 0; i < len; i++ ) {
+        if ( line[i] == '<' || line[i] == '>' || line[i] == '|' ) {
+            temp[j++] = ' ';
+            temp[j++] = line[i];
+            temp[j++] = ' ';
+        } else {
+            temp[j++] = line[i];
+        }
+    }
+    temp[j] = '\0';
+    return temp;
+}
+
+int bytewise(char* line) {
+    int found = bytewiseAllSpaces(line);
+    char* spaced = bytewiseSpace(line);
+    for ( int i = 0; i < CHECKS; i++ ) found += bytewiseHasPipe(spaced) + bytewiseHasCaret(spaced);
+    free(spaced);
+    return found;
+}
+
+/* ===================================================== The new way */
+
+CharMap map;
+
+char* mappedSpace(char* line) {
+    charMapBuild(&map, line, strlen(line));
+    unsigned targets = CLASS_BIT(CLASS_PIPE) | CLASS_BIT(CLASS_CARET);
+    char* temp = malloc(map.length + 2 * charMapCount(&map, targets) + 1);
+    size_t i = 0, j = 0;
+    while ( i < map.length ) {
+        size_t next = charMapNext(&map, targets, i);
+        memcpy(temp + j, line + i, next - i);
+        j += next - i;
+        if ( next == map.length ) break;
+        temp[j++] = ' ';
+        temp[j++] = line[next];
+        temp[j++] = ' ';
+        i = next + 1;
+    }
+    temp[j] = '\0';
+    return temp;
+}
+
+int mapped(char* line) {
+    int found = isspace(line[0]) ? 1 : 0;      // ifAllSpaces() gives up on the first character
+    char* spaced = mappedSpace(line);
+    charMapBuild(&map, spaced, strlen(spaced)); // Once, and then every check reads from it
+    for ( int i = 0; i < CHECKS; i++ ) {
+        found += ( map.present & CLASS_BIT(CLASS_PIPE) ) ? 0 : 1;
+        found += ( map.present & CLASS_BIT(CLASS_CARET) ) ? 0 : 1;
+    }
+    free(spaced);
+    return found;
+}
+
+/* ===================================================== Harness */
+
+char* makeLine(int files) {
+    size_t capacity = 64 + files * 24;
+    char* line = malloc(capacity);
+    size_t length = sprintf(line, "ls -l");
+    for ( int i = 0; i < files; i++ ) length += sprintf(line + length, " big/file%d.dat", i);
+    sprintf(line + length, "|wc -l>count.txt");
+    return line;
+}
+
+double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Runs 'scan' over 'line' for about a quarter of a second. Returns nanoseconds per line */
+double timeScan(int (*scan)(char*), char* line) {
+    volatile int sink = 0;
+    long rounds = 0;
+    double start = seconds();
+    double elapsed;
+    do {
+        for ( int i = 0; i < 16; i++ ) sink += scan(line);
+        rounds += 16;
+        elapsed = seconds() - start;
+    } while ( elapsed < 0.25 );
+    (void)sink;
+    return elapsed / rounds * 1e9;
+}
+
+int main(int argc, char* argv[]) {
+
+    int sizes[] = { 10, 100, 1000, 10000, 100000 };
+    ClassifyBlock kernels[3] = { classifyScalar, NULL, NULL };
+    const char* names[3] = { "scalar", "sse2", "avx2" };
+    int count = 1;
+#ifdef CHARCLASS_X86
+    kernels[count++] = classifySSE2;
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) kernels[count++] = classifyAVX2;
+#endif
+
+    printf("%10s %10s %14s", "files", "bytes", "bytewise-ns");
+    for ( int k = 0; k < count; k++ ) printf(" %11s-ns", names[k]);
+    printf(" %9s\n", "speedup");
+
+    for ( int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ ) {
+        char* line = makeLine(sizes[s]);
+
+        // Every kernel has to agree with the old way before its number counts
+        int expected = bytewise(line);
+        double old = timeScan(bytewise, line);
+        printf("%10d %10zu %14.0f", sizes[s], strlen(line), old);
+
+        double best = old;
+        for ( int k = 0; k < count; k++ ) {
+            charclass_kernel = kernels[k];
+            if ( mapped(line) != expected ) {
+                printf("\nError: the %s kernel got a different answer\n", names[k]);
+                return 1;
+            }
+            double ns = timeScan(mapped, line);
+            if ( ns < best ) best = ns;
+            printf(" %14.0f", ns);
+        }
+        printf(" %8.1fx\n", old / best);
+        free(line);
+    }
+    charMapFree(&map);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/* measure <lines> <shell> [shell arguments...]
+Runs the shell with its output thrown away, and prints one line for run.sh to pick up:
+wall seconds, lines per second, user + system CPU seconds, and peak RSS in KB.
+wait4() hands back the rusage of just this one child (plus whatever it ran and waited
+for), so nothing else we started gets mixed into the numbers */
+
+int main(int argc, char* argv[]) {
+
+    if ( argc < 3 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: measure <lines> <shell> [arguments]\n");
+        return 1;
+    }
+    long lines = atol(argv[1]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        perror("fork");
+        return 1;
+    }
+    if ( pid == 0 ) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+        execv(argv[2], &argv[2]);
+        _exit(127);
+    }
+
+    int wstatus;
+    struct rusage usage;
+    while ( wait4(pid, &wstatus, 0, &usage) == -1 ) {
+        if ( errno != EINTR ) {
+            perror("wait4");
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if ( WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 127 ) {
+        printf("Error: could not run %s\n", argv[2]);
+        return 1;
+    }
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 
+               + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    // CPU covers the programs the shell ran too. ru_maxrss is the biggest any one of them got
+    printf("%.3f %.0f %.3f %ld\n", wall, wall > 0 ? lines / wall : 0.0, cpu, usage.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+# Batch mode benchmark: mysh against dash and bash on the same workloads.
+# Run it with 'make bench'. Everything is generated on the spot, nothing is downloaded.
+#
+#   BENCH_SCALE=N   multiplies the size of every workload (default 1)
+#   BENCH_DIR=path  where the scripts and scratch files go (default: a fresh temp dir)
+
+cd "$(dirname "$0")" || exit 1
+here=$(pwd)
+scale=${BENCH_SCALE:-1}
+work=${BENCH_DIR:-$(mktemp -d "${TMPDIR:-/tmp}/mysh-bench.XXXXXX")}
+mkdir -p "$work"
+cd "$work" || exit 1
+
+# mysh batch mode stops at the first blank line, so none of these may ever write one.
+# Every workload gets written twice: once for mysh, and once in plain sh for dash and bash.
+
+# Many short commands
+short() {
+    n=$((2000 * scale))
+    i=0
+    : > short.mysh
+    while [ $i -lt $n ]; do
+        printf 'echo line %d\ntrue\npwd\n' $i >> short.mysh
+        i=$((i + 1))
+    done
+    cp short.mysh short.sh
+}
+
+# Pipelines. mysh only takes one pipe per line, so "long" here means lots of data
+# going through them rather than lots of stages
+pipelines() {
+    seq 1 $((50000 * scale)) > numbers.txt
+    n=$((200 * scale))
+    i=0
+    : > pipelines.mysh
+    while [ $i -lt $n ]; do
+        printf 'cat numbers.txt | wc -l\nseq 1 20000 | sort -r\ncat numbers.txt | grep 7\n' >> pipelines.mysh
+        i=$((i + 1))
+    done
+    cp pipelines.mysh pipelines.sh
+}
+
+# Redirection both ways
+redirection() {
+    n=$((1000 * scale))
+    i=0
+    : > redirection.mysh
+    while [ $i -lt $n ]; do
+        printf 'echo entry %d > out.txt\ncat < out.txt\nsort < numbers.txt > sorted.txt\n' $i >> redirection.mysh
+        i=$((i + 1))
+    done
+    cp redirection.mysh redirection.sh
+}
+
+# Wildcards over a big directory
+wildcards() {
+    mkdir -p big
+    files=$((5000 * scale))
+    i=0
+    while [ $i -lt $files ]; do
+        : > big/file$i.dat
+        i=$((i + 1))
+    done
+    n=$((100 * scale))
+    i=0
+    : > wildcards.mysh
+    while [ $i -lt $n ]; do
+        printf 'echo big/*.dat\nls big/file1*.dat\necho big/file?.dat\n' >> wildcards.mysh
+        i=$((i + 1))
+    done
+    cp wildcards.mysh wildcards.sh
+}
+
+# then/else chains. sh doesn't have those, so they become tests on $?
+chains() {
+    n=$((1000 * scale))
+    i=0
+    : > chains.mysh
+    : > chains.sh
+    while [ $i -lt $n ]; do
+        printf 'ls numbers.txt\nthen echo found\nelse echo missing\nls no-such-file\nelse echo recovered\nthen echo fine\n' >> chains.mysh
+        printf 'ls numbers.txt\n[ $? -eq 0 ] && echo found\n[ $? -ne 0 ] && echo missing\nls no-such-file\n[ $? -ne 0 ] && echo recovered\n[ $? -eq 0 ] && echo fine\n' >> chains.sh
+        i=$((i + 1))
+    done
+}
+
+echo "Generating workloads in $work (scale $scale)"
+short; pipelines; redirection; wildcards; chains
+
+shells="mysh:$here/mysh-bench"
+[ -x "$here/../mysh" ] && shells="$shells mysh-asan:$here/../mysh"
+for candidate in dash bash; do
+    path=$(command -v $candidate) && shells="$shells $candidate:$path"
+done
+
+printf '\n%-12s %-10s %10s %12s %10s %12s\n' workload shell wall-s lines/s cpu-s peak-rss-kb
+for workload in short pipelines redirection wildcards chains; do
+    lines=$(wc -l < $workload.mysh)
+    for entry in $shells; do
+        name=${entry%%:*}
+        path=${entry#*:}
+        case $name in
+            mysh*) script=$workload.mysh ;;
+            *) script=$workload.sh ;;
+        esac
+        result=$(ASAN_OPTIONS=detect_leaks=0 "$here/measure" "$lines" "$path" "$script") || {
+            echo "$result"
+            continue
+        }
+        set -- $result
+        printf '%-12s %-10s %10s %12s %10s %12s\n' $workload $name $1 $2 $3 $4
+    done
+done
+
+[ -z "$BENCH_DIR" ] && rm -rf "$work"
+exit 0
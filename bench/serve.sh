@@ -0,0 +1,44 @@
+#!/bin/sh
+# Server mode benchmark: how many lines a second 'mysh --serve' gets through, against
+# starting a fresh /bin/sh for every line the way our services do now, and against a
+# whole 'myshc SOCKET command' (its own connection and its own copy of the server) per line.
+# Run it with 'make bench-serve'.
+#
+#   BENCH_LINES=N   lines per run (default 2000)
+
+cd "$(dirname "$0")" || exit 1
+here=$(pwd)
+lines=${BENCH_LINES:-2000}
+socket=${TMPDIR:-/tmp}/mysh-bench-$$.sock
+
+"$here/mysh-bench" --serve "$socket" 2>/dev/null &
+server=$!
+while [ ! -S "$socket" ]; do sleep 0.1; done
+
+echo "$lines lines each"
+for command in "true" "ls /"; do
+    printf '%-28s' "myshc '$command':"
+    "$here/../myshc" -n "$lines" "$socket" "$command" 2>&1 >/dev/null
+    printf '%-28s' "myshc -c '$command':"
+    "$here/../myshc" -c -n "$lines" "$socket" "$command" 2>&1 >/dev/null
+
+    # One-shot calls, each with a brand new client. Only a tenth as many, they're slow
+    script=$(mktemp)
+    i=0
+    while [ $i -lt $((lines / 10)) ]; do echo "$here/../myshc $socket '$command' >/dev/null"; i=$((i + 1)); done > "$script"
+    set -- $("$here/measure" $((lines / 10)) /bin/sh "$script")
+    printf '%-28s%s lines in %ss (%s lines/s)\n' "one-shot myshc '$command':" $((lines / 10)) "$1" "$2"
+    rm -f "$script"
+
+    # The same number of lines, each one its own sh
+    script=$(mktemp)
+    i=0
+    while [ $i -lt "$lines" ]; do echo "/bin/sh -c '$command'"; i=$((i + 1)); done > "$script"
+    set -- $("$here/measure" "$lines" /bin/sh "$script")
+    printf '%-28s%s lines in %ss (%s lines/s)\n' "sh -c '$command':" "$lines" "$1" "$2"
+    rm -f "$script"
+done
+
+kill $server
+wait $server 2>/dev/null
+exit 0
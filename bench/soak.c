@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* soak [-n commands] [-r rss-kb] [-m heap-kb] [-f fds] <mysh>
+
+Keeps one mysh busy with a long run of mixed commands, the way a session that stays
+open for weeks would, and checks that it isn't slowly growing. It goes twice: once
+streaming the commands into mysh's stdin through a pipe, and once as a script in batch
+mode. Each run is 'commands' long (a million by default).
+
+Every so often the commands include an 'echo soak-mark N'. Once that comes out the other
+end, mysh has gotten through everything before it, and that's when we take a sample from
+/proc: its resident set, how big its heap is, and how many fds it has open. The first
+tenth of the run is warmup, for the path cache and friends to fill up. If the last sample
+is bigger than the one after warmup by more than the limits (2048 KB of RSS, 1024 KB of
+heap and no fds at all by default), the run fails and so do we. 'make soak' runs it on
+the optimized build, and SOAK_COMMANDS=N makes the runs shorter or longer */
+
+#define SAMPLES 20      // Over the whole run. The first couple are warmup
+#define MARK "soak-mark"
+
+/* One command each. Some of them come in pairs that have to stay next to each other,
+like a command and its 'else'. None of them can be blank, or batch mode would stop */
+const char* mix[] = {
+    "echo line %d",
+    "true",
+    "pwd",
+    "x=%d",
+    "echo $x",
+    "let y=%d+1",
+    "echo soak*.txt",
+    "cat soak-input.txt | wc -l",
+    "sort soak-input.txt | wc -l > soak-count.txt",
+    "echo %d > soak-out.txt",
+    "cat < soak-out.txt",
+    "ls soak-no-such-file",
+    "else echo recovered %d",
+    "soak-no-such-program %d",
+    "true && echo and || echo or",
+    "for i in a b c; do echo $i %d; done",
+    "greet %d",
+    "echo $(echo sub %d)",
+    "cat <<< here-%d",
+    "cat <(echo proc %d)",
+    "cat <<EOF\nbody %d\nEOF",
+    "cd .",
+};
+#define MAX_MIX ( sizeof(mix) / sizeof(mix[0]) )
+
+// Once, at the start of every run. The function gets called from the mix
+const char* preamble = "greet() {\necho hello $1\n}\n";
+
+typedef struct Sample {
+    long commands;      // How far into the run it was taken
+    long rss_kb;
+    long heap_kb;
+    int fds;
+} Sample;
+
+/* Reads 'pid's numbers out of /proc. Returns 1 if it's gone */
+int takeSample(pid_t pid, Sample* sample) {
+
+    char path[64];
+    char text[512];
+
+    sample->rss_kb = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* file = fopen(path, "r");
+    if ( file == NULL ) return 1;
+    while ( fgets(text, sizeof(text), file) != NULL ) {
+        if ( strncmp(text, "VmRSS:", 6) == 0 ) sample->rss_kb = atol(text + 6);
+    }
+    fclose(file);
+
+    // The heap is the [heap] mapping: how far malloc() has had to move the break
+    sample->heap_kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    file = fopen(path, "r");
+    if ( file == NULL ) return 1;
+    while ( fgets(text, sizeof(text), file) != NULL ) {
+        unsigned long start, end;
+        if ( strstr(text, "[heap]") != NULL && sscanf(text, "%lx-%lx", &start, &end) == 2 ) {
+            sample->heap_kb = ( end - start ) / 1024;
+        }
+    }
+    fclose(file);
+
+    sample->fds = 0;
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR* directory = opendir(path);
+    if ( directory == NULL ) return 1;
+    struct dirent* entry;
+    while ( ( entry = readdir(directory) ) != NULL ) {
+        if ( entry->d_name[0] != '.' ) sample->fds++;
+    }
+    closedir(directory);
+    return 0;
+}
+
+/* Commands 'from' up to 'to', and then the mark that says we got there. Returns a
+malloc'd buffer and puts its length in 'length' */
+char* makeCommands(long from, long to, int mark, size_t* length) {
+    char* text = NULL;
+    FILE* stream = open_memstream(&text, length);
+    if ( from == 0 ) fputs(preamble, stream);
+    for ( long i = from; i < to; i++ ) {
+        fprintf(stream, mix[i % MAX_MIX], (int)i);
+        fputc('\n', stream);
+    }
+    fprintf(stream, "echo %s %d\n", MARK, mark);
+    fclose(stream);
+    return text;
+}
+
+/* Writes 'data' into mysh's stdin (unless 'input' is -1) and reads its stdout at the
+same time, so neither side gets stuck on a full pipe, until 'marker' comes out.
+Returns 1 if mysh goes away first */
+int pump(int input, char* data, size_t length, int output, char* marker) {
+
+    static char seen[65536];
+    static size_t kept = 0;
+    size_t marker_length = strlen(marker);
+    size_t written = 0;
+
+    while ( 1 ) {
+        struct pollfd fds[2] = { { output, POLLIN, 0 }, { input, POLLOUT, 0 } };
+        int count = ( input != -1 && written < length ) ? 2 : 1;
+        if ( poll(fds, count, -1) == -1 ) {
+            if ( errno == EINTR ) continue;
+            return 1;
+        }
+
+        if ( count == 2 && fds[1].revents != 0 ) {
+            ssize_t bytes = write(input, data + written, length - written);
+            if ( bytes == -1 && errno != EAGAIN && errno != EINTR ) return 1;
+            if ( bytes > 0 ) written += bytes;
+        }
+
+        if ( fds[0].revents != 0 ) {
+            ssize_t bytes = read(output, seen + kept, sizeof(seen) - 1 - kept);
+            if ( bytes == -1 && errno == EINTR ) continue;
+            if ( bytes <= 0 ) return 1;
+            kept += bytes;
+            seen[kept] = '\0';
+            char* found = memmem(seen, kept, marker, marker_length);
+            if ( found != NULL ) {
+                // Whatever came after the marker belongs to the next one
+                kept -= ( found - seen ) + marker_length;
+                memmove(seen, found + marker_length, kept);
+                return 0;
+            }
+            // Hang on to just enough of the end for a marker that got split in two
+            if ( kept >= marker_length ) {
+                memmove(seen, seen + kept - ( marker_length - 1 ), marker_length - 1);
+                kept = marker_length - 1;
+            }
+        }
+    }
+}
+
+double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* One run. With 'script' NULL the commands stream into stdin, otherwise they all get
+written to 'script' first and mysh runs that. Returns 1 if it grew too much or died */
+int soak(char* mysh, char* script, long commands, long rss_limit, long heap_limit, int fd_limit) {
+
+    long step = commands / SAMPLES;
+    if ( step == 0 ) step = 1;
+
+    if ( script != NULL ) {
+        FILE* file = fopen(script, "w");
+        if ( file == NULL ) {
+            perror("Error writing the script");
+            return 1;
+        }
+        for ( long from = 0, mark = 0; from < commands; from += step, mark++ ) {
+            size_t length;
+            char* text = makeCommands(from, from + step < commands ? from + step : commands, mark, &length);
+            fwrite(text, 1, length, file);
+            free(text);
+        }
+        fclose(file);
+    }
+
+    int input[2], output[2];
+    if ( pipe2(input, O_CLOEXEC) == -1 || pipe2(output, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        perror("fork");
+        return 1;
+    }
+    if ( pid == 0 ) {
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(script == NULL ? input[0] : devnull, STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+        char* argv[] = { mysh, script, NULL };
+        execv(mysh, argv);
+        _exit(127);
+    }
+    close(input[0]);
+    close(output[1]);
+    fcntl(input[1], F_SETFL, O_NONBLOCK);
+    if ( script != NULL ) close(input[1]);
+
+    printf("%s: %ld commands\n", script == NULL ? "stream" : "batch", commands);
+    printf("%12s %10s %10s %6s\n", "commands", "rss-kb", "heap-kb", "fds");
+
+    Sample samples[SAMPLES + 1];
+    int count = 0;
+    int broken = 0;
+    double start = seconds();
+
+    for ( long from = 0, mark = 0; from < commands && broken == 0; from += step, mark++ ) {
+        long to = from + step < commands ? from + step : commands;
+        char marker[64];
+        snprintf(marker, sizeof(marker), "%s %ld\n", MARK, mark);
+
+        size_t length = 0;
+        char* text = ( script == NULL ) ? makeCommands(from, to, mark, &length) : NULL;
+        broken = pump(script == NULL ? input[1] : -1, text, length, output[0], marker);
+        free(text);
+        if ( broken || count > SAMPLES ) continue;
+
+        Sample* sample = &samples[count];
+        sample->commands = to;
+        if ( takeSample(pid, sample) == 1 ) {
+            broken = 1;
+            continue;
+        }
+        printf("%12ld %10ld %10ld %6d\n", sample->commands, sample->rss_kb, sample->heap_kb, sample->fds);
+        fflush(stdout);
+        count++;
+    }
+    double elapsed = seconds() - start;
+
+    // That's everything. mysh leaves when it runs out of input
+    if ( script == NULL ) close(input[1]);
+    char drain[4096];
+    while ( read(output[0], drain, sizeof(drain)) > 0 );
+    close(output[0]);
+    int wstatus = 0;
+    waitpid(pid, &wstatus, 0);
+
+    if ( broken || WIFSIGNALED(wstatus) || count == 0 ) {
+        if ( WIFSIGNALED(wstatus) ) printf("Error: mysh died with signal %d\n", WTERMSIG(wstatus));
+        else printf("Error: mysh stopped before the end of the run\n");
+        return 1;
+    }
+
+    Sample* first = &samples[count > SAMPLES / 10 ? SAMPLES / 10 : 0];
+    Sample* last = &samples[count - 1];
+    long rss = last->rss_kb - first->rss_kb;
+    long heap = last->heap_kb - first->heap_kb;
+    int fds = last->fds - first->fds;
+    int failed = ( rss > rss_limit || heap > heap_limit || fds > fd_limit );
+
+    printf("%.1fs (%.0f commands/s). Since %ld commands: rss %+ld KB, heap %+ld KB, fds %+d: %s\n\n",
+           elapsed, commands / elapsed, first->commands, rss, heap, fds, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(int argc, char* argv[]) {
+
+    long commands = 1000000;
+    long rss_limit = 2048;
+    long heap_limit = 1024;
+    int fd_limit = 0;
+    int option;
+    while ( ( option = getopt(argc, argv, "n:r:m:f:") ) != -1 ) {
+        if ( option == 'n' ) commands = atol(optarg);
+        else if ( option == 'r' ) rss_limit = atol(optarg);
+        else if ( option == 'm' ) heap_limit = atol(optarg);
+        else if ( option == 'f' ) fd_limit = atoi(optarg);
+        else {
+            printf("Usage: soak [-n commands] [-r rss-kb] [-m heap-kb] [-f fds] <mysh>\n");
+            return 2;
+        }
+    }
+    if ( optind + 1 != argc || commands <= 0 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: soak [-n commands] [-r rss-kb] [-m heap-kb] [-f fds] <mysh>\n");
+        return 2;
+    }
+
+    char* mysh = realpath(argv[optind], NULL);
+    if ( mysh == NULL ) {
+        perror("Error finding mysh");
+        return 2;
+    }
+
+    // Somewhere to make a mess
+    char work[] = "/tmp/mysh-soak.XXXXXX";
+    if ( mkdtemp(work) == NULL || chdir(work) == -1 ) {
+        perror("Error making a scratch directory");
+        return 2;
+    }
+    FILE* file = fopen("soak-input.txt", "w");
+    for ( int i = 0; i < 100; i++ ) fprintf(file, "%d\n", ( i * 37 ) % 100);
+    fclose(file);
+    signal(SIGPIPE, SIG_IGN);
+
+    int failed = soak(mysh, NULL, commands, rss_limit, heap_limit, fd_limit);
+    failed |= soak(mysh, "soak.mysh", commands, rss_limit, heap_limit, fd_limit);
+
+    const char* scratch[] = { "soak-input.txt", "soak-count.txt", "soak-out.txt", "soak.mysh" };
+    for ( int i = 0; i < sizeof(scratch) / sizeof(scratch[0]); i++ ) unlink(scratch[i]);
+    rmdir(work);
+    free(mysh);
+    return failed;
+}
@@ -0,0 +1,272 @@
+#ifndef CHARCLASS_H
+#define CHARCLASS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* charclass.h: finds every character mysh cares about in one pass over a line
+
+The helpers in mysh.c used to each walk the line byte by byte, calling strlen() every
+time around the loop while they were at it. Here we look at 64 bytes at a time and
+sort them into classes all at once: pipes, carets, asterisks, slashes, quotes and
+whitespace. The result is a bitmap per class, one bit per byte, so "is there a pipe?"
+and "where's the next caret?" are just a look at a few words.
+
+On x86 the bytes go through SSE2 (or AVX2, when the CPU has it) compares. Everything
+else, or anybody who sets MYSH_CHARCLASS=scalar, gets a plain lookup table */
+
+#if defined(__x86_64__) || ( defined(__i386__) && defined(__SSE2__) )
+#include <immintrin.h>
+#define CHARCLASS_X86 1
+#endif
+
+enum {
+    CLASS_PIPE,     // |
+    CLASS_CARET,    // < and >
+    CLASS_STAR,     // *
+    CLASS_SLASH,    // /
+    CLASS_QUOTE,    // ' and "
+    CLASS_SPACE,    // Whatever isspace() says, in the C locale
+    MAX_CLASSES
+};
+#define CLASS_BIT(class) ( 1u << (class) )
+
+#define CHARCLASS_BLOCK 64      // Bytes per word of each bitmap
+
+typedef struct CharMap {
+    const char* text;           // What the map is of. Nothing here owns it
+    size_t length;
+    size_t blocks;
+    size_t capacity;            // How many blocks 'masks' has room for
+    uint64_t* masks;            // MAX_CLASSES words per block, one for each class
+    unsigned present;           // CLASS_BIT() of every class that shows up at all
+} CharMap;
+
+typedef void (*ClassifyBlock)(const unsigned char* bytes, uint64_t* masks);
+
+/* ===================================================== Scalar */
+
+static unsigned char charclass_table[256] = {
+    ['|'] = CLASS_BIT(CLASS_PIPE),
+    ['<'] = CLASS_BIT(CLASS_CARET),
+    ['>'] = CLASS_BIT(CLASS_CARET),
+    ['*'] = CLASS_BIT(CLASS_STAR),
+    ['/'] = CLASS_BIT(CLASS_SLASH),
+    ['\''] = CLASS_BIT(CLASS_QUOTE),
+    ['"'] = CLASS_BIT(CLASS_QUOTE),
+    [' '] = CLASS_BIT(CLASS_SPACE),
+    ['\t'] = CLASS_BIT(CLASS_SPACE),
+    ['\n'] = CLASS_BIT(CLASS_SPACE),
+    ['\v'] = CLASS_BIT(CLASS_SPACE),
+    ['\f'] = CLASS_BIT(CLASS_SPACE),
+    ['\r'] = CLASS_BIT(CLASS_SPACE),
+};
+
+static void classifyScalar(const unsigned char* bytes, uint64_t* masks) {
+    for ( int class = 0; class < MAX_CLASSES; class++ ) masks[class] = 0;
+    for ( int i = 0; i < CHARCLASS_BLOCK; i++ ) {
+        unsigned classes = charclass_table[bytes[i]];
+        while ( classes != 0 ) {
+            int class = __builtin_ctz(classes);
+            masks[class] |= (uint64_t)1 << i;
+            classes &= classes - 1;
+        }
+    }
+}
+
+#ifdef CHARCLASS_X86
+
+/* ===================================================== SSE2 */
+
+static void classifySSE2(const unsigned char* bytes, uint64_t* masks) {
+    for ( int class = 0; class < MAX_CLASSES; class++ ) masks[class] = 0;
+
+    for ( int chunk = 0; chunk < CHARCLASS_BLOCK / 16; chunk++ ) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(bytes + chunk * 16));
+        int shift = chunk * 16;
+
+        // Whitespace is ' ', plus '\t' through '\r' (9 to 13), which we check as x - 9 <= 4
+        __m128i shifted = _mm_sub_epi8(x, _mm_set1_epi8(9));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+
+        __m128i found[MAX_CLASSES];
+        found[CLASS_PIPE] = _mm_cmpeq_epi8(x, _mm_set1_epi8('|'));
+        found[CLASS_CARET] = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('<')),
+                                          _mm_cmpeq_epi8(x, _mm_set1_epi8('>')));
+        found[CLASS_STAR] = _mm_cmpeq_epi8(x, _mm_set1_epi8('*'));
+        found[CLASS_SLASH] = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+        found[CLASS_QUOTE] = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\'')),
+                                          _mm_cmpeq_epi8(x, _mm_set1_epi8('"')));
+        found[CLASS_SPACE] = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), control);
+
+        for ( int class = 0; class < MAX_CLASSES; class++ ) {
+            masks[class] |= (uint64_t)(uint16_t)_mm_movemask_epi8(found[class]) << shift;
+        }
+    }
+}
+
+/* ===================================================== AVX2 */
+
+__attribute__((target("avx2")))
+static void classifyAVX2(const unsigned char* bytes, uint64_t* masks) {
+    for ( int class = 0; class < MAX_CLASSES; class++ ) masks[class] = 0;
+
+    for ( int chunk = 0; chunk < CHARCLASS_BLOCK / 32; chunk++ ) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(bytes + chunk * 32));
+        int shift = chunk * 32;
+
+        __m256i shifted = _mm256_sub_epi8(x, _mm256_set1_epi8(9));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted);
+
+        __m256i found[MAX_CLASSES];
+        found[CLASS_PIPE] = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('|'));
+        found[CLASS_CARET] = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('<')),
+                                             _mm256_cmpeq_epi8(x, _mm256_set1_epi8('>')));
+        found[CLASS_STAR] = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('*'));
+        found[CLASS_SLASH] = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('/'));
+        found[CLASS_QUOTE] = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\'')),
+                                             _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')));
+        found[CLASS_SPACE] = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), control);
+
+        for ( int class = 0; class < MAX_CLASSES; class++ ) {
+            masks[class] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(found[class]) << shift;
+        }
+    }
+}
+
+#endif
+
+/* ===================================================== Picking one */
+
+static ClassifyBlock charclass_kernel = NULL;
+
+/* Which kernel we're using, for the benchmark's sake */
+static const char* charclass_kernel_name = "none yet";
+
+/* Picks the fastest kernel this CPU has, unless MYSH_CHARCLASS says otherwise. Threads
+can race to be first here (libmysh runs several shells at once), but they all pick the
+same one, and the atomics keep the compiler from tearing anything */
+static ClassifyBlock classifyKernel() {
+    ClassifyBlock kernel = __atomic_load_n(&charclass_kernel, __ATOMIC_ACQUIRE);
+    if ( kernel != NULL ) return kernel;
+
+    const char* wanted = getenv("MYSH_CHARCLASS");
+    const char* name = "scalar";
+    kernel = classifyScalar;
+#ifdef CHARCLASS_X86
+    if ( wanted == NULL || strcmp(wanted, "scalar") != 0 ) {
+        kernel = classifySSE2;
+        name = "sse2";
+        __builtin_cpu_init();
+        if ( ( wanted == NULL || strcmp(wanted, "avx2") == 0 ) && __builtin_cpu_supports("avx2") ) {
+            kernel = classifyAVX2;
+            name = "avx2";
+        }
+    }
+#else
+    (void)wanted;
+#endif
+    __atomic_store_n(&charclass_kernel_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&charclass_kernel, kernel, __ATOMIC_RELEASE);
+    return kernel;
+}
+
+/* Runs 'kernel' over block number 'block' of 'text'. The last block is usually short, so
+it gets copied into a zeroed buffer first, rather than reading past the end of 'text' */
+static inline void classifyAt(ClassifyBlock kernel, const char* text, size_t length,
+                              size_t block, uint64_t* masks) {
+    size_t start = block * CHARCLASS_BLOCK;
+    if ( length - start >= CHARCLASS_BLOCK ) {
+        kernel((const unsigned char*)text + start, masks);
+        return;
+    }
+    unsigned char tail[CHARCLASS_BLOCK];
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, text + start, length - start);
+    kernel(tail, masks);
+}
+
+/* ===================================================== The API */
+
+/* Returns the CLASS_BIT() of every class found in the first 'length' bytes of 'text',
+without keeping any of the positions around */
+static inline unsigned charClasses(const char* text, size_t length) {
+    ClassifyBlock kernel = classifyKernel();
+    uint64_t any[MAX_CLASSES] = { 0 };
+    uint64_t masks[MAX_CLASSES];
+    size_t blocks = ( length + CHARCLASS_BLOCK - 1 ) / CHARCLASS_BLOCK;
+    for ( size_t block = 0; block < blocks; block++ ) {
+        classifyAt(kernel, text, length, block, masks);
+        for ( int class = 0; class < MAX_CLASSES; class++ ) any[class] |= masks[class];
+    }
+    unsigned present = 0;
+    for ( int class = 0; class < MAX_CLASSES; class++ ) {
+        if ( any[class] != 0 ) present |= CLASS_BIT(class);
+    }
+    return present;
+}
+
+/* Maps out the first 'length' bytes of 'text'. The map's memory gets reused from one
+call to the next, so build into the same CharMap over and over */
+static inline void charMapBuild(CharMap* map, const char* text, size_t length) {
+    ClassifyBlock kernel = classifyKernel();
+    size_t blocks = ( length + CHARCLASS_BLOCK - 1 ) / CHARCLASS_BLOCK;
+    if ( blocks > map->capacity ) {
+        free(map->masks);
+        map->capacity = blocks * 2;
+        map->masks = (uint64_t*)malloc(map->capacity * MAX_CLASSES * sizeof(uint64_t));
+    }
+    map->text = text;
+    map->length = length;
+    map->blocks = blocks;
+
+    uint64_t present[MAX_CLASSES] = { 0 };
+    for ( size_t block = 0; block < blocks; block++ ) {
+        uint64_t* masks = &map->masks[block * MAX_CLASSES];
+        classifyAt(kernel, text, length, block, masks);
+        for ( int class = 0; class < MAX_CLASSES; class++ ) present[class] |= masks[class];
+    }
+    map->present = 0;
+    for ( int class = 0; class < MAX_CLASSES; class++ ) {
+        if ( present[class] != 0 ) map->present |= CLASS_BIT(class);
+    }
+}
+
+/* Returns the index of the first byte at or after 'from' that's in any of 'classes'
+(a CLASS_BIT() or a few of them or'd together), or the map's length if there isn't one */
+static inline size_t charMapNext(const CharMap* map, unsigned classes, size_t from) {
+    if ( ( map->present & classes ) == 0 ) return map->length;
+    for ( size_t block = from / CHARCLASS_BLOCK; block < map->blocks; block++ ) {
+        const uint64_t* masks = &map->masks[block * MAX_CLASSES];
+        uint64_t bits = 0;
+        for ( int class = 0; class < MAX_CLASSES; class++ ) {
+            if ( classes & CLASS_BIT(class) ) bits |= masks[class];
+        }
+        if ( block == from / CHARCLASS_BLOCK ) bits &= ~(uint64_t)0 << ( from % CHARCLASS_BLOCK );
+        if ( bits != 0 ) return block * CHARCLASS_BLOCK + __builtin_ctzll(bits);
+    }
+    return map->length;
+}
+
+/* How many bytes are in any of 'classes' */
+static inline size_t charMapCount(const CharMap* map, unsigned classes) {
+    if ( ( map->present & classes ) == 0 ) return 0;
+    size_t count = 0;
+    for ( size_t block = 0; block < map->blocks; block++ ) {
+        const uint64_t* masks = &map->masks[block * MAX_CLASSES];
+        uint64_t bits = 0;
+        for ( int class = 0; class < MAX_CLASSES; class++ ) {
+            if ( classes & CLASS_BIT(class) ) bits |= masks[class];
+        }
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+static inline void charMapFree(CharMap* map) {
+    free(map->masks);
+    memset(map, 0, sizeof(*map));
+}
+
+#endif
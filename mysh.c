@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     // For splice() and F_SETPIPE_SZ
+
 #include <unistd.h>     // Unix standard library
 #include <stdlib.h>     // C standard library
 #include <stdio.h>      // Standard input and output
@@ -10,16 +12,493 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <glob.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <elf.h>
+
+#include "charclass.h"  // The one pass over a line that finds all the |, <, > and friends
+#include "mysh.h"       // What libmysh hands out. The mysh program is built from this file too
 
 #define BUFFSIZE 5012
 
-char* line;
-char** tokens;
-char** arguments;
+/* Everything a running shell keeps to itself is per thread. The mysh program only ever has
+the one, but a program using libmysh can run a context on each of its threads at once
+(see the Library section at the bottom) */
+#define MYSH_LOCAL __thread
+
+/* Where this shell's programs read and write when nothing on the line says otherwise, and
+where our own messages go. Always 0, 1 and 2 in the mysh program. libmysh points them at
+the files it captures a call's output in */
+MYSH_LOCAL int shell_fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+MYSH_LOCAL int embedded = 0;    // Set while libmysh is running something on this thread
+MYSH_LOCAL int leaving = 0;     // Set by 'exit' when there's a libmysh caller to go back to
+
+#define printf(...) ( shell_fds[1] == STDOUT_FILENO ? printf(__VA_ARGS__) \
+                    : dprintf(shell_fds[1], __VA_ARGS__) )
+#define perror(message) ( shell_fds[2] == STDERR_FILENO ? perror(message) \
+                        : (void)dprintf(shell_fds[2], "%s: %s\n", message, strerror(errno)) )
+
+MYSH_LOCAL char* line;
+MYSH_LOCAL char** tokens;
+MYSH_LOCAL char** arguments;
+
+MYSH_LOCAL int MAX_TOKENS;
+MYSH_LOCAL int MAX_ARGUMENTS;
+MYSH_LOCAL int exit_status = -1;
+MYSH_LOCAL int unsorted_glob = 0;  // Set by the 'nosort' prefix for the current command only
+MYSH_LOCAL int input_ended = 0;    // Set once readInput() runs out, and hands back an 'exit' of its own
+
+MYSH_LOCAL int* substitution_fds = NULL;   // Our ends of the process substitution pipes
+MYSH_LOCAL pid_t* substitution_pids = NULL;
+MYSH_LOCAL int MAX_SUBSTITUTIONS = 0;
+MYSH_LOCAL int substitution_base = 0;      // Where the current line's own substitutions start
+MYSH_LOCAL char* heredoc_command = NULL;   // The line that started the here-document we're still reading
+
+MYSH_LOCAL char** command_substitutions = NULL;    // The $(cmd) commands we pulled out of the line, in order
+MYSH_LOCAL int MAX_COMMAND_SUBSTITUTIONS = 0;
+
+/* ============================================================ */
+// Statistics //
+
+/* Counts every malloc, realloc and syscall the shell makes itself, split up by what the
+shell was busy with at the time. 'mysh --stats' prints them after every command, and
+the 'stats' builtin prints the totals for the whole session. Anything libc does on its
+own behalf (inside glob() or printf(), say) doesn't show up here */
+
+enum { PHASE_OTHER, PHASE_READ, PHASE_LEX, PHASE_GLOB, PHASE_RESOLVE, PHASE_SPAWN, PHASE_WAIT, 
+       PHASE_REAP, MAX_PHASES };
+char* phase_names[] = { "other", "read", "lex", "glob", "resolve", "spawn", "wait", "reap" };
+
+typedef struct PhaseStats {
+    unsigned long mallocs;      // malloc, calloc and strdup
+    unsigned long reallocs;
+    unsigned long bytes;        // Bytes asked for by all of the above
+    unsigned long syscalls;
+} PhaseStats;
+
+MYSH_LOCAL PhaseStats session_stats[MAX_PHASES];
+MYSH_LOCAL PhaseStats command_start[MAX_PHASES];   // session_stats when the current command started
+MYSH_LOCAL int stat_phase = PHASE_OTHER;
+int show_stats = 0;                     // Set by --stats
+
+void tracePush();            // Down in Tracing
+void tracePop(int phase);
+
+/* Switches to 'phase' and returns the phase we were in, so it can be put back afterwards */
+int enterPhase(int phase) {
+    int previous = stat_phase;
+    stat_phase = phase;
+    tracePush();
+    return previous;
+}
+
+/* Goes back to the 'previous' phase and hands 'result' straight back, for return statements */
+int leavePhase(int previous, int result) {
+    tracePop(stat_phase);
+    stat_phase = previous;
+    return result;
+}
+
+void countSyscall() {
+    session_stats[stat_phase].syscalls++;
+}
+
+void* statMalloc(size_t size) {
+    session_stats[stat_phase].mallocs++;
+    session_stats[stat_phase].bytes += size;
+    return malloc(size);
+}
+
+void* statCalloc(size_t count, size_t size) {
+    session_stats[stat_phase].mallocs++;
+    session_stats[stat_phase].bytes += count * size;
+    return calloc(count, size);
+}
+
+void* statRealloc(void* pointer, size_t size) {
+    session_stats[stat_phase].reallocs++;
+    session_stats[stat_phase].bytes += size;
+    return realloc(pointer, size);
+}
+
+char* statStrdup(const char* string) {
+    session_stats[stat_phase].mallocs++;
+    session_stats[stat_phase].bytes += strlen(string) + 1;
+    return strdup(string);
+}
+
+/* From here on down, every call goes through the counters */
+#define malloc(size) statMalloc(size)
+#define calloc(count, size) statCalloc(count, size)
+#define realloc(pointer, size) statRealloc(pointer, size)
+#define strdup(string) statStrdup(string)
+
+#define access(...) (countSyscall(), access(__VA_ARGS__))
+#define chdir(...) (countSyscall(), chdir(__VA_ARGS__))
+#define getcwd(...) (countSyscall(), getcwd(__VA_ARGS__))
+#define open(...) (countSyscall(), open(__VA_ARGS__))
+#define close(...) (countSyscall(), close(__VA_ARGS__))
+#define read(...) (countSyscall(), read(__VA_ARGS__))
+#define write(...) (countSyscall(), write(__VA_ARGS__))
+#define stat(...) (countSyscall(), stat(__VA_ARGS__))
+#define dup(...) (countSyscall(), dup(__VA_ARGS__))
+#define dup2(...) (countSyscall(), dup2(__VA_ARGS__))
+#define pipe(...) (countSyscall(), pipe(__VA_ARGS__))
+#define pipe2(...) (countSyscall(), pipe2(__VA_ARGS__))
+#define fcntl(...) (countSyscall(), fcntl(__VA_ARGS__))
+#define fork(...) (countSyscall(), fork(__VA_ARGS__))
+#define execv(...) (countSyscall(), execv(__VA_ARGS__))
+#define execve(...) (countSyscall(), execve(__VA_ARGS__))
+#define waitpid(...) (countSyscall(), waitpid(__VA_ARGS__))
+#define opendir(...) (countSyscall(), opendir(__VA_ARGS__))
+#define closedir(...) (countSyscall(), closedir(__VA_ARGS__))
+#define splice(...) (countSyscall(), splice(__VA_ARGS__))
+#define tee(...) (countSyscall(), tee(__VA_ARGS__))
+#define poll(...) (countSyscall(), poll(__VA_ARGS__))
+#define sendmsg(...) (countSyscall(), sendmsg(__VA_ARGS__))
+#define recvmsg(...) (countSyscall(), recvmsg(__VA_ARGS__))
+#define socketpair(...) (countSyscall(), socketpair(__VA_ARGS__))
+#define memfd_create(...) (countSyscall(), memfd_create(__VA_ARGS__))
+#define mmap(...) (countSyscall(), mmap(__VA_ARGS__))
+#define munmap(...) (countSyscall(), munmap(__VA_ARGS__))
+#define sendfile(...) (countSyscall(), sendfile(__VA_ARGS__))
+#define unlink(...) (countSyscall(), unlink(__VA_ARGS__))
+#define rename(...) (countSyscall(), rename(__VA_ARGS__))
+#define mkdir(...) (countSyscall(), mkdir(__VA_ARGS__))
+
+/* Prints a table of 'stats' with a line for each phase and one for the total */
+void printStats(FILE* stream, char* title, PhaseStats* stats) {
+    PhaseStats total = { 0, 0, 0, 0 };
+    fprintf(stream, "%-24.24s %10s %10s %12s %10s\n", title, "mallocs", "reallocs", "bytes", "syscalls");
+    for ( int i = 0; i < MAX_PHASES; i++ ) {
+        fprintf(stream, "  %-22s %10lu %10lu %12lu %10lu\n", phase_names[i], stats[i].mallocs, 
+                stats[i].reallocs, stats[i].bytes, stats[i].syscalls);
+        total.mallocs += stats[i].mallocs;
+        total.reallocs += stats[i].reallocs;
+        total.bytes += stats[i].bytes;
+        total.syscalls += stats[i].syscalls;
+    }
+    fprintf(stream, "  %-22s %10lu %10lu %12lu %10lu\n", "total", total.mallocs, 
+            total.reallocs, total.bytes, total.syscalls);
+}
+
+/* Call these two around each command the user types */
+void commandStatsStart() {
+    memcpy(command_start, session_stats, sizeof(session_stats));
+}
+
+void commandStatsEnd(char* command) {
+    if ( show_stats == 0 ) return;
+    PhaseStats delta[MAX_PHASES];
+    for ( int i = 0; i < MAX_PHASES; i++ ) {
+        delta[i].mallocs = session_stats[i].mallocs - command_start[i].mallocs;
+        delta[i].reallocs = session_stats[i].reallocs - command_start[i].reallocs;
+        delta[i].bytes = session_stats[i].bytes - command_start[i].bytes;
+        delta[i].syscalls = session_stats[i].syscalls - command_start[i].syscalls;
+    }
+    fflush(stdout);     // So the table lands after whatever the command printed
+    printStats(stderr, command, delta);
+}
+
+/* stats [reset] */
+int statsCommand() {
+    if ( MAX_TOKENS > 2 || ( MAX_TOKENS == 2 && strcmp(tokens[1], "reset") != 0 ) ) {
+        printf("Error: Unexpected arguments\n");
+        printf("Usage: stats [reset]\n");
+        return 1;
+    }
+    if ( MAX_TOKENS == 2 ) {
+        memset(session_stats, 0, sizeof(session_stats));
+        memset(command_start, 0, sizeof(command_start));
+        return 0;
+    }
+    printStats(stdout, "session", session_stats);
+    return 0;
+}
+
+
+/* ============================================================ */
+// Tracing //
+
+/* 'mysh --trace FILE' writes a Chrome trace (the JSON array format, which loads straight
+into chrome://tracing or Perfetto) with one event for every phase of every line, tagged
+with the line number. Each program we start gets an "exec" event of its own, on a track
+named after its pid, lasting from the moment it was spawned until we reaped it.
+
+While a line runs, an event is just two clock reads and a fixed-size record in a buffer.
+On x86 the clock is the CPU's own timestamp counter, which is about half the price of
+clock_gettime(). Once the buffer fills up, the whole lot becomes JSON in one go and goes
+into FILE with one write(), and a fresh reading of both clocks at that point is what
+turns the ticks into microseconds. A phase that starts again right where it left off
+stays one event. The closing ']' goes on at exit, and trace viewers are fine without it
+if we never get there */
+
+#define TRACE_RECORDS 4096     // Records per write()
+#define MAX_TRACE_DEPTH 32
+#define TRACE_EVENT_SIZE 256   // Plenty for one event's JSON
+
+int writeFully(int fd, const void* buffer, size_t length);     // Down in Spawning Programs
+
+char* trace_names[] = { "other", "read", "lex", "glob", "resolve", "fork", "wait", "reap", "exec" };
+#define TRACE_EXEC 8   // Not a phase, just an extra name for programs we ran
+#define MAX_TRACE_NAMES 9
+
+typedef struct TraceRecord {
+    long long start;        // traceNow() ticks
+    long long end;
+    int name;               // Index into trace_names
+    pid_t tid;
+    int line;
+    char program[36];       // Exec events only
+} TraceRecord;
+
+typedef struct TraceChild {
+    pid_t pid;
+    long long start;
+    int line;
+    char program[36];
+} TraceChild;
+
+int trace_fd = -1;              // The trace file
+pid_t trace_pid = 0;
+int trace_line = 0;             // Which line of the script (or which command) we're on
+MYSH_LOCAL int untraced = 0;    // Set on threads the trace doesn't follow, like --prefetch's
+TraceRecord* trace_records = NULL;
+int trace_count = 0;
+char* trace_json = NULL;        // Where a full buffer of records becomes text
+long long trace_events = 0;     // How many have gone into the file so far
+long long trace_start_ticks;    // traceNow() when the trace started
+long long trace_start_nanoseconds;          // and the monotonic clock at the same moment
+long long trace_merge_ticks = 0;            // Gaps shorter than this (100ns) don't split an event
+char* trace_prefixes[MAX_TRACE_NAMES];      // Everything up to "ts" for the shell's own events
+size_t trace_prefix_lengths[MAX_TRACE_NAMES];
+long long trace_starts[MAX_TRACE_DEPTH];    // When each phase we're inside of began
+int trace_depth = 0;
+TraceChild* trace_children = NULL;          // Programs we started and haven't reaped yet
+int MAX_TRACE_CHILDREN = 0;
+
+long long traceNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Ticks. The CPU's timestamp counter on x86, nanoseconds anywhere else */
+long long traceNow() {
+#ifdef CHARCLASS_X86
+    return __rdtsc();
+#else
+    return traceNanoseconds();
+#endif
+}
+
+/* printf() is slow enough to matter at a few events per line, so the JSON gets put together
+by hand with these. Each one writes at 'at' and returns where it left off */
+char* traceAppend(char* at, const char* text, size_t length) {
+    memcpy(at, text, length);
+    return at + length;
+}
+#define TRACE_APPEND(at, text) traceAppend(at, text, sizeof(text) - 1)
+
+/* Appends 'value' as a number. With 'decimals' set, the last three digits go after a point,
+which turns our nanoseconds into the microseconds trace viewers expect. Two digits at a
+time, since there are three numbers in every event and this is most of the work */
+char* traceNumber(char* at, long long value, int decimals) {
+    static const char pairs[] = 
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[32];
+    char* end = digits + sizeof(digits);
+    char* first = end;      // They go in backwards
+    unsigned long long left = ( value < 0 ) ? 0 : value;
+
+    if ( decimals ) {
+        unsigned int fraction = left % 1000;
+        left /= 1000;
+        *--first = '0' + fraction % 10;
+        first -= 2;
+        memcpy(first, pairs + ( fraction / 10 ) * 2, 2);
+        *--first = '.';
+    }
+    while ( left >= 100 ) {
+        first -= 2;
+        memcpy(first, pairs + ( left % 100 ) * 2, 2);
+        left /= 100;
+    }
+    if ( left >= 10 ) {
+        first -= 2;
+        memcpy(first, pairs + left * 2, 2);
+    } else {
+        *--first = '0' + left;
+    }
+    return traceAppend(at, first, end - first);
+}
+
+/* Turns the buffered records into JSON and writes them out */
+void traceFlush() {
+    if ( trace_fd == -1 || trace_count == 0 ) return;
+
+    // How many nanoseconds a tick has been worth since the trace started
+    long long ticks = traceNow() - trace_start_ticks;
+    double scale = ( ticks > 0 ) ? (double)( traceNanoseconds() - trace_start_nanoseconds ) / ticks : 1;
+
+    char* at = trace_json;
+    for ( int i = 0; i < trace_count; i++ ) {
+        TraceRecord* record = &trace_records[i];
+        if ( trace_events++ > 0 ) at = TRACE_APPEND(at, ",\n");
+        if ( record->name == TRACE_EXEC ) {
+            at = TRACE_APPEND(at, "{\"name\":\"exec\",\"ph\":\"X\",\"pid\":");
+            at = traceNumber(at, trace_pid, 0);
+            at = TRACE_APPEND(at, ",\"tid\":");
+            at = traceNumber(at, record->tid, 0);
+            at = TRACE_APPEND(at, ",\"ts\":");
+        } else {
+            at = traceAppend(at, trace_prefixes[record->name], trace_prefix_lengths[record->name]);
+        }
+        at = traceNumber(at, ( record->start - trace_start_ticks ) * scale, 1);
+        at = TRACE_APPEND(at, ",\"dur\":");
+        at = traceNumber(at, ( record->end - record->start ) * scale, 1);
+        at = TRACE_APPEND(at, ",\"args\":{\"line\":");
+        at = traceNumber(at, record->line, 0);
+        if ( record->name == TRACE_EXEC ) {
+            at = TRACE_APPEND(at, ",\"program\":\"");
+            at = traceAppend(at, record->program, strlen(record->program));
+            at = TRACE_APPEND(at, "\"");
+        }
+        at = TRACE_APPEND(at, "}}");
+    }
+    if ( writeFully(trace_fd, trace_json, at - trace_json) == 1 ) perror("trace");
+    trace_count = 0;
+}
+
+/* Writes out the last of the events and closes the array. Runs at exit */
+void traceFinish() {
+    if ( trace_fd == -1 ) return;
+    traceFlush();
+    if ( writeFully(trace_fd, "\n]\n", 3) == 1 ) perror("trace");
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+/* Starts a trace file at 'path' */
+int traceOpen(const char* path) {
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( trace_fd == -1 ) {
+        perror("Error opening trace file");
+        return 1;
+    }
+    if ( writeFully(trace_fd, "[\n", 2) == 1 ) {
+        perror("trace");
+        close(trace_fd);
+        trace_fd = -1;
+        return 1;
+    }
+
+    trace_pid = getpid();
+    trace_start_ticks = traceNow();
+    trace_start_nanoseconds = traceNanoseconds();
+
+    // What 100ns comes to in ticks. 20us is long enough to tell
+    while ( traceNanoseconds() - trace_start_nanoseconds < 20000 );
+    trace_merge_ticks = ( traceNow() - trace_start_ticks ) / 200;
+
+    // The shell's own events all start the same way, so that part only gets written once
+    for ( int i = 0; i < MAX_TRACE_NAMES; i++ ) {
+        char prefix[128];
+        snprintf(prefix, sizeof(prefix), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":", 
+                 trace_names[i], (int)trace_pid, (int)trace_pid);
+        trace_prefixes[i] = strdup(prefix);
+        trace_prefix_lengths[i] = strlen(prefix);
+    }
+    trace_records = malloc(TRACE_RECORDS * sizeof(TraceRecord));
+    trace_json = malloc(TRACE_RECORDS * TRACE_EVENT_SIZE);
+    atexit(traceFinish);
+    return 0;
+}
+
+/* Adds one event. 'program' is NULL for everything but exec events */
+void traceEvent(int name, long long start, long long end, pid_t tid, int lineNumber, char* program) {
+
+    // A phase that picks up right where it left off stays one event
+    if ( trace_count > 0 && program == NULL ) {
+        TraceRecord* last = &trace_records[trace_count - 1];
+        if ( last->name == name && last->tid == tid && last->line == lineNumber 
+          && start >= last->end && start - last->end < trace_merge_ticks ) {
+            last->end = end;
+            return;
+        }
+    }
+
+    TraceRecord* record = &trace_records[trace_count];
+    record->start = start;
+    record->end = end;
+    record->name = name;
+    record->tid = tid;
+    record->line = lineNumber;
+
+    if ( program != NULL ) memcpy(record->program, program, sizeof(record->program));
+
+    if ( ++trace_count == TRACE_RECORDS ) traceFlush();
+}
+
+/* enterPhase() and leavePhase() call these, so every phase turns into an event */
+void tracePush() {
+    if ( untraced || trace_fd == -1 ) return;
+    if ( trace_depth < MAX_TRACE_DEPTH ) trace_starts[trace_depth] = traceNow();
+    trace_depth++;
+}
+
+void tracePop(int phase) {
+    if ( untraced || trace_fd == -1 || trace_depth == 0 ) return;
+    trace_depth--;
+    if ( trace_depth < MAX_TRACE_DEPTH ) {
+        traceEvent(phase, trace_starts[trace_depth], traceNow(), trace_pid, trace_line, NULL);
+    }
+}
+
+/* Remembers when 'pid' started running 'path', so we can give it an exec event once it's reaped */
+void traceSpawned(pid_t pid, char* path) {
+    if ( trace_fd == -1 || pid <= 0 ) return;
+
+    MAX_TRACE_CHILDREN++;
+    trace_children = realloc(trace_children, MAX_TRACE_CHILDREN * sizeof(TraceChild));
+    TraceChild* child = &trace_children[MAX_TRACE_CHILDREN - 1];
+    child->pid = pid;
+    child->start = traceNow();
+    child->line = trace_line;
+
+    // Just the program's name, and nothing that would need escaping in JSON
+    char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    memset(child->program, 0, sizeof(child->program));
+    for ( int i = 0; name[i] != '\0' && i < (int)sizeof(child->program) - 1; i++ ) {
+        child->program[i] = ( name[i] == '"' || name[i] == '\\' || iscntrl(name[i]) ) ? '?' : name[i];
+    }
+}
+
+void traceReaped(pid_t pid) {
+    if ( trace_fd == -1 || pid <= 0 ) return;
+
+    for ( int i = 0; i < MAX_TRACE_CHILDREN; i++ ) {
+        if ( trace_children[i].pid != pid ) continue;
+        TraceChild* child = &trace_children[i];
+        traceEvent(TRACE_EXEC, child->start, traceNow(), pid, child->line, child->program);
+        trace_children[i] = trace_children[--MAX_TRACE_CHILDREN];
+        return;
+    }
+}
 
-int MAX_TOKENS;
-int MAX_ARGUMENTS;
-int exit_status = -1;
 
 void startup() {
 
@@ -34,35 +513,40 @@ void startup() {
 /* ============================================================ */
 // Miscellaneous Helper Functions //
 
+/* Where the pipes, carets and so on are in 'line'. It gets built the first time somebody
+asks about a line, and every question after that about the same line is free. Anything
+that frees or rewrites 'line' has to call forgetLineMap() */
+MYSH_LOCAL CharMap line_map;
+
+CharMap* lineMap() {
+    if ( line_map.text != line ) charMapBuild(&line_map, line, strlen(line));
+    return &line_map;
+}
+
+void forgetLineMap() {
+    line_map.text = NULL;
+}
+
 /* Returns 0 if the line contains a pipe, and 1 otherwise */
 int hasPipe() {
-    for ( int i = 0; i < strlen(line); i++ ) {
-        if ( line[i] == '|' ) {
-            return 0;
-        }
-    }
-    return 1;
+    return ( lineMap()->present & CLASS_BIT(CLASS_PIPE) ) ? 0 : 1;
 }
 
 /* Returns 0 if the line contains a caret, and 1 otherwise */
 int hasCaret() {
-    for ( int i = 0; i < strlen(line); i++ ) {
-        if ( line[i] == '<' || line[i] == '>' ) {
-            return 0;
-        }
-    }
-    return 1;
+    return ( lineMap()->present & CLASS_BIT(CLASS_CARET) ) ? 0 : 1;
 }
 
 /* Returns 0 if the the token contains a slash, and 1 otherwise */
 int hasSlash(char* token) {
-    for ( int i = 0; i < strlen(token); i++ ) {
-        if ( token[i] == '/' )
-        return 0;
-    }
-    return 1;
+    return ( charClasses(token, strlen(token)) & CLASS_BIT(CLASS_SLASH) ) ? 0 : 1;
 } 
 
+/* Returns 1 if the token is a pipe symbol: a plain pipe, or a metered pipe "|!" */
+int isPipeSymbol(char* token) {
+    return strcmp(token, "|") == 0 || strcmp(token, "|!") == 0;
+}
+
 int caretCounter() {
     int count = 0;
     for ( int i = 0; i < MAX_TOKENS; i++ ) {
@@ -75,7 +559,7 @@ int caretCounter() {
 int pipeCounter() {
     int count = 0;
     for ( int i = 0; i < MAX_TOKENS; i++ ) {
-        if ( strcmp(tokens[i], "|") == 0 )
+        if ( isPipeSymbol(tokens[i]) )
         count++;
     }
     return count;
@@ -83,12 +567,16 @@ int pipeCounter() {
 
 // Return 1 if the input is just all spaces, and 0 if a letter or symbol is found
 int ifAllSpaces() {
-    for (int i = 0; i < strlen(line); i++) {
-        if (isspace(line[i]) == 0) {
-            return 0;
-        }
-    }
-    return 1;
+    size_t length = strlen(line);
+    if ( length == 0 ) return 1;
+
+    // Cheap check first: most lines start with something that isn't a space
+    if ( isspace(line[0]) == 0 ) return 0;
+    CharMap map = { 0 };
+    charMapBuild(&map, line, length);
+    int allSpaces = ( charMapCount(&map, CLASS_BIT(CLASS_SPACE)) == length );
+    charMapFree(&map);
+    return allSpaces;
 }
 
 void countTokens() {
@@ -98,39 +586,74 @@ void countTokens() {
     char lineCopy[strlen(line) + 1];
     memcpy(lineCopy, line, strlen(line) + 1);
 
-    // Get the first token
-    token = strtok(lineCopy, " ");
+    // Get the first token. strtok_r(), since another thread might be tokenizing too
+    char* rest = NULL;
+    token = strtok_r(lineCopy, " ", &rest);
 
     // Walk through other tokens
     while ( token != 0 ) {
         count++;
-        token = strtok(0, " ");
+        token = strtok_r(0, " ", &rest);
     }
 
     MAX_TOKENS = count;
     return;
 }
 
-void addToArguments(char* file_match) {
+/* Opens up 'count' empty slots in 'tokens' starting at 'insertionPoint'. It's one resize
+and one shift no matter how many slots we need, and the caller fills them in afterwards.
+Returns 1 if we ran out of memory */
+int makeRoomForTokens(int insertionPoint, size_t count) {
 
-    MAX_ARGUMENTS++;
+    char** resized = (char**)realloc(tokens, (MAX_TOKENS + count) * sizeof(char*));
+    if ( resized == NULL ) {
+        printf("Memory allocation failed for new string.\n");
+        return 1;
+    }
+    tokens = resized;
 
-    if ( arguments == NULL ) {   // If 'arguments' has not been initialized yet
+    // Shift the later tokens to the right, all at once
+    memmove(&tokens[insertionPoint + count], &tokens[insertionPoint], 
+            (MAX_TOKENS - insertionPoint) * sizeof(char*));
+    MAX_TOKENS += count;
+    return 0;
+}
 
-        arguments = (char**)malloc(1 * sizeof(char *));
-        arguments[0] = (char*)malloc((strlen(file_match) + 1) * sizeof(char));
-        arguments[0][strlen(file_match)] = '\0';
-        strcpy(arguments[0], file_match);
+/* 'arguments' grows in powers of two, so a list with hundreds of thousands of arguments
+takes a couple dozen reallocs instead of one per argument. Call this right after bumping
+MAX_ARGUMENTS */
+void growArguments() {
 
-    } else {    // Otherwise, tack on the new argument to the end
+    size_t before = 0;
+    size_t after = 8;
+    while ( before < MAX_ARGUMENTS - 1 ) before = before ? before * 2 : 8;
+    while ( after < MAX_ARGUMENTS ) after *= 2;
 
-        arguments = (char**)realloc(arguments, (MAX_ARGUMENTS * sizeof(char*)));
-        arguments[MAX_ARGUMENTS - 1] = (char*)malloc((strlen(file_match) + 1) * sizeof(char));
-        arguments[MAX_ARGUMENTS - 1][strlen(file_match)] = '\0';
-        strcpy(arguments[MAX_ARGUMENTS - 1], file_match);
+    if ( MAX_ARGUMENTS == 1 || after != before ) {
+        arguments = (char**)realloc(arguments, after * sizeof(char*));
     }
 }
 
+void addToArguments(char* file_match) {
+
+    MAX_ARGUMENTS++;
+    growArguments();
+
+    // Tack on the new argument to the end
+    arguments[MAX_ARGUMENTS - 1] = (char*)malloc((strlen(file_match) + 1) * sizeof(char));
+    arguments[MAX_ARGUMENTS - 1][strlen(file_match)] = '\0';
+    strcpy(arguments[MAX_ARGUMENTS - 1], file_match);
+}
+
+/* Done with 'arguments'. Every list gets built from scratch, so whoever builds one has to
+call this before the next one starts, or growArguments() ends up resizing a stale array */
+void freeArguments() {
+    for ( int i = 0; i < MAX_ARGUMENTS; i++ ) free(arguments[i]);
+    free(arguments);
+    arguments = NULL;
+    MAX_ARGUMENTS = 0;
+}
+
 /* Reset all global variables to free space for the next command line input */
 void inputReset() {
 
@@ -139,30 +662,20 @@ void inputReset() {
     }
     free(tokens);
 
-    MAX_ARGUMENTS = 0;
+    freeArguments();    // Normally gone already. Anything a failed command left behind goes here
     MAX_TOKENS = 0;
+    unsorted_glob = 0;
     free(line);
+    forgetLineMap();
 }
 
-int iExist(char* program) {
-    char* directory;
-
-    char cwd[5012];
-    getcwd(cwd, sizeof(cwd));
-    
-    if (access(program, F_OK) == 0 ) return 0;
-
-    directory = "/usr/local/bin";  chdir(directory);
-    if (access(program, F_OK) == 0 ) { chdir(cwd); return 0; }
-
-    directory = "/usr/bin";  chdir(directory);
-    if (access(program, F_OK) == 0 ) { chdir(cwd); return 0; }
-
-    directory = "/bin";  chdir(directory);
-    if (access(program, F_OK) == 0 ) { chdir(cwd); return 0; }
+char* findExecutable(char* program);    // Down in Redirection and Piping
 
-    chdir(cwd);
-    return 1;
+int iExist(char* program) {
+    char* path = findExecutable(program);
+    if ( path == NULL ) return 1;
+    free(path);
+    return 0;
 }
 
 
@@ -175,7 +688,7 @@ int thenHandler() {
         printf("Error: Conditional used without a previous command\n");
         return 1;
     }
-    if ( exit_status == 1 ) {
+    if ( exit_status != 0 ) {
         printf("Error: Previous command failed\n");
         printf("Cannot execute 'then' conditional\n");
         return 1;
@@ -245,6 +758,28 @@ int elseHandler() {
     return 0;
 }
 
+/* The 'nosort' prefix tells wildcard expansion not to bother sorting its matches, which
+is nice for commands that don't care about order (rm, chmod, tar...). It only applies to
+the current command, and can come right after a 'then' or 'else' */
+int nosortHandler(int prefixIndex) {
+
+    if ( MAX_TOKENS == prefixIndex + 1 ) {
+        printf("Error: Unexpected number of arguments\n");
+        return 1;
+    }
+
+    free(tokens[prefixIndex]);
+
+    // Shift elements to the left to remove the prefix
+    for (int i = prefixIndex; i < MAX_TOKENS - 1; i++) {
+        tokens[i] = tokens[i + 1];
+    }
+    MAX_TOKENS--;
+
+    unsorted_glob = 1;
+    return 0;
+}
+
 
 /* ============================================================ */
 // Built-In Commands Section //
@@ -337,131 +872,585 @@ int printCurrDirectory() {
 
 
 /* ============================================================ */
-// Redirection and Piping Section //
-
-char* executablePathBuilder(char* program, char* directory) {
-    char* pathname;
-    pathname = malloc(strlen(directory) + sizeof(char) + strlen(program) + sizeof(char));
-    memcpy(pathname, directory, strlen(directory));
-    pathname[strlen(directory)] = '/';
-    memcpy(pathname + strlen(directory) + 1, program, strlen(program) + 1);
-    return pathname;
+// Spawning Programs //
+
+/* With --zygote, the shell never forks to run a program. Right at startup, while we are
+still tiny, we fork off a helper (the "zygote") and hand it every program we want to run
+over a Unix socket: the path, argv, the environment, the cwd, and the fds the program
+should end up with (passed along with SCM_RIGHTS). The zygote does the fork and exec and
+sends back the pid, and later the exit status. Forking copies the whole page table of the
+process doing it, so this keeps spawning cheap no matter how big the shell gets */
+
+#define ZYGOTE_MAX_FDS 32
+
+enum { ZYGOTE_SPAWN, ZYGOTE_WAIT };
+
+typedef struct ZygoteRequest {
+    int type;                           // ZYGOTE_SPAWN or ZYGOTE_WAIT
+    pid_t pid;                          // ZYGOTE_WAIT: who to wait for (-1 for anyone)
+    int MAX_FDS;                        // ZYGOTE_SPAWN: how many fds came with the request...
+    int targets[ZYGOTE_MAX_FDS];        // ...and which fd number each one should become
+    int argc;
+    int envc;
+    size_t length;                      // Bytes of strings after this: path, cwd, argv, envp
+} ZygoteRequest;
+
+typedef struct ZygoteReply {
+    pid_t pid;
+    int status;                         // Wait status, for ZYGOTE_WAIT
+    int error;                          // errno if something went wrong
+} ZygoteReply;
+
+int zygote_fd = -1;     // Our end of the socket, or -1 if we fork for ourselves
+
+int readFully(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while ( done < length ) {
+        ssize_t bytes = read(fd, (char*)buffer + done, length - done);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return 1;
+        done += bytes;
+    }
+    return 0;
 }
 
-/* If the executable in question does NOT exist in the cwd, we need to build the
-full pathname so execv can run it! We will replace its place in 'tokens' with
-the full pathname. Tedious, but has to be done. */
-void pathNameReplacer(char* program, int arrayIndex) {
-    char cwd[5012];
-    getcwd(cwd, sizeof(cwd));
-    char* path;
-
-    int status = 1;
-    char* directory = "/usr/local/bin";  chdir(directory);
-    if ( access(program, F_OK) == 0 && status == 1 ) { 
-        path = executablePathBuilder(program, directory);
-        status = 0;
-    }
-    directory = "/usr/bin";  chdir(directory);
-    if ( access(program, F_OK) == 0 && status == 1 ) { 
-        path = executablePathBuilder(program, directory);
-        status = 0;
+int writeFully(int fd, const void* buffer, size_t length) {
+    size_t done = 0;
+    while ( done < length ) {
+        ssize_t bytes = write(fd, (const char*)buffer + done, length - done);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return 1;
+        done += bytes;
     }
-    directory = "/bin";  chdir(directory);
-    if ( access(program, F_OK) == 0 && status == 1 ) { 
-        path = executablePathBuilder(program, directory);
-        status = 0;
+    return 0;
+}
+
+/* Sends 'length' bytes of 'message', with 'count' fds riding along on the first byte */
+int sendWithFds(int socket, void* message, size_t length, int* fds, int count) {
+
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { message, length };
+    struct msghdr header = { 0 };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+
+    if ( count > 0 ) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
     }
 
-    tokens[arrayIndex] = realloc(tokens[arrayIndex], strlen(path) + 1);
-    memcpy(tokens[arrayIndex], path, strlen(path) + 1);
-    tokens[arrayIndex][strlen(path)] = '\0';
-    free(path);
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &header, MSG_NOSIGNAL);
+    } while ( sent == -1 && errno == EINTR );
+    if ( sent <= 0 ) return 1;
 
-    chdir(cwd);
+    // The fds went with the first chunk. Anything left over is plain data
+    return writeFully(socket, (char*)message + sent, length - sent);
 }
 
-/* We need to find the index of the executable in relation to the redirection symbol.
-How many arguments are in between the executable and the redirection symbol? This function finds out. */
-int getExecutableIndex(int caretIndex) {
+/* Receives 'length' bytes into 'message', and any fds that came with them into 'fds'.
+Returns how many fds showed up, or -1 if the other end is gone */
+int receiveWithFds(int socket, void* message, size_t length, int* fds) {
 
-    for ( int index = caretIndex - 1; index >= 0; index-- ) {
-        if ( caretIndex - 1 == 0 ) {
-            return 0;
-        }
-        if ( strcmp(tokens[index], "<") == 0 || strcmp(tokens[index], ">") == 0 
-        || strcmp(tokens[index], "|") == 0 ) {
-            return index + 1;
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    struct iovec iov = { message, length };
+    struct msghdr header = { 0 };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+    } while ( received == -1 && errno == EINTR );
+    if ( received <= 0 ) return -1;
+
+    int count = 0;
+    for ( struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg) ) {
+        if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
         }
     }
-    // This will never trigger because at this point, there is always something before the caret
-    return 0;
-}
 
-/* This function creates a custom argument list that's unique to each caret symbol, but
-also formats the list correctly for execv(). The list is stored in the global array 'arguments',
-and is reset after the redirection for its corresponding caret is complete */
-void customArgumentList(int caretIndex) {
+    if ( readFully(socket, (char*)message + received, length - received) == 1 ) return -1;
+    return count;
+}
 
-    // Use the index of the executable and start adding arguments after that
-    for ( int index = getExecutableIndex(caretIndex); index < caretIndex; index++ ) {
-        addToArguments(tokens[index]);
+/* Puts each fd in 'fds' at the number in 'targets', in a freshly forked child. Everything
+gets moved out of the way first, so one fd can't land on top of another that hasn't
+been moved yet */
+void placeFds(int* fds, int* targets, int count) {
+    int moved[ZYGOTE_MAX_FDS];
+    for ( int i = 0; i < count; i++ ) {
+        moved[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 256);
+        close(fds[i]);
     }
-    
-    // If the 'constant' filename is the last token, we don't have any more arguments to add
-    if ( caretIndex + 1 != MAX_TOKENS - 1 ) {
+    for ( int i = 0; i < count; i++ ) {
+        dup2(moved[i], targets[i]);     // dup2() clears close-on-exec on the copy
+    }
+}
 
-        // Now add any arguments after the file name
-        for ( int index = caretIndex + 2; index < MAX_TOKENS; index++ ) {
-            if ( strcmp(tokens[index], "<") == 0 || strcmp(tokens[index], ">") == 0 
-                || strcmp(tokens[index], "|") == 0 ) break;
-            addToArguments(tokens[index]);
+/* The zygote itself. It just sits on the socket, starting programs and reaping them,
+until the shell goes away */
+void zygoteLoop(int socket) {
+
+    while ( 1 ) {
+        ZygoteRequest request;
+        int fds[ZYGOTE_MAX_FDS];
+        int count = receiveWithFds(socket, &request, sizeof(request), fds);
+        if ( count == -1 ) _exit(EXIT_SUCCESS);     // The shell is gone, so are we
+
+        ZygoteReply reply = { -1, 0, 0 };
+
+        if ( request.type == ZYGOTE_WAIT ) {
+            int wstatus = 0;
+            pid_t pid;
+            do {
+                pid = waitpid(request.pid, &wstatus, 0);
+            } while ( pid == -1 && errno == EINTR );
+            reply.pid = pid;
+            reply.status = wstatus;
+            reply.error = ( pid == -1 ) ? errno : 0;
+            if ( writeFully(socket, &reply, sizeof(reply)) == 1 ) _exit(EXIT_FAILURE);
+            continue;
         }
-    }
 
-    // Finally, add the null pointer at the last index to make execv() happy
-    MAX_ARGUMENTS++;
-    arguments = (char**)realloc(arguments, (MAX_ARGUMENTS * sizeof(char*)));
-    arguments[MAX_ARGUMENTS - 1] = NULL;
+        // ZYGOTE_SPAWN. Unpack the strings: path, cwd, argv, then envp
+        char* strings = malloc(request.length);
+        if ( readFully(socket, strings, request.length) == 1 ) _exit(EXIT_FAILURE);
+
+        char** argv = malloc((request.argc + 1) * sizeof(char*));
+        char** envp = malloc((request.envc + 1) * sizeof(char*));
+        char* path = strings;
+        char* cwd = path + strlen(path) + 1;
+        char* next = cwd + strlen(cwd) + 1;
+        for ( int i = 0; i < request.argc; i++ ) { argv[i] = next; next += strlen(next) + 1; }
+        for ( int i = 0; i < request.envc; i++ ) { envp[i] = next; next += strlen(next) + 1; }
+        argv[request.argc] = NULL;
+        envp[request.envc] = NULL;
+
+        pid_t pid = fork();
+        if ( pid == 0 ) {
+            close(socket);
+            placeFds(fds, request.targets, count);
+            if ( chdir(cwd) != 0 ) perror("chdir");
+            execve(path, argv, envp);
+            perror("execv");
+            _exit(EXIT_FAILURE);
+        }
 
-    return;
+        reply.pid = pid;
+        reply.error = ( pid == -1 ) ? errno : 0;
+        for ( int i = 0; i < count; i++ ) close(fds[i]);
+        free(argv);
+        free(envp);
+        free(strings);
+
+        if ( writeFully(socket, &reply, sizeof(reply)) == 1 ) _exit(EXIT_FAILURE);
+    }
 }
 
-int redirection(char* executable, char* output_file) {
+/* Forks off the zygote. This should happen as early as possible, while the shell is small */
+int startZygote() {
+
+    int sockets[2];
+    if ( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1 ) {
+        perror("socketpair");
+        return 1;
+    }
 
     pid_t pid = fork();
     if ( pid == -1 ) {
-        printf("Error forking\n");
+        perror("fork");
+        close(sockets[0]);
+        close(sockets[1]);
         return 1;
-    } else if ( pid == 0 ) { // We are in the child
-        if ( execv(executable, arguments) == 1 ) {
-            perror("execv");
-            return 1;
-        }
-    } else { // Parent process
-        int wstatus;
-        wait(&wstatus);
+    }
+    if ( pid == 0 ) {
+        close(sockets[0]);
+        zygoteLoop(sockets[1]);
     }
 
+    close(sockets[1]);
+    zygote_fd = sockets[0];
     return 0;
-}   
+}
 
-/* Here we are just setting things up for redirection, handling any obvious errors,
-creating argument lists, y'know how it is */
-int redirectionWrapper(int caretIndex) {
-    
-    // A caret symbol cannot be the first or last token
-    if ( strcmp(tokens[MAX_TOKENS - 1], "<") == 0 || strcmp(tokens[MAX_TOKENS - 1], ">") == 0 || 
-         strcmp(tokens[0], "<") == 0 || strcmp(tokens[0], ">") == 0 ) {
-         printf("Error: Improper use of redirection symbol\n");
-         return 1;
+/* Asks the zygote to start a program. Returns its pid, or -1 */
+pid_t zygoteSpawn(char* path, char** argv, int fd_in, int fd_out) {
+
+    extern char** environ;
+    ZygoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = ZYGOTE_SPAWN;
+
+    // The program's stdin, stdout and stderr, plus any substitution pipes it was promised
+    int fds[ZYGOTE_MAX_FDS];
+    fds[0] = ( fd_in == -1 ) ? shell_fds[0] : fd_in;
+    fds[1] = ( fd_out == -1 ) ? shell_fds[1] : fd_out;
+    fds[2] = shell_fds[2];
+    request.targets[0] = STDIN_FILENO;
+    request.targets[1] = STDOUT_FILENO;
+    request.targets[2] = STDERR_FILENO;
+    request.MAX_FDS = 3;
+
+    for ( int i = 0; i < MAX_SUBSTITUTIONS; i++ ) {
+        if ( request.MAX_FDS == ZYGOTE_MAX_FDS ) {
+            printf("Error: Too many process substitutions\n");
+            return -1;
+        }
+        fds[request.MAX_FDS] = substitution_fds[i];
+        request.targets[request.MAX_FDS] = substitution_fds[i];
+        request.MAX_FDS++;
     }
 
-    // Caret symbols cannot be adjacent to each other
-    for ( int i = 0; i < MAX_TOKENS; i++ ) {
-        if ( strcmp(tokens[i], "<") == 0 || strcmp(tokens[i], ">") == 0 ) {
-            if ( (( i != 0 ) && ( i != MAX_TOKENS - 1))
-            && ( strcmp(tokens[i - 1], "<") == 0 || strcmp(tokens[i - 1], ">") == 0 
+    char cwd[BUFFSIZE];
+    if ( getcwd(cwd, sizeof(cwd)) == NULL ) {
+        perror("getcwd() error");
+        return -1;
+    }
+
+    // Pack every string back to back
+    request.length = strlen(path) + 1 + strlen(cwd) + 1;
+    for ( request.argc = 0; argv[request.argc] != NULL; request.argc++ ) {
+        request.length += strlen(argv[request.argc]) + 1;
+    }
+    for ( request.envc = 0; environ[request.envc] != NULL; request.envc++ ) {
+        request.length += strlen(environ[request.envc]) + 1;
+    }
+
+    char* strings = malloc(request.length);
+    char* next = strings;
+    next = stpcpy(next, path) + 1;
+    next = stpcpy(next, cwd) + 1;
+    for ( int i = 0; i < request.argc; i++ ) next = stpcpy(next, argv[i]) + 1;
+    for ( int i = 0; i < request.envc; i++ ) next = stpcpy(next, environ[i]) + 1;
+
+    ZygoteReply reply;
+    if ( sendWithFds(zygote_fd, &request, sizeof(request), fds, request.MAX_FDS) == 1
+        || writeFully(zygote_fd, strings, request.length) == 1
+        || readFully(zygote_fd, &reply, sizeof(reply)) == 1 ) {
+        printf("Error: Lost the zygote\n");
+        free(strings);
+        return -1;
+    }
+    free(strings);
+
+    if ( reply.pid == -1 ) {
+        errno = reply.error;
+        perror("fork");
+    }
+    return reply.pid;
+}
+
+/* Starts 'path' with the argument list 'argv'. Its stdin and stdout are 'fd_in' and
+'fd_out', or the shell's own if those are -1. Goes through the zygote if we have one.
+Returns the new pid, or -1 */
+int isMyshScript(char* path);   // Down in Scripts
+pid_t spawnSubshell(char* path, char** argv, int fd_in, int fd_out);
+int forgetSubshell(pid_t pid);
+
+/* For a child we just forked. Puts 'fd_in' and 'fd_out' on its stdin and stdout, or the
+shell's own when they're -1, and the shell's stderr on its stderr */
+void childFds(int fd_in, int fd_out) {
+    int fds[3] = { fd_in != -1 ? fd_in : shell_fds[0], fd_out != -1 ? fd_out : shell_fds[1], 
+                   shell_fds[2] };
+    for ( int i = 0; i < 3; i++ ) {
+        if ( fds[i] != i ) dup2(fds[i], i);
+        shell_fds[i] = i;
+    }
+}
+
+pid_t spawnProgram(char* path, char** argv, int fd_in, int fd_out) {
+
+    int previous = enterPhase(PHASE_SPAWN);
+
+    // Our own scripts run in a fork of this shell instead of a brand new one
+    if ( isMyshScript(path) ) {
+        pid_t pid = spawnSubshell(path, argv, fd_in, fd_out);
+        traceSpawned(pid, path);
+        return leavePhase(previous, pid);
+    }
+
+    if ( zygote_fd != -1 ) {
+        pid_t pid = zygoteSpawn(path, argv, fd_in, fd_out);
+        traceSpawned(pid, path);
+        return leavePhase(previous, pid);
+    }
+
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        perror("fork");
+        return leavePhase(previous, -1);
+    }
+    if ( pid == 0 ) {
+        childFds(fd_in, fd_out);
+        execv(path, argv);
+        perror("execv");
+        _exit(EXIT_FAILURE);  // Exit child process if execv fails
+    }
+    traceSpawned(pid, path);
+    return leavePhase(previous, pid);
+}
+
+/* Waits for a program from spawnProgram() (or any of them, if 'pid' is -1). Fills in
+'wstatus' if it isn't NULL, and returns the pid that finished, or -1 */
+pid_t waitProgram(pid_t pid, int* wstatus) {
+
+    int status = 0;
+    int previous = enterPhase(PHASE_WAIT);
+
+    // The zygote only knows about the programs it started, not our subshells
+    int subshell = forgetSubshell(pid);
+    if ( zygote_fd != -1 && subshell == 0 ) {
+        ZygoteRequest request;
+        memset(&request, 0, sizeof(request));
+        request.type = ZYGOTE_WAIT;
+        request.pid = pid;
+
+        ZygoteReply reply;
+        if ( sendWithFds(zygote_fd, &request, sizeof(request), NULL, 0) == 1
+            || readFully(zygote_fd, &reply, sizeof(reply)) == 1 ) {
+            printf("Error: Lost the zygote\n");
+            return leavePhase(previous, -1);
+        }
+        if ( wstatus != NULL ) *wstatus = reply.status;
+        traceReaped(reply.pid);
+        errno = reply.error;
+        return leavePhase(previous, reply.pid);
+    }
+
+    pid_t done;
+    do {
+        done = waitpid(pid, &status, 0);
+    } while ( done == -1 && errno == EINTR );
+    if ( wstatus != NULL ) *wstatus = status;
+    traceReaped(done);
+    return leavePhase(previous, done);
+}
+
+/* What a wait status from waitProgram() means to the rest of the shell, same as $? in
+any other shell: the program's exit status, or 128 plus the signal that killed it */
+int programStatus(int wstatus) {
+    if ( WIFSIGNALED(wstatus) ) return 128 + WTERMSIG(wstatus);
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+}
+
+
+/* ============================================================ */
+// Redirection and Piping Section //
+
+char* executablePathBuilder(char* program, char* directory) {
+    char* pathname;
+    pathname = malloc(strlen(directory) + sizeof(char) + strlen(program) + sizeof(char));
+    memcpy(pathname, directory, strlen(directory));
+    pathname[strlen(directory)] = '/';
+    memcpy(pathname + strlen(directory) + 1, program, strlen(program) + 1);
+    return pathname;
+}
+
+/* Where we found programs before, so we don't have to go knocking on three directories
+every time. Entries go by the hash of the program name, and a newcomer just takes the
+slot. If any of the bin folders has changed since we last looked (we look at most once
+a second), the whole thing gets thrown out */
+#define PATH_CACHE_SIZE 512
+
+typedef struct CachedPath {
+    char* program;
+    char* path;
+} CachedPath;
+
+char* bin_directories[] = { "/usr/local/bin", "/usr/bin", "/bin" };
+#define MAX_BIN_DIRECTORIES 3
+
+MYSH_LOCAL CachedPath path_cache[PATH_CACHE_SIZE];
+
+/* What isMyshScript() made of each path it looked at, so an ordinary program doesn't get
+opened and read on every single spawn. One stat() says whether it's still the same file:
+a new inode or mtime means new contents, and a new ctime means somebody chmod'ed it */
+typedef struct CachedVerdict {
+    char* path;
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    int script;
+} CachedVerdict;
+
+MYSH_LOCAL CachedVerdict script_cache[PATH_CACHE_SIZE];
+MYSH_LOCAL struct timespec bin_mtimes[MAX_BIN_DIRECTORIES];
+MYSH_LOCAL time_t path_cache_checked = -1;     // When we last looked at the bin folders, in seconds
+
+unsigned int hashName(const char* name, int length);   // Down in Variables and Arithmetic
+
+void forgetPathCache() {
+    for ( int i = 0; i < PATH_CACHE_SIZE; i++ ) {
+        free(path_cache[i].program);
+        free(path_cache[i].path);
+        path_cache[i].program = NULL;
+        path_cache[i].path = NULL;
+        free(script_cache[i].path);
+        script_cache[i].path = NULL;
+    }
+}
+
+void checkPathCache() {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if ( now.tv_sec == path_cache_checked ) return;
+    path_cache_checked = now.tv_sec;
+
+    int changed = 0;
+    for ( int i = 0; i < MAX_BIN_DIRECTORIES; i++ ) {
+        struct stat info;
+        struct timespec mtime = { 0, 0 };
+        if ( stat(bin_directories[i], &info) == 0 ) mtime = info.st_mtim;
+        if ( mtime.tv_sec != bin_mtimes[i].tv_sec || mtime.tv_nsec != bin_mtimes[i].tv_nsec ) changed = 1;
+        bin_mtimes[i] = mtime;
+    }
+    if ( changed == 0 ) return;
+    forgetPathCache();
+}
+
+/* Find the full path of a program the same way executeProgramWrapper() does: the three
+bin folders first, then the cwd. Names with a slash are taken as they are. Unlike the
+other lookups this one never leaves the cwd, it just asks access() about the full path.
+Returns a malloc'd path, or NULL if the program is nowhere to be found */
+char* findExecutable(char* program) {
+
+    int previous = enterPhase(PHASE_RESOLVE);
+    char* found = NULL;
+
+    if ( hasSlash(program) == 0 ) {
+        if ( access(program, F_OK) == 0 ) found = strdup(program);
+        leavePhase(previous, 0);
+        return found;
+    }
+
+    checkPathCache();
+    CachedPath* cached = &path_cache[hashName(program, strlen(program)) % PATH_CACHE_SIZE];
+    if ( cached->program != NULL && strcmp(cached->program, program) == 0 ) {
+        leavePhase(previous, 0);
+        return strdup(cached->path);
+    }
+
+    for ( int i = 0; i < MAX_BIN_DIRECTORIES && found == NULL; i++ ) {
+        char* path = executablePathBuilder(program, bin_directories[i]);
+        if ( access(path, F_OK) == 0 ) found = path;
+        else free(path);
+    }
+
+    if ( found != NULL ) {
+        free(cached->program);
+        free(cached->path);
+        cached->program = strdup(program);
+        cached->path = strdup(found);
+    }
+
+    // The cwd comes last, and never gets cached since it changes under us
+    if ( found == NULL && access(program, F_OK) == 0 ) found = strdup(program);
+    leavePhase(previous, 0);
+    return found;
+}
+
+/* If the executable in question does NOT exist in the cwd, we need to build the
+full pathname so execv can run it! We will replace its place in 'tokens' with
+the full pathname. Tedious, but has to be done. */
+void pathNameReplacer(char* program, int arrayIndex) {
+    char* path = findExecutable(program);
+    if ( path == NULL ) return;
+
+    tokens[arrayIndex] = realloc(tokens[arrayIndex], strlen(path) + 1);
+    memcpy(tokens[arrayIndex], path, strlen(path) + 1);
+    tokens[arrayIndex][strlen(path)] = '\0';
+    free(path);
+}
+
+/* We need to find the index of the executable in relation to the redirection symbol.
+How many arguments are in between the executable and the redirection symbol? This function finds out. */
+int getExecutableIndex(int caretIndex) {
+
+    for ( int index = caretIndex - 1; index >= 0; index-- ) {
+        if ( caretIndex - 1 == 0 ) {
+            return 0;
+        }
+        if ( strcmp(tokens[index], "<") == 0 || strcmp(tokens[index], ">") == 0 
+        || isPipeSymbol(tokens[index]) ) {
+            return index + 1;
+        }
+    }
+    // This will never trigger because at this point, there is always something before the caret
+    return 0;
+}
+
+/* This function creates a custom argument list that's unique to each caret symbol, but
+also formats the list correctly for execv(). The list is stored in the global array 'arguments',
+and is reset after the redirection for its corresponding caret is complete */
+void customArgumentList(int caretIndex) {
+
+    // Use the index of the executable and start adding arguments after that
+    for ( int index = getExecutableIndex(caretIndex); index < caretIndex; index++ ) {
+        addToArguments(tokens[index]);
+    }
+    
+    /* If the 'constant' filename is the last token, we don't have any more arguments to add.
+    A pipe has no filename after it, just the next program, whose arguments aren't ours */
+    if ( caretIndex + 1 != MAX_TOKENS - 1 && !isPipeSymbol(tokens[caretIndex]) ) {
+
+        // Now add any arguments after the file name
+        for ( int index = caretIndex + 2; index < MAX_TOKENS; index++ ) {
+            if ( strcmp(tokens[index], "<") == 0 || strcmp(tokens[index], ">") == 0 
+                || isPipeSymbol(tokens[index]) ) break;
+            addToArguments(tokens[index]);
+        }
+    }
+
+    // Finally, add the null pointer at the last index to make execv() happy
+    MAX_ARGUMENTS++;
+    growArguments();
+    arguments[MAX_ARGUMENTS - 1] = NULL;
+
+    return;
+}
+
+int redirection(char* executable, int fd_in, int fd_out) {
+
+    pid_t pid = spawnProgram(executable, arguments, fd_in, fd_out);
+    if ( pid == -1 ) {
+        printf("Error forking\n");
+        return 1;
+    }
+    int wstatus = 0;
+    waitProgram(pid, &wstatus);
+
+    return programStatus(wstatus);
+}   
+
+/* Here we are just setting things up for redirection, handling any obvious errors,
+creating argument lists, y'know how it is */
+int redirectionWrapper(int caretIndex) {
+    
+    // A caret symbol cannot be the first or last token
+    if ( strcmp(tokens[MAX_TOKENS - 1], "<") == 0 || strcmp(tokens[MAX_TOKENS - 1], ">") == 0 || 
+         strcmp(tokens[0], "<") == 0 || strcmp(tokens[0], ">") == 0 ) {
+         printf("Error: Improper use of redirection symbol\n");
+         return 1;
+    }
+
+    // Caret symbols cannot be adjacent to each other
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        if ( strcmp(tokens[i], "<") == 0 || strcmp(tokens[i], ">") == 0 ) {
+            if ( (( i != 0 ) && ( i != MAX_TOKENS - 1))
+            && ( strcmp(tokens[i - 1], "<") == 0 || strcmp(tokens[i - 1], ">") == 0 
             ||   strcmp(tokens[i + 1], "<") == 0 || strcmp(tokens[i + 1], ">") == 0 ) ) {
                 printf("Error: Improper use of redirection symbol\n");
                 return 1;
@@ -489,117 +1478,202 @@ int redirectionWrapper(int caretIndex) {
 
         char* executable = tokens[getExecutableIndex(caretIndex)];     
         char* output_file = tokens[caretIndex + 1];   
-        int original_stdout = dup(STDOUT_FILENO);
 
         customArgumentList(caretIndex); // Generate an argument list custom to this particular caret
         
-        int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+        int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
         if ( fd == -1 ) {
             perror("open");
+            freeArguments();
             return 1;
         }
-        dup2(fd, STDOUT_FILENO); // All output will now be directed to 'output_file'
-        close(fd);
-
-        // We just have to pass in the program to execute and the argument list
-        if ( redirection(executable, output_file) == 1 ) return 1; 
 
-        if (dup2(original_stdout, STDOUT_FILENO) == -1) {
-            perror("Failed to reset STDOUT to terminal");
-            exit(EXIT_FAILURE);
-        }
+        /* All output will now be directed to 'output_file'. Only the program's stdout moves,
+        not ours, so nothing else running in this process gets caught up in it */
+        int status = redirection(executable, -1, fd);
+        close(fd);
+        if ( status != 0 ) { freeArguments(); return status; }
 
     } else if ( strcmp(caret, "<") == 0 ) { // We want to change STDIN
 
         char* executable = tokens[getExecutableIndex(caretIndex)];   
         char* input_file = tokens[caretIndex + 1];  
-        int original_stdout = dup(STDIN_FILENO);
 
         customArgumentList(caretIndex); // Generate an argument list custom to this particular caret
 
-        int fd = open(input_file, O_RDONLY, 0640);
+        int fd = open(input_file, O_RDONLY | O_CLOEXEC, 0640);
         if ( fd == -1 ) {
             perror("open");
+            freeArguments();
             return 1;
         }
-        dup2(fd, STDIN_FILENO); // All output will now be directed to 'output_file'
-        close(fd);
 
-        // We just have to pass in the program to execute and the argument list
-        if ( redirection(executable, input_file) == 1 ) return 1; 
-
-        if (dup2(original_stdout, STDIN_FILENO) == -1) {
-            perror("Failed to reset STDIN to terminal");
-            exit(EXIT_FAILURE);
-        }
+        // The program reads 'input_file' on its stdin
+        int status = redirection(executable, fd, -1);
+        close(fd);
+        if ( status != 0 ) { freeArguments(); return status; }
     }
 
     /* Free the argument list so a different argument list can be created if a different
     caret symbol is found */
-    for (int i = 0; i < MAX_ARGUMENTS; i++) {
-        free(arguments[i]); // Set pointers to NULL or to initial values
-        arguments[i] = NULL;
-    }
-    free(arguments);
-    arguments = NULL;
-    MAX_ARGUMENTS = 0;
+    freeArguments();
     
     return 0;
 }
 
-int pipeBuddies(char** args1, char** args2) {
+/* Program 2 writes to 'fd_out', or our own stdout if that's -1 */
+int pipeBuddies(char** args1, char** args2, int fd_out) {
 
     int pipefd[2];
-    pid_t pid1, pid2 = 0;
 
-    if ( pipe(pipefd) == -1 ) {
+    // Close-on-exec, so neither program ends up holding the other end of its own pipe
+    if ( pipe2(pipefd, O_CLOEXEC) == -1 ) {
         perror("pipe");
         return 1;
     }
 
-    pid1 = fork(); // Create the first child process
-    if ( pid1 == -1 ) {
-        perror("fork");
-        exit(EXIT_FAILURE);
+    // Program 1 writes to the pipe (e.g., ls to list files)
+    pid_t pid1 = spawnProgram(args1[0], args1, -1, pipefd[1]);
+    // Program 2 reads from the pipe (e.g., wc -l to count lines)
+    pid_t pid2 = spawnProgram(args2[0], args2, pipefd[0], fd_out);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    // Wait for both child processes to finish. The pipe's status is the second one's
+    int wstatus = 0;
+    if ( pid1 > 0 ) waitProgram(pid1, NULL);
+    if ( pid2 > 0 ) waitProgram(pid2, &wstatus);
+    if ( pid1 == -1 || pid2 == -1 ) return 1;
+
+    return programStatus(wstatus);
+}
+
+double secondsSince(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Sets the capacity of a pipe from MYSH_PIPE_SIZE (in bytes), if it's set.
+Returns the capacity the pipe ends up with */
+int setPipeSize(int fd) {
+    char* setting = getenv("MYSH_PIPE_SIZE");
+    if ( setting != NULL && atoi(setting) > 0 ) {
+        if ( fcntl(fd, F_SETPIPE_SZ, atoi(setting)) == -1 ) perror("F_SETPIPE_SZ");
     }
-    if ( pid1 == 0 ) { 
-        // Child process 1 - Program 1 (writes to the pipe
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
+    return fcntl(fd, F_GETPIPE_SZ);
+}
 
-        // Execute the first program (e.g., ls to list files)
-        if ( execv(args1[0], args1) ) {
-            perror("execv");
-            return 1;
-        }
-    } else { // Back in the parent process
-        
-        pid2 = fork(); // Create the second child process
-        if ( pid2 == -1 ) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+/* Blocks SIGPIPE in this thread only, so writing to a reader that's gone gets us an EPIPE
+instead of killing us. Unlike signal(), this leaves every other thread (and the library's
+caller) with whatever they had */
+void holdSigpipe(sigset_t* previous) {
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, previous);
+}
+
+/* Undoes holdSigpipe(). Every EPIPE left a SIGPIPE pending too, which would go off the
+moment we unblock it, so we take it off first. Unless it was blocked already, in which
+case it wasn't ours to take */
+void releaseSigpipe(sigset_t* previous) {
+    sigset_t sigpipe, pending;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    struct timespec now = { 0, 0 };
+    if ( !sigismember(previous, SIGPIPE) ) {
+        while ( sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) ) {
+            if ( sigtimedwait(&sigpipe, NULL, &now) == -1 && errno != EINTR ) break;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, previous, NULL);
+}
 
-        if ( pid2 == 0 ) {
-            // Child process 2 - Program 2 (reads from the pipe)
-            close(pipefd[1]);
-            dup2(pipefd[0], STDIN_FILENO);
+/* The same two programs as pipeBuddies(), but with the shell sitting in the middle.
+Program 1 writes into one pipe, program 2 reads from another, and we splice() the data
+across without ever copying it into our own memory. Along the way we keep track of how
+long we sat waiting on each side, which tells you which one is the bottleneck */
+int pipeMeter(char** args1, char** args2, int fd_out) {
 
-            // Execute the second program (e.g., wc -l to count lines)
-            if ( execv(args2[0], args2) ) {
-                perror("execv");
-                return 1;
-            }
+    int producer[2];    // Program 1 -> shell
+    int consumer[2];    // Shell -> program 2
+
+    if ( pipe2(producer, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        return 1;
+    }
+    if ( pipe2(consumer, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        close(producer[0]);
+        close(producer[1]);
+        return 1;
+    }
+    setPipeSize(producer[0]);
+    int capacity = setPipeSize(consumer[0]);
+
+    // Program 1 writes to the first pipe, program 2 reads from the second
+    pid_t pid1 = spawnProgram(args1[0], args1, -1, producer[1]);
+    pid_t pid2 = spawnProgram(args2[0], args2, consumer[0], fd_out);
+
+    // Back in the parent. We only keep the ends we splice between
+    close(producer[1]);
+    close(consumer[0]);
+    fcntl(producer[0], F_SETFL, O_NONBLOCK);
+    fcntl(consumer[1], F_SETFL, O_NONBLOCK);
+
+    // If program 2 quits early, we want an EPIPE, not to be killed by SIGPIPE
+    sigset_t previous_mask;
+    holdSigpipe(&previous_mask);
+
+    unsigned long long bytes = 0;
+    double producer_wait = 0;
+    double consumer_wait = 0;
+    struct timespec start, blocked;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ( 1 ) {
+        ssize_t moved = splice(producer[0], NULL, consumer[1], NULL, capacity, 
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if ( moved > 0 ) { bytes += moved; continue; }
+        if ( moved == 0 ) break;                        // Program 1 is done writing
+        if ( errno == EINTR ) continue;
+        if ( errno != EAGAIN ) {
+            if ( errno != EPIPE ) perror("splice");     // EPIPE just means program 2 is done reading
+            break;
+        }
+
+        /* Somebody isn't ready. If there's nothing to read, we're waiting on program 1.
+        Otherwise the second pipe is full and we're waiting on program 2 */
+        struct pollfd input = { producer[0], POLLIN, 0 };
+        clock_gettime(CLOCK_MONOTONIC, &blocked);
+        if ( poll(&input, 1, 0) == 0 ) {
+            poll(&input, 1, -1);
+            producer_wait += secondsSince(&blocked);
+        } else {
+            struct pollfd output = { consumer[1], POLLOUT, 0 };
+            poll(&output, 1, -1);
+            consumer_wait += secondsSince(&blocked);
         }
     }
-    close(pipefd[0]);
-    close(pipefd[1]);
+    double elapsed = secondsSince(&start);
 
-    // Wait for both child processes to finish
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+    close(producer[0]);
+    close(consumer[1]);
+    releaseSigpipe(&previous_mask);
 
-    return 0;
+    // Wait for both child processes to finish
+    int wstatus = 0;
+    if ( pid1 > 0 ) waitProgram(pid1, NULL);
+    if ( pid2 > 0 ) waitProgram(pid2, &wstatus);
+
+    fprintf(stderr, "|! %llu bytes in %.3fs (%.2f MB/s), pipe size %d\n", bytes, elapsed, 
+            elapsed > 0 ? bytes / elapsed / 1e6 : 0.0, capacity);
+    fprintf(stderr, "|! waited %.3fs on %s, %.3fs on %s\n", producer_wait, args1[0], 
+            consumer_wait, args2[0]);
+    if ( pid1 == -1 || pid2 == -1 ) return 1;
+    return programStatus(wstatus);
 }
 
 int pipeWrapper(int arrayIndex) {
@@ -611,13 +1685,13 @@ int pipeWrapper(int arrayIndex) {
     }
 
     // Pipes cannot be the first or last token
-    if ( strcmp(tokens[0], "|") == 0 || strcmp(tokens[MAX_TOKENS - 1], "|") == 0 ) {
+    if ( isPipeSymbol(tokens[0]) || isPipeSymbol(tokens[MAX_TOKENS - 1]) ) {
         printf("Error: Improper use of pipe command\n");
         return 1;
     }
 
     // Pipes and redirects cannot be adjacent to each other
-    if ( strcmp(tokens[arrayIndex + 1], "|") == 0 || strcmp(tokens[arrayIndex - 1], "|") == 0 
+    if ( isPipeSymbol(tokens[arrayIndex + 1]) || isPipeSymbol(tokens[arrayIndex - 1]) 
     || strcmp(tokens[arrayIndex + 1], "<") == 0 || strcmp(tokens[arrayIndex - 1], "<") == 0 
     || strcmp(tokens[arrayIndex + 1], ">") == 0 || strcmp(tokens[arrayIndex - 1], ">") == 0 ) {
         printf("Error: Improper use of pipe command\n");
@@ -645,17 +1719,15 @@ int pipeWrapper(int arrayIndex) {
     
     // Create two custom argument lists for the pipe in question
     customArgumentList(arrayIndex);
-    char** args1 = (char**)malloc(MAX_ARGUMENTS * sizeof(char **));
+    int count = MAX_ARGUMENTS;
+    char** args1 = (char**)malloc(count * sizeof(char **));
 
-    for (int i = 0; i < MAX_ARGUMENTS - 1; ++i) {
+    for (int i = 0; i < count - 1; ++i) {
         args1[i] = strdup(arguments[i]);
         args1[i][strlen(arguments[i])] = '\0';
-        free(arguments[i]);
-        arguments[i] = NULL;
     }
-    free(arguments);
-    arguments = NULL;
-    args1[MAX_ARGUMENTS - 1] = NULL;
+    args1[count - 1] = NULL;
+    freeArguments();    // Or a '>' after the pipe would build its list on top of this one
 
     // Make second list
     int length = 0;
@@ -672,12 +1744,36 @@ int pipeWrapper(int arrayIndex) {
     }
     
     args2[length] = NULL;      
+
+    // 'cmd1 | cmd2 > file' sends what cmd2 writes into the file
+    int status = 1;
+    int fd_out = -1;
+    int after = arrayIndex + 1 + length;
+    if ( after < MAX_TOKENS && ( after + 1 == MAX_TOKENS || strcmp(tokens[after + 1], "<") == 0 
+                                || strcmp(tokens[after + 1], ">") == 0 ) ) {
+        printf("Error: Improper use of redirection symbol\n");
+        after = -1;
+    } else if ( after < MAX_TOKENS && strcmp(tokens[after], ">") == 0 ) {
+        fd_out = open(tokens[after + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if ( fd_out == -1 ) {
+            perror("open");
+            after = -1;
+        }
+    }
     length++;
 
-    // Let's do the pipe thing
-    if ( pipeBuddies(args1, args2) == 1 ) return 1;
+    // Let's do the pipe thing. A "|!" pipe gets metered on its way through
+    if ( after == -1 ) {
+        // Nothing runs if the redirection is broken
+    } else if ( strcmp(tokens[arrayIndex], "|!") == 0 ) {
+        status = pipeMeter(args1, args2, fd_out);
+    } else {
+        status = pipeBuddies(args1, args2, fd_out);
+    }
+    if ( fd_out != -1 ) close(fd_out);
 
-    for (int i = 0; i < MAX_ARGUMENTS; i++) { 
+    // Both lists go, whether the pipe worked or not
+    for (int i = 0; i < count; i++) { 
         free(args1[i]);
         args1[i] = NULL;
     }
@@ -691,114 +1787,719 @@ int pipeWrapper(int arrayIndex) {
     free(args2);
     args2 = NULL;
     
-    return 0;
+    return status;
 }
 
 int caretPipeSwitch() {
 
     for ( int i = 0; i < MAX_TOKENS; i++ ) {
         if ( strcmp(tokens[i], "<") == 0 || strcmp(tokens[i], ">") == 0 ) {
-            if ( redirectionWrapper(i) == 1 ) return 1;
+            int status = redirectionWrapper(i);
+            if ( status != 0 ) return status;
         }
 
-        if ( strcmp(tokens[i], "|") == 0 ) {
-            if ( pipeWrapper(i) == 1 ) return 1;
-        }
+        // The pipe takes care of everything after it, '> file' included
+        if ( isPipeSymbol(tokens[i]) ) return pipeWrapper(i);
     }
     // This will never trigger, so we return 0 for fun.
     return 0;
 }
 
-
 /* ============================================================ */
-// File Execution Section //
+// Pipeline Optimizer //
+
+/* Before a line with pipes or redirection runs, we take a look at it and throw out the
+parts that don't do anything. 'cat FILE | cmd' is really just 'cmd < FILE', 'cmd | cat'
+is just 'cmd', and 'cmd > a > b' only ever ends up writing to 'b'. Whatever is left runs
+as a single program with its input and output already hooked up, which saves a fork, an
+exec and a pipe's worth of copying. We only ever drop a stage when we can tell nobody
+would notice, so anything that might talk to a terminal or isn't a plain file gets left
+alone. 'mysh --no-optimize' turns all of this off */
 
-void insertPathName(char* path, int arrayIndex) {
-    arguments[arrayIndex] = realloc(arguments[arrayIndex], strlen(path) + 1);
-    memcpy(arguments[arrayIndex], path, strlen(path) + 1);
-    arguments[arrayIndex][strlen(path)] = '\0';
+int optimize_pipelines = 1;     // Cleared by --no-optimize
+
+int isCaretSymbol(char* token) {
+    return strcmp(token, "<") == 0 || strcmp(token, ">") == 0;
 }
 
-int executeProgram(char* program) {
+/* Takes 'count' tokens out of 'tokens' starting at 'index' */
+void removeTokens(int index, int count) {
+    for ( int i = index; i < index + count; i++ ) free(tokens[i]);
+    memmove(&tokens[index], &tokens[index + count], (MAX_TOKENS - index - count) * sizeof(char*));
+    MAX_TOKENS -= count;
+}
 
-    pid_t pid = fork();
-    if ( pid == -1 ) {
-        perror("fork");
-        return 1;
-    } else if ( pid == 0 ) {
-        if ( execv(arguments[0], arguments) == -1 ) {
-            perror("execv");
-            return 1;  // Exit child process if execv fails
-        }
-    } else wait(NULL); // Parent process waits for the child process to finish
+/* Tacks a redirection onto the end of the line */
+int appendRedirection(char* caret, char* file) {
+    char* copy = strdup(file);
+    if ( makeRoomForTokens(MAX_TOKENS, 2) == 1 ) { free(copy); return 1; }
+    tokens[MAX_TOKENS - 2] = strdup(caret);
+    tokens[MAX_TOKENS - 1] = copy;
     return 0;
 }
 
-int executeProgramWrapper() {
+/* 'cat' and nothing else but redirections, from 'start' up to 'end' */
+int isPlainCat(int start, int end) {
+    if ( end - start < 1 || strcmp(tokens[start], "cat") != 0 ) return 0;
+    for ( int i = start + 1; i < end; i += 2 ) {
+        if ( !isCaretSymbol(tokens[i]) || i + 1 >= end ) return 0;
+    }
+    return 1;
+}
 
-    char* directory;
-    char* program = tokens[0];
+/* Counts the 'caret' symbols from 'start' up to 'end' */
+int countCarets(char* caret, int start, int end) {
+    int count = 0;
+    for ( int i = start; i < end; i++ ) count += ( strcmp(tokens[i], caret) == 0 );
+    return count;
+}
 
-    char cwd[5012];
-    getcwd(cwd, sizeof(cwd));
+/* A regular file or a pipe (a here-document, say) we can read. Anything else (devices,
+directories, missing files) might act differently under cat than when handed straight to
+a program, so those stay put */
+int isReadableFile(char* path) {
+    struct stat info;
+    return stat(path, &info) == 0 && ( S_ISREG(info.st_mode) || S_ISFIFO(info.st_mode) ) 
+        && access(path, R_OK) == 0;
+}
 
-    for ( int i = 0; i < MAX_TOKENS; i++ ) {
-        addToArguments(tokens[i]);
+/* Where a stage's output ends up: the last '>' file between 'start' and 'end', or the
+shell's own stdout. Returns 1 if that's a terminal */
+int outputIsTerminal(int start, int end) {
+    char* output = NULL;
+    for ( int i = start; i < end - 1; i++ ) {
+        if ( strcmp(tokens[i], ">") == 0 ) output = tokens[i + 1];
     }
+    if ( output == NULL ) return isatty(shell_fds[1]);
+
+    // It might not exist yet, in which case it's going to be a plain file
+    int fd = open(output, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+    if ( fd == -1 ) return 0;
+    int terminal = isatty(fd);
+    close(fd);
+    return terminal;
+}
 
-    // Add a NULL terminator to the end of arguments
-    MAX_ARGUMENTS++;
-    arguments = (char**)realloc(arguments, (MAX_ARGUMENTS * sizeof(char*)));
-    arguments[MAX_ARGUMENTS - 1] = NULL;
+/* Rewrites the line in 'tokens' without its useless stages. Returns 1 if anything
+changed. Only plain pipes get looked at; a metered "|!" is there because somebody
+wants to see the data go by */
+int removeUselessStages() {
 
-    
-    for ( int i = 1; i < MAX_ARGUMENTS - 1; i++ ) {
+    if ( pipeCounter() != 1 ) return 0;
+    int pipeIndex = 0;
+    while ( strcmp(tokens[pipeIndex], "|") != 0 ) {
+        if ( strcmp(tokens[pipeIndex], "|!") == 0 ) return 0;
+        pipeIndex++;
+    }
+    if ( pipeIndex == 0 || pipeIndex == MAX_TOKENS - 1 ) return 0;
+    int right = pipeIndex + 1;
+
+    // cat FILE | cmd   ->   cmd < FILE, as long as cmd wasn't reading from somewhere else
+    if ( pipeIndex == 2 && strcmp(tokens[0], "cat") == 0 && tokens[1][0] != '-' 
+        && isReadableFile(tokens[1]) && countCarets("<", right, MAX_TOKENS) == 0 ) {
+        if ( appendRedirection("<", tokens[1]) == 1 ) return 0;
+        removeTokens(0, 3);
+        return 1;
+    }
 
-        if ( strcmp(program, "echo") == 0 ) break;
+    // cat < FILE | cmd   ->   cmd < FILE
+    if ( pipeIndex == 3 && strcmp(tokens[0], "cat") == 0 && strcmp(tokens[1], "<") == 0 
+        && isReadableFile(tokens[2]) && countCarets("<", right, MAX_TOKENS) == 0 ) {
+        if ( appendRedirection("<", tokens[2]) == 1 ) return 0;
+        removeTokens(0, 4);
+        return 1;
+    }
 
-        directory = "/usr/local/bin";  chdir(directory);
-        if (access(arguments[i], F_OK) == 0) {
-            insertPathName( executablePathBuilder(arguments[i], directory), i );
-            break;
-        }
-        directory = "/usr/bin";  chdir(directory);
-        if (access(arguments[i], F_OK) == 0) {
-            insertPathName( executablePathBuilder(arguments[i], directory), i );
-            break;
-        }
-        directory = "/bin";  chdir(directory);
-        if (access(arguments[i], F_OK) == 0) {
-            insertPathName( executablePathBuilder(arguments[i], directory), i );
+    // cat | cmd   ->   cmd, unless cmd would suddenly find itself reading a terminal
+    if ( pipeIndex == 1 && strcmp(tokens[0], "cat") == 0 && !isatty(shell_fds[0])
+        && countCarets("<", right, MAX_TOKENS) == 0 ) {
+        removeTokens(0, 2);
+        return 1;
+    }
+
+    /* cmd | cat [> FILE]   ->   cmd [> FILE]. Not when the output is a terminal, since
+    plenty of programs (ls, for one) change what they print when they see one */
+    if ( isPlainCat(right, MAX_TOKENS) && countCarets("<", right, MAX_TOKENS) == 0 
+        && countCarets(">", 0, pipeIndex) == 0 && outputIsTerminal(right, MAX_TOKENS) == 0 ) {
+        removeTokens(pipeIndex, 2);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Runs a single program with all of its redirections set up at once, instead of once
+per caret like redirectionWrapper() does. Only the last '<' and the last '>' matter,
+but the earlier ones still get opened so a missing input is still an error and an
+earlier output file still gets created, just like it would have been */
+int runRedirected() {
+
+    int fd_in = -1;
+    int fd_out = -1;
+    int status = 0;
+    char** args = (char**)malloc((MAX_TOKENS + 1) * sizeof(char*));
+    int count = 0;
+
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        if ( !isCaretSymbol(tokens[i]) ) {
+            args[count++] = tokens[i];
+            continue;
+        }
+        int input = ( strcmp(tokens[i], "<") == 0 );
+        int fd = input ? open(tokens[i + 1], O_RDONLY | O_CLOEXEC)
+                       : open(tokens[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if ( fd == -1 ) {
+            perror("open");
+            status = 1;
+            break;
+        }
+        if ( input ) {
+            if ( fd_in != -1 ) close(fd_in);
+            fd_in = fd;
+        } else {
+            if ( fd_out != -1 ) close(fd_out);
+            fd_out = fd;
+        }
+        i++;    // Skip over the file name
+    }
+    args[count] = NULL;
+
+    char* executable = NULL;
+    if ( status == 0 ) {
+        executable = findExecutable(args[0]);
+        if ( executable == NULL ) {
+            printf("Error: executable does not exist\n");
+            status = 1;
+        }
+    }
+
+    if ( status == 0 ) {
+        pid_t pid = spawnProgram(executable, args, fd_in, fd_out);
+        int wstatus = 0;
+        if ( pid == -1 ) {
+            printf("Error forking\n");
+            status = 1;
+        } else {
+            waitProgram(pid, &wstatus);
+            status = programStatus(wstatus);
+        }
+    }
+
+    if ( fd_in != -1 ) close(fd_in);
+    if ( fd_out != -1 ) close(fd_out);
+    free(executable);
+    free(args);
+    return status;
+}
+
+/* The optimizer's way into masterDirectory(). Returns -1 if the line isn't one we
+handle, and it should go through caretPipeSwitch() like always. Otherwise the line has
+been run, and we return its status like everybody else */
+int optimizePipeline() {
+
+    if ( optimize_pipelines == 0 ) return -1;
+
+    /* Anything malformed goes the normal way, so it gets the normal error messages. Same
+    goes for a lone program, since there is nothing to optimize there */
+    int symbols = 0;
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        if ( !isCaretSymbol(tokens[i]) && !isPipeSymbol(tokens[i]) ) continue;
+        if ( i == 0 || i == MAX_TOKENS - 1 || isCaretSymbol(tokens[i + 1]) 
+            || isPipeSymbol(tokens[i + 1]) ) return -1;
+        symbols++;
+    }
+    if ( symbols == 0 ) return -1;
+
+    removeUselessStages();
+
+    // Pipes that are still around get run by pipeWrapper(), same as ever
+    if ( pipeCounter() > 0 ) return -1;
+    return runRedirected();
+}
+
+
+/* ============================================================ */
+// Fan-Out Pipes //
+
+/* 'producer |+ consumer1 |+ consumer2 ...' hands everything the producer writes to every
+consumer, like 'producer | tee >(consumer1) | consumer2' would if we had those. The
+producer writes into one pipe and each consumer reads out of a pipe of its own. We sit in
+between like pipeMeter() does, except every chunk gets tee()'d into all but one of the
+consumer pipes and then splice()'d into the last one. tee() only takes another reference
+to the pages the producer wrote, so the data never gets copied into our memory.
+
+Everybody moves at the speed of the slowest consumer. We don't take the next chunk until
+every consumer has this one, so a consumer that stops reading ends up stopping the
+producer, the same as a plain pipe would. A consumer that quits early just gets dropped.
+Each consumer can have a '> file' of its own, and the producer a '< file' */
+
+#define MAX_FAN_OUT 16      // Consumers on one line
+
+typedef struct FanOutStage {
+    char** args;            // The program and its arguments, with a NULL on the end
+    char* path;             // Where the program is
+    char* file;             // '< file' for the producer, '> file' for a consumer
+    int fd;                 // 'file', once it's open
+    int pipe;               // The end of its pipe we hold: we read the producer's, write a consumer's
+    pid_t pid;
+} FanOutStage;
+
+int isFanOutSymbol(char* token) {
+    return strcmp(token, "|+") == 0;
+}
+
+int fanOutCounter() {
+    int count = 0;
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        if ( isFanOutSymbol(tokens[i]) ) count++;
+    }
+    return count;
+}
+
+void fanOutFree(FanOutStage* stages, int count) {
+    for ( int i = 0; i < count; i++ ) {
+        for ( int j = 0; stages[i].args != NULL && stages[i].args[j] != NULL; j++ ) {
+            free(stages[i].args[j]);
+        }
+        free(stages[i].args);
+        free(stages[i].path);
+        if ( stages[i].fd != -1 ) close(stages[i].fd);
+        if ( stages[i].pipe != -1 ) close(stages[i].pipe);
+    }
+}
+
+/* Splits the line into its stages at every '|+'. Returns 1 and says why if it can't */
+int fanOutParse(FanOutStage* stages, int* count) {
+
+    *count = 0;
+    if ( pipeCounter() > 0 ) {
+        printf("Error: Improper use of pipe command\n");
+        return 1;
+    }
+
+    int start = 0;
+    for ( int i = 0; i <= MAX_TOKENS; i++ ) {
+        if ( i < MAX_TOKENS && isFanOutSymbol(tokens[i]) == 0 ) continue;
+
+        // tokens[start] up to tokens[i] is one stage
+        if ( *count == MAX_FAN_OUT + 1 ) {
+            printf("Error: Only %d consumers allowed on a fan-out pipe\n", MAX_FAN_OUT);
+            return 1;
+        }
+        FanOutStage* stage = &stages[(*count)++];
+        memset(stage, 0, sizeof(FanOutStage));
+        stage->fd = -1;
+        stage->pipe = -1;
+
+        int end = start;
+        while ( end < i && isCaretSymbol(tokens[end]) == 0 ) end++;
+        if ( end == start ) {
+            printf("Error: Improper use of pipe command\n");
+            return 1;
+        }
+
+        stage->args = (char**)malloc((end - start + 1) * sizeof(char*));
+        for ( int j = start; j < end; j++ ) stage->args[j - start] = strdup(tokens[j]);
+        stage->args[end - start] = NULL;
+
+        // Whatever comes after the program has to be one redirection: '<' in, '>' out
+        if ( end < i ) {
+            int in = strcmp(tokens[end], "<") == 0;
+            if ( end + 2 != i || isCaretSymbol(tokens[end + 1]) || in != ( *count == 1 ) ) {
+                printf("Error: Improper use of redirection symbol\n");
+                return 1;
+            }
+            stage->file = tokens[end + 1];
+        }
+        start = i + 1;
+    }
+
+    if ( *count < 2 ) {
+        printf("Error: Improper use of pipe command\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Gives 'output' a copy of the first 'length' bytes waiting in 'input', without taking
+them out. Returns 1 if nobody's reading 'output' any more */
+int fanOutTee(int input, int output, size_t length, int scratch[2], int devnull) {
+
+    ssize_t copied;
+    do {
+        copied = tee(input, output, length, 0);
+    } while ( copied == -1 && errno == EINTR );
+    if ( copied == -1 ) {
+        if ( errno != EPIPE ) perror("tee");
+        return 1;
+    }
+    if ( copied == length ) return 0;
+
+    /* It only had room for part of the chunk. tee() always starts from the front of the
+    pipe, so the rest takes a detour: the whole chunk gets tee()'d into the empty scratch
+    pipe, the part they already have gets thrown away, and then the rest gets splice()'d
+    across as they make room for it. Still no copies of our own */
+    if ( scratch[0] == -1 ) {
+        if ( pipe2(scratch, O_CLOEXEC) == -1 ) {
+            perror("pipe");
+            return 1;
+        }
+        fcntl(scratch[1], F_SETPIPE_SZ, fcntl(input, F_GETPIPE_SZ));
+    }
+    if ( tee(input, scratch[1], length, 0) != length ) {
+        perror("tee");
+        return 1;
+    }
+
+    size_t skip = copied;
+    while ( skip > 0 ) {
+        ssize_t moved = splice(scratch[0], NULL, devnull, NULL, skip, SPLICE_F_MOVE);
+        if ( moved == -1 && errno == EINTR ) continue;
+        if ( moved <= 0 ) {
+            perror("splice");
+            return 1;
+        }
+        skip -= moved;
+    }
+
+    size_t left = length - copied;
+    int gone = 0;
+    while ( left > 0 ) {
+        ssize_t moved = splice(scratch[0], NULL, gone ? devnull : output, NULL, left, SPLICE_F_MOVE);
+        if ( moved > 0 ) { left -= moved; continue; }
+        if ( moved == -1 && errno == EINTR ) continue;
+        if ( moved == -1 && gone == 0 ) {
+            // They left halfway through. The rest still has to come out of the scratch pipe
+            if ( errno != EPIPE ) perror("splice");
+            gone = 1;
+            continue;
+        }
+        perror("splice");
+        return 1;
+    }
+    return gone;
+}
+
+/* Moves everything that comes out of 'input' into every consumer's pipe. Done when the
+producer is, or when there's no consumer left to take it */
+void fanOutCopy(int input, FanOutStage* consumers, int count) {
+
+    int capacity = fcntl(input, F_GETPIPE_SZ);
+    int scratch[2] = { -1, -1 };
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if ( devnull == -1 ) {
+        perror("open");
+        return;
+    }
+
+    int alive = count;
+    while ( alive > 0 ) {
+
+        // splice() and tee() can't tell us how much is waiting, so we ask first
+        struct pollfd waiting = { input, POLLIN, 0 };
+        if ( poll(&waiting, 1, -1) == -1 ) {
+            if ( errno == EINTR ) continue;
+            perror("poll");
             break;
-        }       
-        chdir(cwd);
-        if (access(arguments[i], F_OK) == 0) {
-            insertPathName( executablePathBuilder(arguments[i], cwd), i );
+        }
+        int length = 0;
+        if ( ioctl(input, FIONREAD, &length) == -1 || length == 0 ) break;    // The producer is done
+        if ( length > capacity ) length = capacity;
+
+        // Everybody but the last consumer gets a copy of the chunk
+        int last = count - 1;
+        while ( consumers[last].pipe == -1 ) last--;
+        for ( int i = 0; i < last; i++ ) {
+            if ( consumers[i].pipe == -1 ) continue;
+            if ( fanOutTee(input, consumers[i].pipe, length, scratch, devnull) == 1 ) {
+                close(consumers[i].pipe);
+                consumers[i].pipe = -1;
+                alive--;
+            }
+        }
+
+        // and the last one gets the chunk itself, which takes it out of the producer's pipe
+        int target = consumers[last].pipe;
+        while ( length > 0 ) {
+            ssize_t moved = splice(input, NULL, target, NULL, length, SPLICE_F_MOVE);
+            if ( moved > 0 ) { length -= moved; continue; }
+            if ( moved == -1 && errno == EINTR ) continue;
+            if ( moved == -1 && target != devnull ) {
+                // The last one is gone too. What's left of the chunk goes nowhere
+                if ( errno != EPIPE ) perror("splice");
+                close(consumers[last].pipe);
+                consumers[last].pipe = -1;
+                alive--;
+                target = devnull;
+                continue;
+            }
+            perror("splice");
+            alive = 0;
             break;
         }
     }
 
-    // We must change to the directory of first argument.
-    directory = "/usr/local/bin";  chdir(directory);
-    if (access(program, F_OK) == 0) {
-        executeProgram(program);
-        chdir(cwd); return 0;
+    close(devnull);
+    if ( scratch[0] != -1 ) {
+        close(scratch[0]);
+        close(scratch[1]);
     }
-    directory = "/usr/bin";  chdir(directory);
-    if (access(program, F_OK) == 0) {
-        executeProgram(program);
-        chdir(cwd); return 0;
+}
+
+int fanOut() {
+
+    FanOutStage stages[MAX_FAN_OUT + 1];
+    int count = 0;
+    if ( fanOutParse(stages, &count) == 1 ) {
+        fanOutFree(stages, count);
+        return 1;
     }
-    directory = "/bin";  chdir(directory);
-    if (access(program, F_OK) == 0) {
-        executeProgram(program);
-        chdir(cwd); return 0;
-    }       
-    
-    chdir(cwd);
-    executeProgram(program);
 
-    return 0; 
+    // Nothing starts unless everything can
+    for ( int i = 0; i < count; i++ ) {
+        stages[i].path = findExecutable(stages[i].args[0]);
+        if ( stages[i].path == NULL ) {
+            printf("Error: executable does not exist\n");
+            fanOutFree(stages, count);
+            return 1;
+        }
+        if ( stages[i].file == NULL ) continue;
+        if ( i == 0 ) stages[i].fd = open(stages[i].file, O_RDONLY | O_CLOEXEC);
+        else stages[i].fd = open(stages[i].file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+        if ( stages[i].fd == -1 ) {
+            perror("open");
+            fanOutFree(stages, count);
+            return 1;
+        }
+    }
+
+    // The consumers go first, so they're already waiting when the producer starts writing
+    int status = 0;
+    int fds[2];
+    for ( int i = 1; i < count; i++ ) {
+        if ( pipe2(fds, O_CLOEXEC) == -1 ) {
+            perror("pipe");
+            status = 1;
+            break;
+        }
+        setPipeSize(fds[0]);
+        stages[i].pid = spawnProgram(stages[i].path, stages[i].args, fds[0], stages[i].fd);
+        close(fds[0]);
+        stages[i].pipe = fds[1];
+    }
+    if ( status == 0 && pipe2(fds, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        status = 1;
+    } else if ( status == 0 ) {
+        setPipeSize(fds[0]);
+        stages[0].pid = spawnProgram(stages[0].path, stages[0].args, stages[0].fd, fds[1]);
+        close(fds[1]);
+        stages[0].pipe = fds[0];
+
+        // Consumers that quit early should give us an EPIPE, not kill us with SIGPIPE
+        sigset_t previous_mask;
+        holdSigpipe(&previous_mask);
+        if ( stages[0].pid > 0 ) fanOutCopy(stages[0].pipe, stages + 1, count - 1);
+        releaseSigpipe(&previous_mask);
+    }
+
+    // Hanging up on everybody first, so nobody waits on us while we wait on them
+    for ( int i = 0; i < count; i++ ) {
+        if ( stages[i].pipe != -1 ) close(stages[i].pipe);
+        stages[i].pipe = -1;
+    }
+
+    // Like a plain pipe, it's the consumers that decide the status. All of them have to work
+    for ( int i = 0; i < count; i++ ) {
+        if ( stages[i].pid <= 0 ) {
+            status = 1;     // Never started
+            continue;
+        }
+        int wstatus = 0;
+        waitProgram(stages[i].pid, &wstatus);
+        if ( i > 0 && programStatus(wstatus) != 0 ) status = programStatus(wstatus);
+    }
+
+    fanOutFree(stages, count);
+    return status;
+}
+
+
+/* ============================================================ */
+// File Execution Section //
+
+/* Returns the program's status, or 1 if it never got started */
+int executeProgram(char* program) {
+
+    pid_t pid = spawnProgram(program, arguments, -1, -1);
+    if ( pid == -1 ) return 1;
+    int wstatus = 0;
+    waitProgram(pid, &wstatus); // Wait for the program to finish
+    return programStatus(wstatus);
+}
+
+int executeProgramWrapper() {
+
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        addToArguments(tokens[i]);
+    }
+
+    // Add a NULL terminator to the end of arguments
+    MAX_ARGUMENTS++;
+    growArguments();
+    arguments[MAX_ARGUMENTS - 1] = NULL;
+
+    /* Look for the program in the three bin folders, then the cwd. We never leave the cwd
+    to do it, so the program runs right where the user is and its arguments can stay
+    exactly the way they were typed */
+    char* program = findExecutable(tokens[0]);
+    if ( program == NULL ) program = strdup(tokens[0]);     // execv() will tell them it's not there
+
+    int status = executeProgram(program);
+    free(program);
+    freeArguments();
+
+    return status; 
+}
+
+
+/* ============================================================ */
+// Argument Splitting //
+
+/* How many bytes of ARG_MAX one argument uses up: the string, its null terminator,
+and its slot in the argv array */
+size_t argumentCost(char* argument) {
+    return strlen(argument) + 1 + sizeof(char*);
+}
+
+/* The space execv() really has for arguments is ARG_MAX minus whatever the environment
+takes up. We also hold back some headroom, just like xargs does */
+size_t argumentSpace() {
+
+    extern char** environ;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if ( arg_max <= 0 ) arg_max = 131072;   // The smallest ARG_MAX POSIX allows us to assume
+
+    size_t used = 2048;
+    for ( int i = 0; environ[i] != NULL; i++ ) {
+        used += argumentCost(environ[i]);
+    }
+    used += sizeof(char*);  // The environment's NULL terminator
+
+    if ( used >= (size_t)arg_max ) return 0;
+    return arg_max - used;
+}
+
+/* Waits for one of the 'running' batches in 'pids' to finish, and takes it off the list.
+Returns 0 if it exited successfully */
+int reapBatch(pid_t* pids, int* running) {
+
+    /* Whichever finishes first. Under libmysh the programs other threads started are our
+    children too, so there we have to ask for one of ours by name, and it's the oldest */
+    int wstatus;
+    pid_t pid = waitProgram(embedded ? pids[0] : -1, &wstatus);
+    int done = 0;
+    while ( done < *running - 1 && pids[done] != pid ) done++;
+    memmove(&pids[done], &pids[done + 1], (*running - done - 1) * sizeof(pid_t));
+    (*running)--;
+
+    if ( pid == -1 ) {
+        perror("waitpid");
+        return 1;
+    }
+    return programStatus(wstatus);
+}
+
+/* split -jN program [options] args...
+The line has already gone through wildcard(), so the argument list can be enormous.
+If it doesn't fit in ARG_MAX, it gets cut into the biggest batches that do fit, and
+every batch runs as its own copy of the program, N at a time. The program name and any
+options in front of the first real argument are repeated in every batch.
+Returns 0 if every single batch succeeded, and 1 otherwise */
+int splitCommand() {
+
+    if ( MAX_TOKENS < 3 || strncmp(tokens[1], "-j", 2) != 0 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: split -j<jobs> <program name> <arguments>\n");
+        return 1;
+    }
+
+    char* end;
+    long jobs = strtol(tokens[1] + 2, &end, 10);
+    if ( tokens[1][2] == '\0' || *end != '\0' || jobs < 1 ) {
+        printf("Error: Improper number of jobs: \"%s\"\n", tokens[1]);
+        printf("Usage: split -j<jobs> <program name> <arguments>\n");
+        return 1;
+    }
+
+    char* executable = findExecutable(tokens[2]);
+    if ( executable == NULL ) {
+        printf("Error: executable does not exist\n");
+        return 1;
+    }
+
+    // The program name plus its leading options make up the part every batch repeats
+    int headStart = 2;
+    int itemStart = 3;
+    while ( itemStart < MAX_TOKENS && tokens[itemStart][0] == '-' ) itemStart++;
+
+    size_t space = argumentSpace();
+    size_t headCost = sizeof(char*);    // The NULL terminator
+    for ( int i = headStart; i < itemStart; i++ ) headCost += argumentCost(tokens[i]);
+
+    if ( headCost >= space ) {
+        printf("Error: Argument list too long\n");
+        free(executable);
+        return 1;
+    }
+
+    // One argv array is big enough for any batch, since no batch can hold more than every token
+    char** batch = (char**)malloc((MAX_TOKENS + 1) * sizeof(char*));
+    int headLength = itemStart - headStart;
+    for ( int i = 0; i < headLength; i++ ) batch[i] = tokens[headStart + i];
+
+    int status = 0;
+    pid_t* pids = (pid_t*)malloc(( jobs < MAX_TOKENS ? jobs : MAX_TOKENS ) * sizeof(pid_t));  // No more batches than tokens
+    int running = 0;
+    int next = itemStart;
+
+    do {
+        // Fill this batch with as many arguments as ARG_MAX will let us
+        int length = headLength;
+        size_t cost = headCost;
+        while ( next < MAX_TOKENS && cost + argumentCost(tokens[next]) <= space ) {
+            cost += argumentCost(tokens[next]);
+            batch[length++] = tokens[next++];
+        }
+        batch[length] = NULL;
+
+        if ( length == headLength && next < MAX_TOKENS ) {
+            printf("Error: Argument too long: \"%.40s...\"\n", tokens[next]);
+            status = 1;
+            break;
+        }
+
+        // Don't go over the job limit, wait for someone to finish first
+        if ( running == jobs && reapBatch(pids, &running) != 0 ) status = 1;
+
+        pid_t pid = spawnProgram(executable, batch, -1, -1);
+        if ( pid == -1 ) {
+            status = 1;
+            break;
+        }
+        pids[running++] = pid;
+
+    } while ( next < MAX_TOKENS );
+
+    // Everyone has been started. Now wait for the stragglers
+    while ( running > 0 ) {
+        if ( reapBatch(pids, &running) != 0 ) status = 1;
+    }
+
+    free(pids);
+    free(batch);
+    free(executable);
+    return status;
 }
 
 
@@ -842,372 +2543,4790 @@ int wildcardCriteria(char* token) {
     return 0;
 }
 
-/* IMPORTANT */
-/* This function adds all wildcard matches to the official token list */
-void addGlob(char* token, int arrayIndex) {
+/* IMPORTANT */
+/* This function adds all wildcard matches to the official token list. Every match gets
+spliced in right after the original wildcard token with a single resize and a single shift,
+so a directory with 100k matches costs one realloc instead of 100k of them */
+int addGlob(char** matches, size_t count, int arrayIndex) {
+
+    int insertionPoint = arrayIndex + 1;
+    if ( makeRoomForTokens(insertionPoint, count) == 1 ) return 1;
+
+    // Copy each match straight from the glob results into its new slot
+    for ( size_t i = 0; i < count; i++ ) {
+        tokens[insertionPoint + i] = strdup(matches[i]);
+        if ( tokens[insertionPoint + i] == NULL ) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+
+int globIt(char* token, int arrayIndex) {
+
+    glob_t glob_result;
+
+    // With the 'nosort' prefix, matches come back in directory order and are never sorted
+    int glob_status = glob(token, unsorted_glob ? GLOB_NOSORT : 0, 0, &glob_result);
+    if (glob_status == 0) {
+
+        // Successfully found matching files
+
+        /* The first match completely replaces the token with the wildcard character */
+        char* first_match = strdup(glob_result.gl_pathv[0]);
+        if ( first_match == NULL ) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        free(tokens[arrayIndex]);
+        tokens[arrayIndex] = first_match;
+
+        /* If there is more than one match, the rest get tacked onto the array after 
+        the original wildcard token in one go */
+        if ( glob_result.gl_pathc > 1 ) 
+        addGlob(&glob_result.gl_pathv[1], glob_result.gl_pathc - 1, arrayIndex);
+
+        globfree(&glob_result);
+
+    } else if (glob_status == GLOB_NOMATCH) {
+        // printf("No files found matching the pattern.\n");
+        // If there are no matches, we do nothing. The token remains the same.
+        return 1;
+    } else {
+        printf("Error in glob.\n");
+        return 1;
+    }
+    return 0;
+}
+
+void bareGlob(char* token, int arrayIndex) {
+
+    char cwd[4096];
+    getcwd(cwd, sizeof(cwd));
+
+    char original_token[strlen(token) + 1];
+    memcpy(original_token, token, strlen(token) + 1);
+    original_token[strlen(token)] = '\0';
+
+    char* directory;
+
+    directory = "/usr/local/bin";  chdir(directory);
+    globIt(token, arrayIndex);
+    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+
+    directory = "/usr/bin";  chdir(directory);
+    globIt(token, arrayIndex);
+    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+
+    directory = "/bin";  chdir(directory);
+    globIt(token, arrayIndex);
+    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+
+    chdir(cwd);
+}
+
+/* Check if any wildcard characters exist, and if they do, send that token to 'glob()' */
+int wildcard() {
+
+    char* token;
+    int status = 0;
+
+    for ( int i = 0; i < MAX_TOKENS; i++ ) { // Iterate through the entire array
+        token = tokens[i];
+        size_t length = strlen(token);
+
+        // One pass over the token tells us if there's a wildcard anywhere in it
+        if ( ( charClasses(token, length) & CLASS_BIT(CLASS_STAR) ) == 0 ) continue;
+
+        // Wildcard found!
+        char original_token[length + 1];
+        memcpy(original_token, token, length + 1);
+
+        if ( wildcardCriteria(token) == 1 ) return 1; // Must pass criteria
+
+        int tokens_before = MAX_TOKENS;
+
+        // If a match is found, return 0, if no match return 1.
+        status = globIt(token, i);
+
+        /* If we have a bare name that is not in the cwd, we need to go into 
+        the three bin directories to see if the file is in there */
+        int bare = 0;
+        for ( int ch = 0; ch < strlen(tokens[i]); ch++ ) {
+            if ( ch == '/' ) bare = 1;
+        }
+        // 'token' may have been freed by globIt(), so check against our copy
+        if ( bare == 0 && access(original_token, F_OK) != 0 && status == 1 ) 
+        bareGlob(original_token, i); 
+
+        // The matches we just spliced in are file names, not patterns. Skip over them
+        i += MAX_TOKENS - tokens_before;
+
+        status = 0;
+    }
+    return status;
+}
+
+
+/* ============================================================ */
+// Line Editing and Tab Completion //
+
+/* Every directory we complete from gets its own prefix trie of file names. Children of
+a node are kept in a sorted sibling list, which keeps nodes small enough to hold a
+directory with 100k entries. Nodes come out of big blocks, so a whole trie can be
+thrown away in a few free() calls when the directory changes */
+typedef struct TrieNode {
+    char ch;
+    char terminal;              // 1 if a name ends at this node
+    struct TrieNode* child;     // First child (children are sorted by character)
+    struct TrieNode* sibling;   // The next child of our parent
+} TrieNode;
+
+#define TRIE_BLOCK 4096
+
+typedef struct TrieBlock {
+    struct TrieBlock* next;
+    int used;
+    TrieNode nodes[TRIE_BLOCK];
+} TrieBlock;
+
+/* A trie is only (re)built when someone completes in that directory and its mtime,
+device, or inode has changed since the last time we looked */
+typedef struct CompletionDir {
+    char* path;                 // Absolute path, so a 'cd' doesn't confuse us
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    TrieNode root;
+    TrieBlock* blocks;
+} CompletionDir;
+
+CompletionDir** completion_dirs = NULL;
+int MAX_COMPLETION_DIRS = 0;
+
+#define MAX_CANDIDATES 256
+
+char* builtins[] = { "cd", "pwd", "which", "exit", "then", "else", "split", "nosort", "stats", "let", "unset", "bench" };
+int MAX_BUILTINS = sizeof(builtins) / sizeof(builtins[0]);
+
+struct termios original_termios;
+int raw_mode = 0;
+
+TrieNode* trieNewNode(CompletionDir* dir, char ch) {
+
+    if ( dir->blocks == NULL || dir->blocks->used == TRIE_BLOCK ) {
+        TrieBlock* block = (TrieBlock*)malloc(sizeof(TrieBlock));
+        if ( block == NULL ) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        block->next = dir->blocks;
+        block->used = 0;
+        dir->blocks = block;
+    }
+
+    TrieNode* node = &dir->blocks->nodes[dir->blocks->used++];
+    node->ch = ch;
+    node->terminal = 0;
+    node->child = NULL;
+    node->sibling = NULL;
+    return node;
+}
+
+void trieInsert(CompletionDir* dir, char* name) {
+
+    TrieNode* node = &dir->root;
+    for ( int i = 0; name[i] != '\0'; i++ ) {
+
+        // Find where this character belongs in the sorted list of children
+        TrieNode** link = &node->child;
+        while ( *link != NULL && (unsigned char)(*link)->ch < (unsigned char)name[i] ) {
+            link = &(*link)->sibling;
+        }
+        if ( *link == NULL || (*link)->ch != name[i] ) {
+            TrieNode* fresh = trieNewNode(dir, name[i]);
+            fresh->sibling = *link;
+            *link = fresh;
+        }
+        node = *link;
+    }
+    node->terminal = 1;
+}
+
+void trieFree(CompletionDir* dir) {
+    while ( dir->blocks != NULL ) {
+        TrieBlock* next = dir->blocks->next;
+        free(dir->blocks);
+        dir->blocks = next;
+    }
+    memset(&dir->root, 0, sizeof(TrieNode));
+}
+
+/* Returns the node for the last character of 'prefix', or NULL if no name starts with it */
+TrieNode* trieWalk(TrieNode* node, char* prefix, int length) {
+    for ( int i = 0; i < length && node != NULL; i++ ) {
+        TrieNode* child = node->child;
+        while ( child != NULL && child->ch != prefix[i] ) child = child->sibling;
+        node = child;
+    }
+    return node;
+}
+
+/* Appends the characters every name below 'node' agrees on to 'extension' */
+void trieExtension(TrieNode* node, char* extension, int size) {
+    int length = strlen(extension);
+    while ( node->terminal == 0 && node->child != NULL && node->child->sibling == NULL
+        && length < size - 1 ) {
+        node = node->child;
+        extension[length++] = node->ch;
+    }
+    extension[length] = '\0';
+}
+
+/* Collects whole names below 'node' into 'candidates', up to MAX_CANDIDATES of them */
+void trieCollect(TrieNode* node, char* name, int length, int size, char** candidates, int* count) {
+
+    if ( *count == MAX_CANDIDATES ) return;
+    if ( node->terminal ) {
+        name[length] = '\0';
+        candidates[(*count)++] = strdup(name);
+    }
+    if ( length >= size - 1 ) return;
+
+    for ( TrieNode* child = node->child; child != NULL; child = child->sibling ) {
+        name[length] = child->ch;
+        trieCollect(child, name, length + 1, size, candidates, count);
+    }
+}
+
+/* Hands back the trie for a directory, building it first if we don't have one yet or
+the directory has been modified since. Returns NULL if the directory can't be read */
+CompletionDir* completionDirectory(char* path) {
+
+    char absolute[BUFFSIZE * 2];
+    if ( path[0] == '/' ) {
+        snprintf(absolute, sizeof(absolute), "%s", path);
+    } else {
+        char cwd[BUFFSIZE];
+        if ( getcwd(cwd, sizeof(cwd)) == NULL ) return NULL;
+        snprintf(absolute, sizeof(absolute), "%s/%s", cwd, path);
+    }
+
+    struct stat info;
+    if ( stat(absolute, &info) != 0 || !S_ISDIR(info.st_mode) ) return NULL;
+
+    CompletionDir* dir = NULL;
+    for ( int i = 0; i < MAX_COMPLETION_DIRS; i++ ) {
+        if ( strcmp(completion_dirs[i]->path, absolute) == 0 ) dir = completion_dirs[i];
+    }
+
+    if ( dir == NULL ) {
+        dir = (CompletionDir*)calloc(1, sizeof(CompletionDir));
+        dir->path = strdup(absolute);
+        MAX_COMPLETION_DIRS++;
+        completion_dirs = (CompletionDir**)realloc(completion_dirs, MAX_COMPLETION_DIRS * sizeof(CompletionDir*));
+        completion_dirs[MAX_COMPLETION_DIRS - 1] = dir;
+    } else if ( dir->device == info.st_dev && dir->inode == info.st_ino
+        && dir->mtime.tv_sec == info.st_mtim.tv_sec && dir->mtime.tv_nsec == info.st_mtim.tv_nsec ) {
+        return dir;     // Nothing has changed, so the trie we have is still good
+    }
+
+    trieFree(dir);
+    DIR* stream = opendir(absolute);
+    if ( stream == NULL ) return NULL;
+
+    struct dirent* entry;
+    while ( (entry = readdir(stream)) != NULL ) {
+        if ( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ) continue;
+        trieInsert(dir, entry->d_name);
+    }
+    closedir(stream);
+
+    dir->device = info.st_dev;
+    dir->inode = info.st_ino;
+    dir->mtime = info.st_mtim;
+    return dir;
+}
+
+int compareCandidates(const void* a, const void* b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+/* Cuts 'common' down to the part it shares with 'other' */
+void commonPrefix(char* common, char* other) {
+    int i = 0;
+    while ( common[i] != '\0' && common[i] == other[i] ) i++;
+    common[i] = '\0';
+}
+
+/* Finds every completion for 'word'. Command names come from the three bin folders
+(the same ones we run programs from) plus our built-ins, everything else comes from
+the directory named in the word, or the cwd. The sorted, de-duplicated names go into
+'candidates', and 'extension' gets the characters all of them share after 'word'.
+Returns the number of candidates */
+int findCompletions(char* word, int isCommand, char** candidates, char* extension, int size) {
+
+    int count = 0;
+    int first = 1;
+    char name[BUFFSIZE];
+    extension[0] = '\0';
+
+    if ( isCommand ) {
+
+        char* directories[] = { "/usr/local/bin", "/usr/bin", "/bin" };
+        CompletionDir* seen[3];
+        int MAX_SEEN = 0;
+
+        for ( int i = 0; i < 3; i++ ) {
+            CompletionDir* dir = completionDirectory(directories[i]);
+            if ( dir == NULL ) continue;
+
+            // /bin is just a link to /usr/bin on a lot of systems, don't count it twice
+            int duplicate = 0;
+            for ( int j = 0; j < MAX_SEEN; j++ ) {
+                if ( seen[j]->device == dir->device && seen[j]->inode == dir->inode ) duplicate = 1;
+            }
+            if ( duplicate ) continue;
+            seen[MAX_SEEN++] = dir;
+
+            TrieNode* node = trieWalk(&dir->root, word, strlen(word));
+            if ( node == NULL ) continue;
+
+            char forced[BUFFSIZE] = "";
+            trieExtension(node, forced, sizeof(forced));
+            if ( first ) { snprintf(extension, size, "%s", forced); first = 0; }
+            else commonPrefix(extension, forced);
+
+            memcpy(name, word, strlen(word));
+            trieCollect(node, name, strlen(word), sizeof(name), candidates, &count);
+        }
+
+        for ( int i = 0; i < MAX_BUILTINS && count < MAX_CANDIDATES; i++ ) {
+            if ( strncmp(builtins[i], word, strlen(word)) != 0 ) continue;
+            if ( first ) { snprintf(extension, size, "%s", builtins[i] + strlen(word)); first = 0; }
+            else commonPrefix(extension, builtins[i] + strlen(word));
+            candidates[count++] = strdup(builtins[i]);
+        }
+
+    } else {
+
+        // Split the word into the directory to look in and the start of the file name
+        char* slash = strrchr(word, '/');
+        char directory[BUFFSIZE];
+        char* prefix = word;
+
+        if ( slash == NULL ) {
+            snprintf(directory, sizeof(directory), ".");
+        } else {
+            snprintf(directory, sizeof(directory), "%.*s", (int)(slash - word + 1), word);
+            prefix = slash + 1;
+        }
+
+        CompletionDir* dir = completionDirectory(directory);
+        if ( dir == NULL ) return 0;
+
+        TrieNode* node = trieWalk(&dir->root, prefix, strlen(prefix));
+        if ( node == NULL ) return 0;
+
+        trieExtension(node, extension, size);
+        memcpy(name, prefix, strlen(prefix));
+        trieCollect(node, name, strlen(prefix), sizeof(name), candidates, &count);
+    }
+
+    // Sort and drop the duplicates
+    qsort(candidates, count, sizeof(char*), compareCandidates);
+    int unique = 0;
+    for ( int i = 0; i < count; i++ ) {
+        if ( unique > 0 && strcmp(candidates[unique - 1], candidates[i]) == 0 ) {
+            free(candidates[i]);
+            continue;
+        }
+        candidates[unique++] = candidates[i];
+    }
+    return unique;
+}
+
+void disableRawMode() {
+    if ( raw_mode ) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+        raw_mode = 0;
+    }
+}
+
+int enableRawMode() {
+
+    static int registered = 0;
+    if ( tcgetattr(STDIN_FILENO, &original_termios) == -1 ) return 1;
+    if ( registered == 0 ) { atexit(disableRawMode); registered = 1; }
+
+    struct termios raw = original_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    if ( tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1 ) return 1;
+    raw_mode = 1;
+    return 0;
+}
+
+/* Redraws the line from the cursor onward, which is all that changes for most edits,
+then puts the cursor back where it belongs */
+void redrawTail(char* buffer, int length, int cursor) {
+    char sequence[32];
+    write(STDOUT_FILENO, buffer + cursor, length - cursor);
+    write(STDOUT_FILENO, "\x1b[K", 3);
+    if ( length > cursor ) {
+        int size = snprintf(sequence, sizeof(sequence), "\x1b[%dD", length - cursor);
+        write(STDOUT_FILENO, sequence, size);
+    }
+}
+
+/* Redraws everything, prompt included. Only needed after we print a list of completions */
+void redrawLine(char* prompt, char* buffer, int length, int cursor) {
+    write(STDOUT_FILENO, "\r", 1);
+    write(STDOUT_FILENO, prompt, strlen(prompt));
+    redrawTail(buffer, length, 0);
+    if ( cursor > 0 ) {
+        char sequence[32];
+        int size = snprintf(sequence, sizeof(sequence), "\x1b[%dC", cursor);
+        write(STDOUT_FILENO, sequence, size);
+    }
+}
+
+void moveCursor(int* cursor, int position) {
+    char sequence[32];
+    int size;
+    if ( position < *cursor ) size = snprintf(sequence, sizeof(sequence), "\x1b[%dD", *cursor - position);
+    else if ( position > *cursor ) size = snprintf(sequence, sizeof(sequence), "\x1b[%dC", position - *cursor);
+    else return;
+    write(STDOUT_FILENO, sequence, size);
+    *cursor = position;
+}
+
+/* Handles a Tab. Fills in as much of the word under the cursor as we can, and on a
+second Tab in a row with nothing left to fill in, prints out every candidate */
+void completeWord(char* prompt, char** buffer, int* length, int* capacity, int* cursor, int listing) {
+
+    // Find the start of the word we are completing
+    int start = *cursor;
+    while ( start > 0 && (*buffer)[start - 1] != ' ' ) start--;
+
+    // It's a command name if nothing but spaces (or a pipe) comes before it
+    int isCommand = 1;
+    for ( int i = start - 1; i >= 0; i-- ) {
+        if ( (*buffer)[i] == '|' ) break;
+        if ( (*buffer)[i] != ' ' ) { isCommand = 0; break; }
+    }
+
+    char word[BUFFSIZE];
+    snprintf(word, sizeof(word), "%.*s", *cursor - start, *buffer + start);
+    if ( strchr(word, '/') != NULL ) isCommand = 0;
+
+    char* candidates[MAX_CANDIDATES];
+    char extension[BUFFSIZE];
+    int count = findCompletions(word, isCommand, candidates, extension, sizeof(extension));
+
+    if ( count == 0 ) {
+        write(STDOUT_FILENO, "\a", 1);
+        return;
+    }
+
+    if ( count == 1 ) {
+        // The one and only match. Directories get a slash, everything else a space
+        char* slash = strrchr(word, '/');
+        char path[BUFFSIZE * 2];
+        struct stat info;
+        snprintf(path, sizeof(path), "%.*s%s", slash ? (int)(slash - word + 1) : 0, word, candidates[0]);
+        int directory = !isCommand && stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+        strncat(extension, directory ? "/" : " ", sizeof(extension) - strlen(extension) - 1);
+    }
+
+    int added = strlen(extension);
+    if ( added > 0 ) {
+        while ( *length + added + 1 > *capacity ) {
+            *capacity *= 2;
+            *buffer = (char*)realloc(*buffer, *capacity);
+        }
+        memmove(*buffer + *cursor + added, *buffer + *cursor, *length - *cursor);
+        memcpy(*buffer + *cursor, extension, added);
+        *length += added;
+        if ( *cursor + added == *length ) {     // At the end of the line, just echo it
+            write(STDOUT_FILENO, extension, added);
+            *cursor += added;
+        } else {
+            redrawTail(*buffer, *length, *cursor);
+            moveCursor(cursor, *cursor + added);
+        }
+    } else if ( listing ) {
+        write(STDOUT_FILENO, "\r\n", 2);
+        int column = 0;
+        for ( int i = 0; i < count; i++ ) {
+            char* name = candidates[i];
+            if ( column + strlen(name) + 2 > 80 && column > 0 ) {
+                write(STDOUT_FILENO, "\r\n", 2);
+                column = 0;
+            }
+            write(STDOUT_FILENO, name, strlen(name));
+            write(STDOUT_FILENO, "  ", 2);
+            column += strlen(name) + 2;
+        }
+        if ( count == MAX_CANDIDATES ) write(STDOUT_FILENO, "...", 3);
+        write(STDOUT_FILENO, "\r\n", 2);
+        redrawLine(prompt, *buffer, *length, *cursor);
+    } else {
+        write(STDOUT_FILENO, "\a", 1);
+    }
+
+    for ( int i = 0; i < count; i++ ) free(candidates[i]);
+}
+
+/* Reads one line from the terminal in raw mode, echoing and editing it ourselves.
+Returns a malloc'd line with no newline on the end */
+char* editLine(char* prompt) {
+
+    int capacity = 128;
+    int length = 0;
+    int cursor = 0;
+    int lastWasTab = 0;
+    char* buffer = (char*)malloc(capacity);
+
+    if ( enableRawMode() == 1 ) {
+        free(buffer);
+        return NULL;
+    }
+
+    while ( 1 ) {
+        char c;
+        int bytes = read(STDIN_FILENO, &c, 1);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) {
+            // The terminal went away. Treat it like an exit
+            disableRawMode();
+            free(buffer);
+            input_ended = 1;
+            return strdup("exit");
+        }
+
+        int isTab = ( c == '\t' );
+
+        if ( c == '\r' || c == '\n' ) {                 // Enter
+            write(STDOUT_FILENO, "\r\n", 2);
+            break;
+        } else if ( c == '\t' ) {                       // Tab
+            completeWord(prompt, &buffer, &length, &capacity, &cursor, lastWasTab);
+        } else if ( c == 127 || c == 8 ) {              // Backspace
+            if ( cursor > 0 ) {
+                memmove(buffer + cursor - 1, buffer + cursor, length - cursor);
+                length--;
+                moveCursor(&cursor, cursor - 1);
+                redrawTail(buffer, length, cursor);
+            }
+        } else if ( c == 4 ) {                          // Ctrl-D
+            if ( length == 0 ) {
+                write(STDOUT_FILENO, "\r\n", 2);
+                disableRawMode();
+                free(buffer);
+                input_ended = 1;
+                return strdup("exit");
+            }
+            if ( cursor < length ) {
+                memmove(buffer + cursor, buffer + cursor + 1, length - cursor - 1);
+                length--;
+                redrawTail(buffer, length, cursor);
+            }
+        } else if ( c == 3 ) {                          // Ctrl-C throws the line away
+            write(STDOUT_FILENO, "^C\r\n", 4);
+            length = 0;
+            break;
+        } else if ( c == 1 ) {                          // Ctrl-A
+            moveCursor(&cursor, 0);
+        } else if ( c == 5 ) {                          // Ctrl-E
+            moveCursor(&cursor, length);
+        } else if ( c == 2 ) {                          // Ctrl-B
+            if ( cursor > 0 ) moveCursor(&cursor, cursor - 1);
+        } else if ( c == 6 ) {                          // Ctrl-F
+            if ( cursor < length ) moveCursor(&cursor, cursor + 1);
+        } else if ( c == 11 ) {                         // Ctrl-K
+            length = cursor;
+            redrawTail(buffer, length, cursor);
+        } else if ( c == 21 ) {                         // Ctrl-U
+            memmove(buffer, buffer + cursor, length - cursor);
+            length -= cursor;
+            moveCursor(&cursor, 0);
+            redrawTail(buffer, length, cursor);
+        } else if ( c == 23 ) {                         // Ctrl-W
+            int start = cursor;
+            while ( start > 0 && buffer[start - 1] == ' ' ) start--;
+            while ( start > 0 && buffer[start - 1] != ' ' ) start--;
+            memmove(buffer + start, buffer + cursor, length - cursor);
+            length -= cursor - start;
+            moveCursor(&cursor, start);
+            redrawTail(buffer, length, cursor);
+        } else if ( c == 12 ) {                         // Ctrl-L
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            redrawLine(prompt, buffer, length, cursor);
+        } else if ( c == 27 ) {                         // Escape sequences (arrow keys and friends)
+            char sequence[3];
+            if ( read(STDIN_FILENO, &sequence[0], 1) != 1 ) continue;
+            if ( read(STDIN_FILENO, &sequence[1], 1) != 1 ) continue;
+            if ( sequence[0] == '[' && sequence[1] >= '0' && sequence[1] <= '9' ) {
+                if ( read(STDIN_FILENO, &sequence[2], 1) != 1 || sequence[2] != '~' ) continue;
+                if ( sequence[1] == '1' || sequence[1] == '7' ) moveCursor(&cursor, 0);
+                if ( sequence[1] == '4' || sequence[1] == '8' ) moveCursor(&cursor, length);
+                if ( sequence[1] == '3' && cursor < length ) {   // Delete
+                    memmove(buffer + cursor, buffer + cursor + 1, length - cursor - 1);
+                    length--;
+                    redrawTail(buffer, length, cursor);
+                }
+            } else if ( sequence[0] == '[' || sequence[0] == 'O' ) {
+                if ( sequence[1] == 'C' && cursor < length ) moveCursor(&cursor, cursor + 1);
+                if ( sequence[1] == 'D' && cursor > 0 ) moveCursor(&cursor, cursor - 1);
+                if ( sequence[1] == 'H' ) moveCursor(&cursor, 0);
+                if ( sequence[1] == 'F' ) moveCursor(&cursor, length);
+            }
+        } else if ( (unsigned char)c >= 32 ) {          // Plain old characters
+            if ( length + 2 > capacity ) {
+                capacity *= 2;
+                buffer = (char*)realloc(buffer, capacity);
+            }
+            memmove(buffer + cursor + 1, buffer + cursor, length - cursor);
+            buffer[cursor] = c;
+            length++;
+            if ( cursor == length - 1 ) {
+                write(STDOUT_FILENO, &c, 1);    // Typing at the end is just an echo
+                cursor++;
+            } else {
+                redrawTail(buffer, length, cursor);
+                moveCursor(&cursor, cursor + 1);
+            }
+        }
+
+        lastWasTab = isTab;
+    }
+
+    disableRawMode();
+    buffer[length] = '\0';
+    return buffer;
+}
+
+
+/* ============================================================ */
+// Input Processing Functions //
+
+/* This function takes the user input as a string, and indexes each token in 'tokens[]' */
+void stringToArray(const char *originalString, const char *delimiter, char **stringArray, int *numSubstrings) {
+
+    char *token;
+    *numSubstrings = 0;
+    int MAX_SUBSTRINGS = MAX_TOKENS;
+
+    // Tokenize the string based on the delimiter
+    char* rest = NULL;
+    token = strtok_r((char *)originalString, delimiter, &rest);
+    
+    // Store each token as a substring in the string array
+    while ( token != NULL && *numSubstrings < MAX_SUBSTRINGS ) {
+
+        stringArray[*numSubstrings] = (char *)malloc(((strlen(token)+1)) * sizeof(char));
+
+        if ( stringArray[*numSubstrings] == NULL ) {
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(stringArray[*numSubstrings], token, strlen(token) + 1);  // The '\0' comes along too
+        (*numSubstrings)++;
+        token = strtok_r(NULL, delimiter, &rest);
+    }
+}
+
+/* This function just sets things up before calling 'stringToArray()' */
+void stringToArrayWrapper() {
+
+    int numSubstrings;
+    const char delimiter[] = " ";
+    char originalString[strlen(line) + 1];
+    memcpy(originalString, line, strlen(line) + 1);
+
+    // Create space for each token in 'line'
+    // 'tokens' is a global array that can be accessed anywhere
+    tokens = (char**)malloc(MAX_TOKENS * sizeof(char *));
+    
+    stringToArray(originalString, delimiter, tokens, &numSubstrings);
+}
+
+/* This is an important function. If there are any carets or pipes that rub up 
+against a token, it will separate them with a space */
+void makeSpaceForJesus() {
+
+    CharMap* map = lineMap();
+    size_t len = map->length;
+    unsigned targets = CLASS_BIT(CLASS_PIPE) | CLASS_BIT(CLASS_CARET);
+
+    // Two spaces for each target character, worked out from the map instead of another pass
+    size_t newSize = len + 2 * charMapCount(map, targets) + 1;
+    char *temp = (char *)malloc(newSize * sizeof(char));
+    if (temp == NULL) {
+        perror("Memory allocation failed");
+        return;
+    }
+
+    // Copy everything in between the targets in one go
+    size_t j = 0;
+    size_t i = 0;
+    while ( i < len ) {
+        size_t next = charMapNext(map, targets, i);
+        memcpy(temp + j, line + i, next - i);
+        j += next - i;
+        if ( next == len ) break;
+
+        if (line[next] == '|' && ( line[next + 1] == '!' || line[next + 1] == '+' )) {
+            temp[j++] = ' ';      // A metered pipe "|!" or a fan-out "|+" stays together as one token
+            temp[j++] = '|';
+            temp[j++] = line[next + 1];
+            temp[j++] = ' ';
+            i = next + 2;
+        } else {
+            temp[j++] = ' ';      // Add space before the target character
+            temp[j++] = line[next];  // Add the target character
+            temp[j++] = ' ';      // Add space after the target character
+            i = next + 1;
+        }
+    }
+    temp[j] = '\0'; // Add null terminator to mark the end of the new string
+
+    free(line);
+    line = temp;
+    forgetLineMap();
+}
+
+/* Convert user input to a char array and store in memory. On a terminal the line editor
+does the reading. Otherwise the input is read in big chunks and handed out one line at
+a time, so piped input with many lines in one read() doesn't get mashed together */
+char* readInput(char* prompt) {
+
+    static char buffer[BUFFSIZE];
+    static int start = 0;
+    static int end = 0;
+
+    write(STDOUT_FILENO, prompt, strlen(prompt));
+
+    if ( isatty(STDIN_FILENO) ) {
+        line = editLine(prompt);
+        if ( line != NULL ) return line;
+        // If the terminal won't go into raw mode, fall back to plain reads
+    }
+
+    int length = 0;
+    int capacity = 128;
+    line = malloc(capacity);
+
+    while ( 1 ) {
+        if ( start == end ) {
+            int bytes = read(STDIN_FILENO, buffer, BUFFSIZE);
+            if ( bytes == -1 && errno == EINTR ) continue;
+            if ( bytes == -1 ) {
+                perror("Error reading input");
+                exit(EXIT_FAILURE);
+            }
+            if ( bytes == 0 ) {     // End of input. Leave like the user typed 'exit'
+                if ( length == 0 ) {
+                    free(line);
+                    line = strdup("exit");
+                    input_ended = 1;
+                    return line;
+                }
+                break;
+            }
+            start = 0;
+            end = bytes;
+        }
+
+        char* newline = memchr(buffer + start, '\n', end - start);
+        int chunk = ( newline != NULL ) ? newline - (buffer + start) : end - start;
+
+        if ( length + chunk + 1 > capacity ) {
+            while ( length + chunk + 1 > capacity ) capacity *= 2;
+            line = realloc(line, capacity);
+        }
+        memcpy(line + length, buffer + start, chunk);
+        length += chunk;
+        start += chunk;
+
+        if ( newline != NULL ) {
+            start++;    // Skip over the newline itself
+            break;
+        }
+    }
+
+    line[length] = '\0';
+    return line;
+}
+
+
+/* ============================================================ */
+// Variables and Arithmetic //
+
+/* NAME=value sets a shell variable, and $NAME or ${NAME} anywhere in a token gets
+replaced with its value (or the environment's, if the shell doesn't have one) before
+wildcards are expanded. $? is the last exit status.
+$((expression)) and 'let expression...' do integer math right here in the shell, so
+counting in a loop doesn't cost an 'expr' process every time around. Expressions take
++ - * / % ( ), comparisons, && || !, and the assignments = += -= *= /= %=.
+Variables can be used with or without the $ */
+
+int matchingParen(char* text, int open);    // Down in Process Substitution
+
+typedef struct Variable {
+    char* name;         // NULL for an empty slot
+    char* value;
+} Variable;
+
+MYSH_LOCAL Variable* variables = NULL;     // Open addressing, and the size is always a power of two
+MYSH_LOCAL int MAX_VARIABLES = 0;          // Slots
+MYSH_LOCAL int variable_count = 0;         // Slots in use
+
+unsigned int hashName(const char* name, int length) {
+    unsigned int hash = 2166136261u;    // FNV-1a
+    for ( int i = 0; i < length; i++ ) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Finds the slot for the first 'length' characters of 'name': either the one holding it,
+or the empty one where it would go */
+Variable* variableSlot(const char* name, int length) {
+    unsigned int index = hashName(name, length) & ( MAX_VARIABLES - 1 );
+    while ( variables[index].name != NULL ) {
+        if ( strncmp(variables[index].name, name, length) == 0 && variables[index].name[length] == '\0' ) break;
+        index = ( index + 1 ) & ( MAX_VARIABLES - 1 );
+    }
+    return &variables[index];
+}
+
+/* Returns the value of the variable named by the first 'length' characters of 'name',
+or NULL if there isn't one */
+char* getVariable(const char* name, int length) {
+    if ( MAX_VARIABLES > 0 ) {
+        Variable* slot = variableSlot(name, length);
+        if ( slot->name != NULL ) return slot->value;
+    }
+    char copy[length + 1];
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    return getenv(copy);
+}
+
+void setVariable(const char* name, int length, const char* value) {
+
+    // Keep it under 3/4 full, so nobody has to walk far to find their slot
+    if ( ( variable_count + 1 ) * 4 > MAX_VARIABLES * 3 ) {
+        Variable* old = variables;
+        int oldSize = MAX_VARIABLES;
+        MAX_VARIABLES = ( MAX_VARIABLES == 0 ) ? 64 : MAX_VARIABLES * 2;
+        variables = (Variable*)calloc(MAX_VARIABLES, sizeof(Variable));
+        for ( int i = 0; i < oldSize; i++ ) {
+            if ( old[i].name != NULL ) *variableSlot(old[i].name, strlen(old[i].name)) = old[i];
+        }
+        free(old);
+    }
+
+    Variable* slot = variableSlot(name, length);
+    if ( slot->name == NULL ) {
+        slot->name = strndup(name, length);
+        variable_count++;
+    } else {
+        free(slot->value);
+    }
+    slot->value = strdup(value);
+}
+
+void unsetVariable(const char* name) {
+    if ( MAX_VARIABLES == 0 ) return;
+    Variable* slot = variableSlot(name, strlen(name));
+    if ( slot->name == NULL ) return;
+    free(slot->name);
+    free(slot->value);
+    slot->name = NULL;
+    variable_count--;
+
+    // Everyone after it in the same run might have been pushed past this slot. Put them back
+    int index = ( slot - variables + 1 ) & ( MAX_VARIABLES - 1 );
+    while ( variables[index].name != NULL ) {
+        Variable moved = variables[index];
+        variables[index].name = NULL;
+        *variableSlot(moved.name, strlen(moved.name)) = moved;
+        index = ( index + 1 ) & ( MAX_VARIABLES - 1 );
+    }
+}
+
+int isNameStart(char c) { return isalpha(c) || c == '_'; }
+int isNameChar(char c) { return isalnum(c) || c == '_'; }
+
+/* The arithmetic itself: a little recursive descent parser that works out the value as it goes */
+typedef struct Expression {
+    char* text;
+    int at;
+    int error;      // Set once something goes wrong. Everything after that is ignored
+} Expression;
+
+long long evaluateAssignment(Expression* expression);
+
+void skipSpaces(Expression* expression) {
+    while ( isspace(expression->text[expression->at]) ) expression->at++;
+}
+
+/* Is 'op' next? If it is, step over it */
+int nextIs(Expression* expression, char* op) {
+    skipSpaces(expression);
+    int length = strlen(op);
+    if ( strncmp(expression->text + expression->at, op, length) != 0 ) return 0;
+    // Don't mistake the start of "<=" for "<", or "==" for "="
+    char after = expression->text[expression->at + length];
+    if ( ( length == 1 && strchr("<>=!", op[0]) && after == '=' ) 
+      || ( length == 1 && strchr("&|", op[0]) && after == op[0] ) ) return 0;
+    expression->at += length;
+    return 1;
+}
+
+long long evaluatePrimary(Expression* expression) {
+
+    skipSpaces(expression);
+    char* text = expression->text + expression->at;
+
+    if ( *text == '(' ) {
+        expression->at++;
+        long long value = evaluateAssignment(expression);
+        if ( !nextIs(expression, ")") ) expression->error = 1;
+        return value;
+    }
+
+    if ( isdigit(*text) ) {
+        char* end;
+        long long value = strtoll(text, &end, 0);
+        expression->at += end - text;
+        return value;
+    }
+
+    if ( *text == '$' ) { text++; expression->at++; }
+    if ( isNameStart(*text) ) {
+        int length = 0;
+        while ( isNameChar(text[length]) ) length++;
+        expression->at += length;
+        char* value = getVariable(text, length);
+        return ( value == NULL ) ? 0 : strtoll(value, NULL, 0);
+    }
+
+    expression->error = 1;
+    return 0;
+}
+
+long long evaluateUnary(Expression* expression) {
+    if ( nextIs(expression, "-") ) return -evaluateUnary(expression);
+    if ( nextIs(expression, "+") ) return evaluateUnary(expression);
+    if ( nextIs(expression, "!") ) return !evaluateUnary(expression);
+    return evaluatePrimary(expression);
+}
+
+long long evaluateProduct(Expression* expression) {
+    long long value = evaluateUnary(expression);
+    while ( !expression->error ) {
+        int op;
+        if ( nextIs(expression, "*") ) op = '*';
+        else if ( nextIs(expression, "/") ) op = '/';
+        else if ( nextIs(expression, "%") ) op = '%';
+        else break;
+        long long right = evaluateUnary(expression);
+        if ( op == '*' ) { value *= right; continue; }
+        if ( right == 0 ) {
+            printf("Error: Division by zero\n");
+            expression->error = 2;      // Already reported
+            return 0;
+        }
+        value = ( op == '/' ) ? value / right : value % right;
+    }
+    return value;
+}
+
+long long evaluateSum(Expression* expression) {
+    long long value = evaluateProduct(expression);
+    while ( !expression->error ) {
+        if ( nextIs(expression, "+") ) value += evaluateProduct(expression);
+        else if ( nextIs(expression, "-") ) value -= evaluateProduct(expression);
+        else break;
+    }
+    return value;
+}
+
+long long evaluateComparison(Expression* expression) {
+    long long value = evaluateSum(expression);
+    while ( !expression->error ) {
+        if ( nextIs(expression, "<=") ) value = value <= evaluateSum(expression);
+        else if ( nextIs(expression, ">=") ) value = value >= evaluateSum(expression);
+        else if ( nextIs(expression, "<") ) value = value < evaluateSum(expression);
+        else if ( nextIs(expression, ">") ) value = value > evaluateSum(expression);
+        else if ( nextIs(expression, "==") ) value = value == evaluateSum(expression);
+        else if ( nextIs(expression, "!=") ) value = value != evaluateSum(expression);
+        else break;
+    }
+    return value;
+}
+
+long long evaluateLogic(Expression* expression) {
+    long long value = evaluateComparison(expression);
+    while ( !expression->error ) {
+        // Both sides always get evaluated, which only matters if the right one assigns something
+        if ( nextIs(expression, "&&") ) { long long right = evaluateComparison(expression); value = value && right; }
+        else if ( nextIs(expression, "||") ) { long long right = evaluateComparison(expression); value = value || right; }
+        else break;
+    }
+    return value;
+}
+
+long long evaluateAssignment(Expression* expression) {
+
+    // NAME op= ...? Otherwise put things back the way they were and evaluate it normally
+    skipSpaces(expression);
+    int start = expression->at;
+    char* name = expression->text + start;
+    int length = 0;
+    while ( isNameStart(name[0]) && isNameChar(name[length]) ) length++;
+
+    if ( length > 0 ) {
+        expression->at += length;
+        char* ops[] = { "=", "+=", "-=", "*=", "/=", "%=" };
+        for ( int i = 0; i < 6; i++ ) {
+            if ( !nextIs(expression, ops[i]) ) continue;
+            long long value = evaluateAssignment(expression);
+            if ( expression->error ) return 0;
+
+            char* current = getVariable(name, length);
+            long long old = ( current == NULL ) ? 0 : strtoll(current, NULL, 0);
+            if ( ( ops[i][0] == '/' || ops[i][0] == '%' ) && value == 0 ) {
+                printf("Error: Division by zero\n");
+                expression->error = 2;
+                return 0;
+            }
+            switch ( ops[i][0] ) {
+                case '+': value = old + value; break;
+                case '-': value = old - value; break;
+                case '*': value = old * value; break;
+                case '/': value = old / value; break;
+                case '%': value = old % value; break;
+            }
+
+            char number[32];
+            snprintf(number, sizeof(number), "%lld", value);
+            setVariable(name, length, number);
+            return value;
+        }
+        expression->at = start;
+    }
+    return evaluateLogic(expression);
+}
+
+/* Works out 'text'. Returns 0 and fills in 'value', or returns 1 after printing an error */
+int evaluate(char* text, long long* value) {
+    Expression expression = { text, 0, 0 };
+    *value = evaluateAssignment(&expression);
+    skipSpaces(&expression);
+    if ( expression.error == 0 && text[expression.at] != '\0' ) expression.error = 1;
+    if ( expression.error == 1 ) printf("Error: Bad arithmetic expression: \"%s\"\n", text);
+    return ( expression.error == 0 ) ? 0 : 1;
+}
+
+/* Replaces every $((expression)) in 'line' with its value. This happens before anything
+else touches the line, since the tokenizer would pull "<" and ">" apart, and $(cmd)
+would take "$((" for one of its own. Returns 1 on a bad expression */
+int arithmeticExpansion() {
+
+    char* start;
+    while ( ( start = strstr(line, "$((") ) != NULL ) {
+
+        int open = start - line;
+        int closing = matchingParen(line, open + 1);
+        if ( closing == -1 || line[closing - 1] != ')' ) {
+            printf("Error: Unterminated arithmetic expansion\n");
+            return 1;
+        }
+
+        // The expression is everything between "$((" and "))"
+        char* text = strndup(line + open + 3, closing - open - 4);
+        long long value;
+        int status = evaluate(text, &value);
+        free(text);
+        if ( status == 1 ) return 1;
+
+        char number[32];
+        int numberLength = snprintf(number, sizeof(number), "%lld", value);
+        int restLength = strlen(line + closing + 1);
+        char* replaced = malloc(open + numberLength + restLength + 1);
+        memcpy(replaced, line, open);
+        memcpy(replaced + open, number, numberLength);
+        memcpy(replaced + open + numberLength, line + closing + 1, restLength + 1);
+        free(line);
+        line = replaced;
+    }
+    return 0;
+}
+
+/* Returns a malloc'd copy of 'token' with $NAME, ${NAME} and $? filled in. Names that
+aren't set turn into nothing. Anything else after a '$' is left alone */
+char* expandToken(char* token) {
+
+    size_t capacity = strlen(token) + 16;
+    size_t length = 0;
+    char* expanded = malloc(capacity);
+    char status[16];
+
+    for ( int i = 0; token[i] != '\0'; i++ ) {
+        char* value = NULL;
+        int skip = 0;       // How much of the token the reference took up, past the '$'
+
+        if ( token[i] == '$' && token[i + 1] == '?' ) {
+            snprintf(status, sizeof(status), "%d", exit_status < 0 ? 0 : exit_status);
+            value = status;
+            skip = 1;
+        } else if ( token[i] == '$' && token[i + 1] == '{' && strchr(token + i, '}') != NULL ) {
+            int length = strchr(token + i, '}') - ( token + i + 2 );
+            value = getVariable(token + i + 2, length);
+            if ( value == NULL ) value = "";
+            skip = length + 2;
+        } else if ( token[i] == '$' && isNameStart(token[i + 1]) ) {
+            int length = 1;
+            while ( isNameChar(token[i + 1 + length]) ) length++;
+            value = getVariable(token + i + 1, length);
+            if ( value == NULL ) value = "";
+            skip = length;
+        }
+
+        if ( value == NULL ) {
+            if ( length + 2 > capacity ) expanded = realloc(expanded, capacity *= 2);
+            expanded[length++] = token[i];
+            continue;
+        }
+        while ( length + strlen(value) + 2 > capacity ) expanded = realloc(expanded, capacity *= 2);
+        memcpy(expanded + length, value, strlen(value));
+        length += strlen(value);
+        i += skip;
+    }
+    expanded[length] = '\0';
+    return expanded;
+}
+
+/* Expands the variables in every token. Tokens that end up empty are dropped */
+void expandVariables() {
+    int kept = 0;
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        if ( strchr(tokens[i], '$') == NULL ) {
+            tokens[kept++] = tokens[i];
+            continue;
+        }
+        char* expanded = expandToken(tokens[i]);
+        free(tokens[i]);
+        if ( expanded[0] == '\0' ) { free(expanded); continue; }
+        tokens[kept++] = expanded;
+    }
+    MAX_TOKENS = kept;
+}
+
+/* Is 'token' a NAME=value assignment? */
+int isAssignment(char* token) {
+    if ( !isNameStart(token[0]) ) return 0;
+    int i = 1;
+    while ( isNameChar(token[i]) ) i++;
+    return token[i] == '=';
+}
+
+/* A line of nothing but NAME=value assignments */
+int assignVariables() {
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        char* equals = strchr(tokens[i], '=');
+        setVariable(tokens[i], equals - tokens[i], equals + 1);
+    }
+    return 0;
+}
+
+/* 'let' takes the rest of its command as arithmetic, so a '<', '>', '|' or '&&' in there
+is a comparison or a logical operator, not a redirection, a pipe or a list. What ends it
+is a ';', or a '&&' or '||' standing on its own between spaces, since that can't be an
+expression: 'let i<3 && echo more'. If 'text' starts a let command, returns how long the
+command is. Returns 0 if it isn't one */
+int letLength(char* text) {
+    char* start = text;
+    while ( isspace(*start) ) start++;
+    if ( strncmp(start, "let", 3) != 0 || !isspace(start[3]) ) return 0;
+
+    int i = start + 3 - text;
+    for ( ; text[i] != '\0' && text[i] != ';'; i++ ) {
+        if ( isspace(text[i - 1]) && ( text[i] == '&' || text[i] == '|' ) && text[i + 1] == text[i] 
+            && ( text[i + 2] == '\0' || isspace(text[i + 2]) ) ) break;
+    }
+    return i;
+}
+
+/* let expression [expression...]
+Each argument is one expression, split at spaces only. Like bash, the status is 0 if the
+last expression came out non-zero, and 1 if it was zero */
+int letCommand() {
+    if ( MAX_TOKENS < 2 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: let <expression> [expression...]\n");
+        return 1;
+    }
+    long long value = 0;
+    for ( int i = 1; i < MAX_TOKENS; i++ ) {
+        if ( evaluate(tokens[i], &value) == 1 ) return 1;
+    }
+    return ( value != 0 ) ? 0 : 1;
+}
+
+/* unset NAME... */
+int unsetCommand() {
+    if ( MAX_TOKENS < 2 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: unset <name> [name...]\n");
+        return 1;
+    }
+    for ( int i = 1; i < MAX_TOKENS; i++ ) unsetVariable(tokens[i]);
+    return 0;
+}
+
+
+/* ============================================================ */
+// Functions //
+
+/* name() {
+       commands...
+   }
+A function's body gets tokenized once, when it's defined, and stored as a plan. Calling
+it just copies those tokens into 'tokens' (filling in $1, $2... along the way) and sends
+each line through masterDirectory(), all inside the shell. Nothing gets forked unless
+the body runs a program itself. Lines with $(cmd), <(cmd) or >(cmd) in them have to be
+picked apart fresh every time, so those are kept as plain text and run through processLine() */
+
+#define MAX_CALL_DEPTH 100
+
+int processLine();      // Down below
+int masterDirectory();
+
+typedef struct CommandList CommandList;     // Down in Command Lists
+
+typedef struct Loop Loop;     // Down in Loops
+
+typedef struct PlanLine {
+    char* text;         // Set for lines that need the full processLine() treatment
+    CommandList* list;  // Set for 'cmd1 && cmd2' and friends, with every command planned on its own
+    Loop* loop;         // Set for a whole for or while loop, body and all
+    char* spaced;       // Otherwise, the line after makeSpaceForJesus() (hasPipe() and friends look at it)
+    char** tokens;      // and the line already split into tokens
+    int MAX_TOKENS;
+} PlanLine;
+
+typedef struct Plan {
+    PlanLine* lines;
+    int MAX_LINES;
+    char* heredoc;      // The delimiter, while the lines going in are a here-document's body
+    int heredoc_tabs;   // and whether it was a <<-
+    char** loop_lines;  // A loop's statements, while we're still waiting on its 'done'
+    int MAX_LOOP_LINES;
+    int loop_depth;     // and how many 'for's and 'while's in there haven't had theirs yet
+} Plan;
+
+typedef struct Function {
+    char* name;
+    Plan body;
+} Function;
+
+/* Everything a line keeps in globals while it runs. A function call saves the caller's
+copy, so the lines in the body can use the globals as if they had them to themselves */
+typedef struct LineState {
+    char* line;
+    char** tokens;
+    int MAX_TOKENS;
+    char** arguments;
+    int MAX_ARGUMENTS;
+    int unsorted_glob;
+    char** command_substitutions;
+    int MAX_COMMAND_SUBSTITUTIONS;
+    int substitution_base;
+} LineState;
+
+MYSH_LOCAL Function* functions = NULL;
+MYSH_LOCAL int MAX_FUNCTIONS = 0;
+MYSH_LOCAL Function* defining = NULL;      // The function whose body we're in the middle of reading
+MYSH_LOCAL Plan loop_plan;                  // A loop we're in the middle of reading, outside of any function
+MYSH_LOCAL int call_depth = 0;
+MYSH_LOCAL char** positional = NULL;       // $0 (the function's name), $1, $2... of the current call
+MYSH_LOCAL int MAX_POSITIONAL = 0;
+
+/* Returns 1 if the next line is part of a here-document, either one that's about to run
+or one in a function body we're reading. Blank lines and 'exit' count as text in there */
+int inHeredoc() {
+    return heredoc_command != NULL || ( defining != NULL && defining->body.heredoc != NULL ) 
+        || loop_plan.heredoc != NULL;
+}
+
+/* 'exit' from a script or a function body. The mysh program just leaves. Under libmysh
+there's a caller to go back to, so we stop running lines until we get there instead */
+void leaveShell() {
+    if ( embedded ) {
+        leaving = 1;
+        return;
+    }
+    printf("Now leaving myshell\n");
+    exit(EXIT_SUCCESS);
+}
+
+void saveLineState(LineState* state) {
+    state->line = line;
+    state->tokens = tokens;
+    state->MAX_TOKENS = MAX_TOKENS;
+    state->arguments = arguments;
+    state->MAX_ARGUMENTS = MAX_ARGUMENTS;
+    state->unsorted_glob = unsorted_glob;
+    state->command_substitutions = command_substitutions;
+    state->MAX_COMMAND_SUBSTITUTIONS = MAX_COMMAND_SUBSTITUTIONS;
+    state->substitution_base = substitution_base;
+
+    line = NULL;
+    tokens = NULL;
+    MAX_TOKENS = 0;
+    arguments = NULL;
+    MAX_ARGUMENTS = 0;
+    unsorted_glob = 0;
+    command_substitutions = NULL;
+    MAX_COMMAND_SUBSTITUTIONS = 0;
+    substitution_base = MAX_SUBSTITUTIONS;  // The caller's <(cmd) pipes stay open under us
+    forgetLineMap();
+}
+
+void restoreLineState(LineState* state) {
+    line = state->line;
+    tokens = state->tokens;
+    MAX_TOKENS = state->MAX_TOKENS;
+    arguments = state->arguments;
+    MAX_ARGUMENTS = state->MAX_ARGUMENTS;
+    unsorted_glob = state->unsorted_glob;
+    command_substitutions = state->command_substitutions;
+    MAX_COMMAND_SUBSTITUTIONS = state->MAX_COMMAND_SUBSTITUTIONS;
+    substitution_base = state->substitution_base;
+    forgetLineMap();
+}
+
+/* Adds 'text' to the end of 'plan', tokenizing it now if it can be */
+char* findHeredoc(char* text, int* start, int* end, int* stripTabs, int* quoted);     // Down in Here-Documents
+int findListOperator(char* text, int* length);     // Down in Command Lists
+CommandList* listParse(char* text);
+int runList(CommandList* list, int expand);
+void listFree(CommandList* list);
+int startsLoop(char* text);     // Down in Loops
+void loopCollect(Plan* plan, char* text);
+int runLoop(Loop* loop);
+void loopFree(Loop* loop);
+
+/* An empty line on the end of 'plan', for the caller to fill in */
+PlanLine* planNewLine(Plan* plan) {
+    plan->MAX_LINES++;
+    plan->lines = (PlanLine*)realloc(plan->lines, plan->MAX_LINES * sizeof(PlanLine));
+    PlanLine* planLine = &plan->lines[plan->MAX_LINES - 1];
+    planLine->text = NULL;
+    planLine->list = NULL;
+    planLine->loop = NULL;
+    planLine->spaced = NULL;
+    planLine->tokens = NULL;
+    planLine->MAX_TOKENS = 0;
+    return planLine;
+}
+
+void planAddLine(Plan* plan, char* text) {
+
+    // A loop waits for its 'done', and then goes in as one line
+    if ( plan->MAX_LOOP_LINES > 0 || ( plan->heredoc == NULL && startsLoop(text) ) ) {
+        loopCollect(plan, text);
+        return;
+    }
+
+    PlanLine* planLine = planNewLine(plan);
+
+    /* A here-document's lines have to go through processLine() one at a time when it runs,
+    body and all, so they stay text */
+    int start, end, stripTabs;
+    if ( plan->heredoc != NULL ) {
+        char* trimmed = text;
+        while ( plan->heredoc_tabs && *trimmed == '\t' ) trimmed++;
+        if ( strcmp(trimmed, plan->heredoc) == 0 ) {
+            free(plan->heredoc);
+            plan->heredoc = NULL;
+        }
+        planLine->text = strdup(text);
+        return;
+    }
+    char* delimiter = findHeredoc(text, &start, &end, &stripTabs, NULL);
+    if ( delimiter != NULL ) {
+        plan->heredoc = delimiter;
+        plan->heredoc_tabs = stripTabs;
+        planLine->text = strdup(text);
+        return;
+    }
+
+    // Each command in a list gets planned on its own. A broken list complains when it runs
+    if ( findListOperator(text, NULL) != -1 ) {
+        planLine->list = listParse(text);
+        if ( planLine->list == NULL ) planLine->text = strdup(text);
+        return;
+    }
+
+    if ( strstr(text, "$(") != NULL || strstr(text, "<(") != NULL || strstr(text, ">(") != NULL 
+      || strstr(text, "<<<") != NULL ) {
+        planLine->text = strdup(text);
+        return;
+    }
+
+    // Same steps processLine() takes, just done once instead of on every call
+    LineState state;
+    saveLineState(&state);
+    line = strdup(text);
+    if ( letLength(line) == 0 ) makeSpaceForJesus();
+    countTokens();
+    stringToArrayWrapper();
+    planLine->spaced = line;
+    planLine->tokens = tokens;
+    planLine->MAX_TOKENS = MAX_TOKENS;
+    restoreLineState(&state);
+}
+
+void planFree(Plan* plan) {
+    for ( int i = 0; i < plan->MAX_LINES; i++ ) {
+        free(plan->lines[i].text);
+        if ( plan->lines[i].list != NULL ) listFree(plan->lines[i].list);
+        if ( plan->lines[i].loop != NULL ) loopFree(plan->lines[i].loop);
+        free(plan->lines[i].spaced);
+        for ( int j = 0; j < plan->lines[i].MAX_TOKENS; j++ ) free(plan->lines[i].tokens[j]);
+        free(plan->lines[i].tokens);
+    }
+    free(plan->lines);
+    free(plan->heredoc);
+    for ( int i = 0; i < plan->MAX_LOOP_LINES; i++ ) free(plan->loop_lines[i]);
+    free(plan->loop_lines);
+    plan->lines = NULL;
+    plan->MAX_LINES = 0;
+    plan->heredoc = NULL;
+    plan->loop_lines = NULL;
+    plan->MAX_LOOP_LINES = 0;
+    plan->loop_depth = 0;
+}
+
+/* Returns a malloc'd copy of 'text' with $0-$9, $# and $@ (or $*) filled in from the
+current call. Outside of a function, it's just a copy */
+char* expandPositional(char* text) {
+
+    if ( MAX_POSITIONAL == 0 || strchr(text, '$') == NULL ) return strdup(text);
+
+    size_t capacity = strlen(text) + 1;
+    size_t length = 0;
+    char* expanded = malloc(capacity);
+    char number[16];
+
+    for ( int i = 0; text[i] != '\0'; i++ ) {
+        char* value = NULL;
+        char* next = text + i + 1;
+        if ( text[i] == '$' && isdigit(*next) ) {
+            int index = *next - '0';
+            value = ( index < MAX_POSITIONAL ) ? positional[index] : "";
+        } else if ( text[i] == '$' && *next == '#' ) {
+            snprintf(number, sizeof(number), "%d", MAX_POSITIONAL - 1);
+            value = number;
+        } else if ( text[i] == '$' && ( *next == '@' || *next == '*' ) ) {
+            value = "";     // Filled in below, one argument at a time
+        }
+
+        if ( value == NULL ) {
+            if ( length + 2 > capacity ) expanded = realloc(expanded, capacity *= 2);
+            expanded[length++] = text[i];
+            continue;
+        }
+
+        // Everything this piece could possibly add, so we only have to grow once
+        size_t needed = strlen(value);
+        if ( *next == '@' || *next == '*' ) {
+            for ( int j = 1; j < MAX_POSITIONAL; j++ ) needed += strlen(positional[j]) + 1;
+        }
+        while ( length + needed + 2 > capacity ) expanded = realloc(expanded, capacity *= 2);
+
+        if ( *next == '@' || *next == '*' ) {
+            for ( int j = 1; j < MAX_POSITIONAL; j++ ) {
+                if ( j > 1 ) expanded[length++] = ' ';
+                memcpy(expanded + length, positional[j], strlen(positional[j]));
+                length += strlen(positional[j]);
+            }
+        } else {
+            memcpy(expanded + length, value, strlen(value));
+            length += strlen(value);
+        }
+        i++;    // Skip the character after the '$' too
+    }
+    expanded[length] = '\0';
+    return expanded;
+}
+
+/* The end of running any planned line: 'tokens' and 'line' are all set up */
+int runTokens() {
+    int status = 0;
+    if ( MAX_TOKENS > 0 && strcmp(tokens[0], "exit") == 0 ) leaveShell();
+    else if ( MAX_TOKENS > 0 ) status = masterDirectory();
+    inputReset();
+    return status;
+}
+
+/* Fills 'tokens' with copies of 'from', with the current call's $1, $2... in them. A lone
+$@ becomes one token per argument. Anything that expands to nothing goes away */
+void positionalTokens(char** from, int count) {
+    tokens = (char**)malloc(( count + MAX_POSITIONAL ) * sizeof(char*));
+    MAX_TOKENS = 0;
+    for ( int i = 0; i < count; i++ ) {
+        char* token = from[i];
+        if ( MAX_POSITIONAL > 0 && strcmp(token, "$@") == 0 ) {
+            for ( int j = 1; j < MAX_POSITIONAL; j++ ) tokens[MAX_TOKENS++] = strdup(positional[j]);
+            continue;
+        }
+        char* expanded = expandPositional(token);
+        if ( expanded[0] == '\0' && token[0] != '\0' ) { free(expanded); continue; }
+        tokens[MAX_TOKENS++] = expanded;
+    }
+}
+
+/* Runs one line of a plan. Returns what masterDirectory() (or processLine()) did */
+int runPlanLine(PlanLine* planLine) {
+
+    if ( planLine->list != NULL ) return runList(planLine->list, 1);
+    if ( planLine->loop != NULL ) return runLoop(planLine->loop);
+
+    if ( planLine->text != NULL ) {
+        line = expandPositional(planLine->text);
+        if ( heredoc_command == NULL && ifAllSpaces() == 1 ) { free(line); line = NULL; return 0; }
+        return processLine();
+    }
+
+    int previous = enterPhase(PHASE_LEX);
+    positionalTokens(planLine->tokens, planLine->MAX_TOKENS);
+    line = strdup(planLine->spaced);
+    leavePhase(previous, 0);
+
+    return runTokens();
+}
+
+Function* findFunction(char* name) {
+    for ( int i = 0; i < MAX_FUNCTIONS; i++ ) {
+        if ( strcmp(functions[i].name, name) == 0 ) return &functions[i];
+    }
+    return NULL;
+}
+
+/* Calls 'function' with the current tokens as its arguments. Returns the status of the
+last line in its body */
+int callFunction(Function* function) {
+
+    if ( call_depth == MAX_CALL_DEPTH ) {
+        printf("Error: Functions nested more than %d deep\n", MAX_CALL_DEPTH);
+        return 1;
+    }
+
+    // Bind the arguments. $0 is the name the function was called by
+    char** saved_positional = positional;
+    int saved_count = MAX_POSITIONAL;
+    positional = (char**)malloc(MAX_TOKENS * sizeof(char*));
+    for ( int i = 0; i < MAX_TOKENS; i++ ) positional[i] = strdup(tokens[i]);
+    MAX_POSITIONAL = MAX_TOKENS;
+
+    LineState state;
+    saveLineState(&state);
+    call_depth++;
+
+    int status = 0;
+    Plan* body = &function->body;
+    for ( int i = 0; i < body->MAX_LINES && leaving == 0; i++ ) status = runPlanLine(&body->lines[i]);
+
+    call_depth--;
+    restoreLineState(&state);
+
+    for ( int i = 0; i < MAX_POSITIONAL; i++ ) free(positional[i]);
+    free(positional);
+    positional = saved_positional;
+    MAX_POSITIONAL = saved_count;
+
+    return status;
+}
+
+/* If 'text' looks like "name() {", copies the name into 'name' and returns 1 */
+int isFunctionHeader(char* text, char* name, int size) {
+
+    while ( isspace(*text) ) text++;
+    int length = 0;
+    while ( isalnum(text[length]) || text[length] == '_' ) length++;
+    if ( length == 0 || length >= size || isdigit(text[0]) ) return 0;
+
+    char* rest = text + length;
+    while ( isspace(*rest) ) rest++;
+    if ( *rest++ != '(' ) return 0;
+    while ( isspace(*rest) ) rest++;
+    if ( *rest++ != ')' ) return 0;
+    while ( isspace(*rest) ) rest++;
+    if ( *rest++ != '{' ) return 0;
+    while ( isspace(*rest) ) rest++;
+    if ( *rest != '\0' ) return 0;
+
+    memcpy(name, text, length);
+    name[length] = '\0';
+    return 1;
+}
+
+/* Handles a line that starts or belongs to a function definition. The new function
+only replaces an old one with the same name once its closing brace shows up */
+int defineFunctionLine() {
+
+    char name[256];
+    int isHeader = isFunctionHeader(line, name, sizeof(name));
+
+    if ( defining == NULL ) {
+        if ( call_depth > 0 ) {
+            printf("Error: Functions can't be defined inside a function\n");
+            free(line);
+            return 1;
+        }
+        defining = (Function*)malloc(sizeof(Function));
+        defining->name = strdup(name);
+        memset(&defining->body, 0, sizeof(Plan));
+        free(line);
+        return 0;
+    }
+
+    if ( isHeader && defining->body.heredoc == NULL ) {
+        printf("Error: Functions can't be defined inside a function\n");
+        planFree(&defining->body);
+        free(defining->name);
+        free(defining);
+        defining = NULL;
+        free(line);
+        return 1;
+    }
+
+    // Is this the closing brace?
+    char* trimmed = line;
+    while ( isspace(*trimmed) ) trimmed++;
+    int length = strlen(trimmed);
+    while ( length > 0 && isspace(trimmed[length - 1]) ) length--;
+
+    if ( length == 1 && trimmed[0] == '}' && defining->body.heredoc == NULL ) {
+        if ( defining->body.MAX_LOOP_LINES > 0 ) {
+            printf("Error: Unfinished loop in function \"%s\"\n", defining->name);
+            planFree(&defining->body);
+            free(defining->name);
+            free(defining);
+            defining = NULL;
+            free(line);
+            return 1;
+        }
+        Function* existing = findFunction(defining->name);
+        if ( existing != NULL ) {
+            planFree(&existing->body);
+            free(existing->name);
+            *existing = *defining;
+        } else {
+            MAX_FUNCTIONS++;
+            functions = (Function*)realloc(functions, MAX_FUNCTIONS * sizeof(Function));
+            functions[MAX_FUNCTIONS - 1] = *defining;
+        }
+        free(defining);
+        defining = NULL;
+    } else if ( length > 0 || defining->body.heredoc != NULL ) {
+        planAddLine(&defining->body, line);
+    }
+
+    free(line);
+    return 0;
+}
+
+
+/* ============================================================ */
+// Command Lists //
+
+/* 'cmd1 ; cmd2' runs one and then the other, 'cmd1 && cmd2' only runs cmd2 if cmd1
+worked, and 'cmd1 || cmd2' only if it didn't. "Worked" means the status the command
+really finished with, which for a program is its exit status from waitpid(). A longer
+list goes left to right with whatever ran last deciding, so 'a && b || c' runs c if
+either a or b failed.
+
+The line gets split up and every command planned just once, the same way a function
+body is, so a whole chain of steps costs one read of the line instead of one apiece.
+A command that gets skipped never runs anything at all, $(cmd) and <(cmd) included */
+
+enum { LIST_ALWAYS, LIST_AND, LIST_OR };
+
+struct CommandList {
+    Plan plan;          // A line for each command
+    int* operators;     // and what comes in front of it. The first one is always LIST_ALWAYS
+};
+
+/* Finds the first ';', '&&' or '||' in 'text' that isn't in quotes or inside a $(...),
+<(...) or >(...). Returns where it is and puts its length in 'length' (if that isn't
+NULL), or returns -1 if there isn't one */
+int findListOperator(char* text, int* length) {
+
+    if ( strpbrk(text, ";&|") == NULL ) return -1;     // Nearly every line
+
+    char quote = '\0';
+    for ( int i = letLength(text); text[i] != '\0'; i++ ) {
+        if ( quote != '\0' ) {
+            if ( text[i] == quote ) quote = '\0';
+            continue;
+        }
+        if ( text[i] == '\'' || text[i] == '"' ) {
+            quote = text[i];
+            continue;
+        }
+        if ( text[i] == '(' && i > 0 && strchr("$<>", text[i - 1]) != NULL ) {
+            int close = matchingParen(text, i);
+            if ( close == -1 ) return -1;   // The substitution code has a message for that
+            i = close;
+            continue;
+        }
+        int size = 0;
+        if ( text[i] == ';' ) size = 1;
+        else if ( ( text[i] == '&' || text[i] == '|' ) && text[i + 1] == text[i] ) size = 2;
+        if ( size > 0 ) {
+            if ( length != NULL ) *length = size;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Splits 'text' into its commands and plans each one. Returns NULL if a command is
+missing, like in '&& cmd' or 'cmd1 || ; cmd2'. Only a ';' can end the line */
+CommandList* listParse(char* text) {
+
+    CommandList* list = (CommandList*)calloc(1, sizeof(CommandList));
+    char* copy = strdup(text);
+    char* rest = copy;
+    int operator = LIST_ALWAYS;
+    int broken = 0;
+
+    while ( rest != NULL && broken == 0 ) {
+        int length = 0;
+        int at = findListOperator(rest, &length);
+        char* next = NULL;
+        int following = LIST_ALWAYS;
+        if ( at != -1 ) {
+            if ( rest[at] == '&' ) following = LIST_AND;
+            if ( rest[at] == '|' ) following = LIST_OR;
+            rest[at] = '\0';
+            next = rest + at + length;
+        }
+
+        char* command = rest;
+        while ( isspace(*command) ) command++;
+        if ( startsLoop(command) ) {
+            /* A loop has ';'s of its own, so it gets the rest of the line, and whatever
+            comes after its 'done' gets planned from there. It has to finish on this line */
+            int before = list->plan.MAX_LINES;
+            planAddLine(&list->plan, text + ( command - copy ));
+            broken = ( list->plan.MAX_LOOP_LINES > 0 );
+            list->operators = (int*)realloc(list->operators, list->plan.MAX_LINES * sizeof(int));
+            for ( int i = before; i < list->plan.MAX_LINES; i++ ) {
+                list->operators[i] = ( i == before ) ? operator : LIST_ALWAYS;
+            }
+            break;
+        } else if ( *command == '\0' ) {
+            // 'cmd ;' is fine. Nothing else gets to be empty
+            broken = ( next != NULL || operator != LIST_ALWAYS || list->plan.MAX_LINES == 0 );
+        } else {
+            planAddLine(&list->plan, command);
+            list->operators = (int*)realloc(list->operators, list->plan.MAX_LINES * sizeof(int));
+            list->operators[list->plan.MAX_LINES - 1] = operator;
+        }
+        operator = following;
+        rest = next;
+    }
+
+    free(copy);
+    if ( broken ) {
+        listFree(list);
+        return NULL;
+    }
+    return list;
+}
+
+void listFree(CommandList* list) {
+    planFree(&list->plan);
+    free(list->operators);
+    free(list);
+}
+
+/* Runs one command of a list. With 'expand' set it gets the $1, $2... of the function
+we're in. Otherwise the line was already expanded before it got split up */
+int runListItem(PlanLine* item, int expand) {
+
+    if ( expand || item->list != NULL || item->loop != NULL ) return runPlanLine(item);
+
+    if ( item->text != NULL ) {
+        line = strdup(item->text);
+        return processLine();
+    }
+
+    tokens = (char**)malloc(item->MAX_TOKENS * sizeof(char*));
+    for ( int i = 0; i < item->MAX_TOKENS; i++ ) tokens[i] = strdup(item->tokens[i]);
+    MAX_TOKENS = item->MAX_TOKENS;
+    line = strdup(item->spaced);
+    return runTokens();
+}
+
+/* Runs the commands in 'list' that its operators say should run. Returns the status of
+the last one that did */
+int runList(CommandList* list, int expand) {
+    int status = 0;
+    for ( int i = 0; i < list->plan.MAX_LINES && leaving == 0; i++ ) {
+        if ( list->operators[i] == LIST_AND && status != 0 ) continue;
+        if ( list->operators[i] == LIST_OR && status == 0 ) continue;
+        status = runListItem(&list->plan.lines[i], expand);
+        exit_status = status;   // For the next one's 'then' or 'else'
+    }
+    return status;
+}
+
+/* processLine()'s way in, for a line it found an operator in */
+int runCommandList() {
+    CommandList* list = listParse(line);
+    free(line);
+    line = NULL;
+    if ( list == NULL ) {
+        printf("Error: Improper use of ';', '&&' or '||'\n");
+        return 1;
+    }
+    int status = runList(list, 0);
+    listFree(list);
+    return status;
+}
+
+
+/* ============================================================ */
+// Loops //
+
+/*  for NAME in WORDS...; do COMMANDS...; done
+    while COMMAND; do COMMANDS...; done
+
+A loop can sit on one line, or spread over as many as it likes with a newline anywhere
+a ';' could go. Nothing in it runs until its 'done' shows up. Then the whole thing gets
+planned once, the same way a function body is: every command is split into tokens and
+has its program looked up the first time around, and after that all a command gets is
+its $variables filled in again. The WORDS after 'in' are expanded once, variables and
+wildcards both, before the first time around. 'for NAME' on its own goes over $@ */
+
+enum { LOOP_FOR, LOOP_WHILE };
+
+struct Loop {
+    int type;
+    char* variable;     // for's NAME
+    char** words;       // and its WORDS, the way they were written
+    int MAX_WORDS;
+    Plan condition;     // while's COMMAND
+    Plan body;
+};
+
+/* Returns 1 if the first word in 'text' is 'word'. A ';' right after it ends it too */
+int startsWithWord(char* text, const char* word) {
+    while ( isspace(*text) ) text++;
+    size_t length = strlen(word);
+    return strncmp(text, word, length) == 0 
+        && ( text[length] == '\0' || text[length] == ';' || isspace(text[length]) );
+}
+
+/* Returns where the word after the first one in 'text' starts */
+char* afterWord(char* text) {
+    while ( isspace(*text) ) text++;
+    while ( *text != '\0' && isspace(*text) == 0 ) text++;
+    while ( isspace(*text) ) text++;
+    return text;
+}
+
+int startsLoop(char* text) {
+    return startsWithWord(text, "for") || startsWithWord(text, "while");
+}
+
+/* Returns 1 while we're reading a loop's lines at the top level */
+int inLoop() {
+    return loop_plan.MAX_LOOP_LINES > 0;
+}
+
+/* Finds the first ';' in 'text' that a command list would split at. A loop's statements
+only end at those. A '&&' or '||' stays inside its statement, like in 'while a && b' */
+int findSemicolon(char* text) {
+    int offset = 0;
+    int length;
+    int at;
+    while ( ( at = findListOperator(text + offset, &length) ) != -1 ) {
+        if ( text[offset + at] == ';' ) return offset + at;
+        offset += at + length;
+    }
+    return -1;
+}
+
+void loopAddStatement(Plan* plan, char* statement) {
+    plan->MAX_LOOP_LINES++;
+    plan->loop_lines = (char**)realloc(plan->loop_lines, plan->MAX_LOOP_LINES * sizeof(char*));
+    plan->loop_lines[plan->MAX_LOOP_LINES - 1] = strdup(statement);
+}
+
+/* Works out for's NAME and WORDS from its first statement. Returns 1 if it's broken */
+int loopHeader(Loop* loop, char* header) {
+
+    LineState state;
+    saveLineState(&state);
+    line = strdup(header);
+    countTokens();
+    stringToArrayWrapper();
+
+    int broken = ( MAX_TOKENS < 2 || ( MAX_TOKENS > 2 && strcmp(tokens[2], "in") != 0 ) );
+    if ( broken == 0 ) {
+        broken = isNameStart(tokens[1][0]) == 0;
+        for ( int i = 1; tokens[1][i] != '\0'; i++ ) if ( isNameChar(tokens[1][i]) == 0 ) broken = 1;
+    }
+    if ( broken == 0 ) {
+        loop->variable = strdup(tokens[1]);
+        if ( MAX_TOKENS == 2 ) {
+            loop->MAX_WORDS = 1;
+            loop->words = (char**)malloc(sizeof(char*));
+            loop->words[0] = strdup("$@");
+        } else {
+            loop->MAX_WORDS = MAX_TOKENS - 3;
+            loop->words = (char**)malloc(( loop->MAX_WORDS + 1 ) * sizeof(char*));
+            for ( int i = 3; i < MAX_TOKENS; i++ ) loop->words[i - 3] = strdup(tokens[i]);
+        }
+    }
+
+    inputReset();
+    restoreLineState(&state);
+    return broken;
+}
+
+/* Turns a loop's statements into a Loop, planning its condition and body. The first
+statement is the header, the second starts with 'do' and the last one is 'done'.
+Returns NULL if it's broken, after saying so */
+Loop* loopBuild(char** statements, int count) {
+
+    Loop* loop = (Loop*)calloc(1, sizeof(Loop));
+    int broken = 0;
+
+    if ( startsWithWord(statements[0], "while") ) {
+        loop->type = LOOP_WHILE;
+        char* condition = afterWord(statements[0]);
+        if ( *condition != '\0' ) planAddLine(&loop->condition, condition);
+        broken = ( loop->condition.MAX_LINES != 1 || loop->condition.MAX_LOOP_LINES > 0 );
+    } else {
+        loop->type = LOOP_FOR;
+        broken = loopHeader(loop, statements[0]);
+    }
+
+    if ( broken == 0 ) {
+        broken = ( count < 3 || startsWithWord(statements[1], "do") == 0 || strcmp(statements[count - 1], "done") != 0 );
+    }
+    if ( broken == 0 ) {
+        char* first = afterWord(statements[1]);    // 'do cmd' is the same as 'do; cmd'
+        if ( *first != '\0' ) planAddLine(&loop->body, first);
+        for ( int i = 2; i < count - 1; i++ ) planAddLine(&loop->body, statements[i]);
+        broken = ( loop->body.MAX_LOOP_LINES > 0 || loop->body.heredoc != NULL );
+    }
+
+    if ( broken ) {
+        if ( loop->type == LOOP_FOR ) {
+            printf("Error: Improper use of 'for'\n");
+            printf("Usage: for NAME in WORDS...; do COMMANDS...; done\n");
+        } else {
+            printf("Error: Improper use of 'while'\n");
+            printf("Usage: while COMMAND; do COMMANDS...; done\n");
+        }
+        loopFree(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/* Adds 'text' to the loop 'plan' is reading, a statement at a time. Once the last 'done'
+is in, the loop goes on the end of 'plan' as one line, and anything after that 'done'
+gets added to 'plan' like normal */
+void loopCollect(Plan* plan, char* text) {
+
+    // A here-document's body goes in just as it is, ';'s and all
+    if ( plan->heredoc != NULL ) {
+        loopAddStatement(plan, text);
+        char* trimmed = text;
+        while ( plan->heredoc_tabs && *trimmed == '\t' ) trimmed++;
+        if ( strcmp(trimmed, plan->heredoc) == 0 ) {
+            free(plan->heredoc);
+            plan->heredoc = NULL;
+        }
+        return;
+    }
+
+    char* copy = strdup(text);
+    char* rest = copy;
+    while ( rest != NULL ) {
+        int at = findSemicolon(rest);
+        char* next = NULL;
+        if ( at != -1 ) {
+            rest[at] = '\0';
+            next = rest + at + 1;
+        }
+
+        char* statement = rest;
+        rest = next;
+        while ( isspace(*statement) ) statement++;
+        int length = strlen(statement);
+        while ( length > 0 && isspace(statement[length - 1]) ) length--;
+        statement[length] = '\0';
+        if ( length == 0 ) continue;
+
+        // Loops inside this one need their own 'done' before ours counts
+        char* command = startsWithWord(statement, "do") ? afterWord(statement) : statement;
+        if ( startsLoop(command) ) plan->loop_depth++;
+        if ( startsWithWord(statement, "done") ) plan->loop_depth--;
+        loopAddStatement(plan, statement);
+
+        int start, end, stripTabs;
+        char* delimiter = findHeredoc(statement, &start, &end, &stripTabs, NULL);
+        if ( delimiter != NULL ) {
+            free(plan->heredoc);
+            plan->heredoc = delimiter;
+            plan->heredoc_tabs = stripTabs;
+        }
+
+        if ( plan->loop_depth <= 0 ) {
+            Loop* loop = loopBuild(plan->loop_lines, plan->MAX_LOOP_LINES);
+            for ( int i = 0; i < plan->MAX_LOOP_LINES; i++ ) free(plan->loop_lines[i]);
+            free(plan->loop_lines);
+            plan->loop_lines = NULL;
+            plan->MAX_LOOP_LINES = 0;
+            plan->loop_depth = 0;
+            if ( loop != NULL ) planNewLine(plan)->loop = loop;
+
+            if ( rest != NULL ) {
+                char* after = text + ( rest - copy );
+                while ( isspace(*after) ) after++;
+                if ( *after != '\0' ) planAddLine(plan, after);
+            }
+            break;
+        }
+    }
+    free(copy);
+}
+
+void loopFree(Loop* loop) {
+    free(loop->variable);
+    for ( int i = 0; i < loop->MAX_WORDS; i++ ) free(loop->words[i]);
+    free(loop->words);
+    planFree(&loop->condition);
+    planFree(&loop->body);
+    free(loop);
+}
+
+/* Once through the body. Returns the status of the last command in it */
+int runLoopBody(Loop* loop) {
+    int status = 0;
+    for ( int i = 0; i < loop->body.MAX_LINES && leaving == 0; i++ ) {
+        status = runPlanLine(&loop->body.lines[i]);
+        exit_status = status;   // For the next one's 'then' or 'else'
+    }
+    return status;
+}
+
+/* Returns the status of the last command the body ran, or 0 if it never ran */
+int runLoop(Loop* loop) {
+
+    int status = 0;
+
+    if ( loop->type == LOOP_WHILE ) {
+        while ( leaving == 0 && runPlanLine(&loop->condition.lines[0]) == 0 ) status = runLoopBody(loop);
+        return status;
+    }
+
+    // The words get expanded just like a command's arguments would, but only the once
+    int previous = enterPhase(PHASE_LEX);
+    positionalTokens(loop->words, loop->MAX_WORDS);
+    expandVariables();
+    if ( wildcard() == 1 ) {
+        inputReset();
+        line = NULL;
+        return leavePhase(previous, 1);
+    }
+    char** words = tokens;
+    int count = MAX_TOKENS;
+    tokens = NULL;
+    MAX_TOKENS = 0;
+    leavePhase(previous, 0);
+
+    for ( int i = 0; i < count && leaving == 0; i++ ) {
+        setVariable(loop->variable, strlen(loop->variable), words[i]);
+        status = runLoopBody(loop);
+    }
+
+    for ( int i = 0; i < count; i++ ) free(words[i]);
+    free(words);
+    return status;
+}
+
+/* processLine()'s way in, for a line that starts a loop or is part of one */
+int loopLine() {
+
+    planAddLine(&loop_plan, line);
+    free(line);
+    line = NULL;
+    if ( inLoop() ) return 0;     // Still waiting on its 'done'
+
+    // Off the global first, since a line in the loop could start a loop of its own
+    Plan plan = loop_plan;
+    memset(&loop_plan, 0, sizeof(Plan));
+
+    int broken = ( plan.MAX_LINES == 0 || plan.lines[0].loop == NULL );
+    int status = 0;
+    for ( int i = 0; i < plan.MAX_LINES && leaving == 0; i++ ) {
+        status = runListItem(&plan.lines[i], 0);
+        exit_status = status;
+    }
+    planFree(&plan);
+    return broken ? 1 : status;
+}
+
+/* Complains about a loop that never got its 'done', and throws it away */
+int unfinishedLoop() {
+    if ( inLoop() == 0 ) return 0;
+    printf("Error: Loop ended before its 'done'\n");
+    planFree(&loop_plan);
+    return 1;
+}
+
+
+/* ============================================================ */
+// Scripts //
+
+/* Running a mysh script by name doesn't need a whole new mysh. Instead we fork this one,
+which already has a warm path cache and knows every function and variable, and the
+script runs in the child. 'source FILE' doesn't even fork, it runs the script right here.
+A file counts as a mysh script if it's executable and its #! line names mysh, or if it
+has no #! line at all and ends in .mysh */
+
+#define MAX_SCRIPT_DEPTH 100
+
+void unfinishedHeredoc();       // Down in Here-Documents and Here-Strings
+
+MYSH_LOCAL pid_t* subshell_pids = NULL;    // Subshells we forked ourselves, so the zygote never hears about them
+MYSH_LOCAL int MAX_SUBSHELLS = 0;
+MYSH_LOCAL int script_depth = 0;
+
+/* Opens 'path' up and takes a look. isMyshScript() only calls this for files it hasn't seen */
+int readMyshScript(char* path) {
+
+    if ( access(path, X_OK) != 0 ) return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) return 0;
+    char header[256];
+    ssize_t bytes = read(fd, header, sizeof(header) - 1);
+    close(fd);
+    if ( bytes <= 0 || memchr(header, '\0', bytes) != NULL ) return 0;     // Empty, a directory, or a binary
+    header[bytes] = '\0';
+
+    if ( bytes < 2 || header[0] != '#' || header[1] != '!' ) {
+        size_t length = strlen(path);
+        return length > 5 && strcmp(path + length - 5, ".mysh") == 0;
+    }
+
+    // #!/path/to/mysh, or #!/usr/bin/env mysh
+    char* rest = NULL;
+    char* interpreter = strtok_r(header + 2, " \t\r\n", &rest);
+    for ( int i = 0; i < 2 && interpreter != NULL; i++ ) {
+        char* name = strrchr(interpreter, '/');
+        name = ( name == NULL ) ? interpreter : name + 1;
+        if ( strcmp(name, "mysh") == 0 ) return 1;
+        if ( strcmp(name, "env") != 0 ) return 0;
+        interpreter = strtok_r(NULL, " \t\r\n", &rest);
+    }
+    return 0;
+}
+
+/* Returns 1 if 'path' is a script of ours: an executable that starts with #!/path/to/mysh
+or #!/usr/bin/env mysh, or one with no #! line that ends in .mysh */
+int isMyshScript(char* path) {
+
+    struct stat info;
+    if ( stat(path, &info) != 0 ) return 0;
+
+    CachedVerdict* cached = &script_cache[hashName(path, strlen(path)) % PATH_CACHE_SIZE];
+    if ( cached->path != NULL && strcmp(cached->path, path) == 0 && cached->inode == info.st_ino
+      && cached->mtime.tv_sec == info.st_mtim.tv_sec && cached->mtime.tv_nsec == info.st_mtim.tv_nsec
+      && cached->ctime.tv_sec == info.st_ctim.tv_sec && cached->ctime.tv_nsec == info.st_ctim.tv_nsec ) {
+        return cached->script;
+    }
+
+    free(cached->path);
+    cached->path = strdup(path);
+    cached->inode = info.st_ino;
+    cached->mtime = info.st_mtim;
+    cached->ctime = info.st_ctim;
+    cached->script = readMyshScript(path);
+    return cached->script;
+}
+
+/* Runs every line of the script at 'path' in this shell, with 'argv' as $0, $1 and so on.
+Returns the status of the last line */
+int runScript(char* path, char** argv, int argc) {
+
+    if ( script_depth == MAX_SCRIPT_DEPTH ) {
+        printf("Error: Scripts nested more than %d deep\n", MAX_SCRIPT_DEPTH);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        perror("Error opening file");
+        return 1;
+    }
+
+    // The whole thing in one go. Scripts are small, and it's a lot fewer read()s
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* text = malloc(capacity);
+    ssize_t bytes;
+    while ( ( bytes = read(fd, text + length, capacity - length - 1) ) > 0 ) {
+        length += bytes;
+        if ( length + 1 == capacity ) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    close(fd);
+    text[length] = '\0';
+
+    // Bind the arguments. $0 is the script itself
+    char** saved_positional = positional;
+    int saved_count = MAX_POSITIONAL;
+    positional = (char**)malloc(argc * sizeof(char*));
+    for ( int i = 0; i < argc; i++ ) positional[i] = strdup(argv[i]);
+    MAX_POSITIONAL = argc;
+
+    LineState state;
+    saveLineState(&state);
+    script_depth++;
+
+    int status = 0;
+    char* next = text;
+    while ( next != NULL && leaving == 0 ) {
+        char* current = next;
+        next = strchr(current, '\n');
+        if ( next != NULL ) *next++ = '\0';
+
+        // A function body's $1 is the function's, so it waits until the call
+        line = ( defining != NULL ) ? strdup(current) : expandPositional(current);
+        if ( inHeredoc() == 0 && ifAllSpaces() == 1 ) { free(line); line = NULL; continue; }
+        if ( strcmp(line, "exit") == 0 && defining == NULL && heredoc_command == NULL && inLoop() == 0 ) {
+            free(line);
+            line = NULL;
+            leaveShell();
+            continue;
+        }
+        status = processLine();
+        if ( status != 0 ) exit_status = status;
+    }
+
+    if ( heredoc_command != NULL ) {
+        unfinishedHeredoc();
+        status = 1;
+    }
+    if ( unfinishedLoop() == 1 ) status = 1;
+    if ( defining != NULL ) {
+        printf("Error: Unfinished function \"%s\"\n", defining->name);
+        planFree(&defining->body);
+        free(defining->name);
+        free(defining);
+        defining = NULL;
+        status = 1;
+    }
+
+    script_depth--;
+    restoreLineState(&state);
+
+    for ( int i = 0; i < MAX_POSITIONAL; i++ ) free(positional[i]);
+    free(positional);
+    positional = saved_positional;
+    MAX_POSITIONAL = saved_count;
+    free(text);
+
+    return status;
+}
+
+/* Closes every close-on-exec descriptor, the same as execv() would have. Otherwise a
+subshell at the end of a pipe could be holding the write end of its own stdin, and
+would never see end of file */
+void closeOnExecFds() {
+    DIR* directory = opendir("/proc/self/fd");
+    if ( directory == NULL ) return;
+    int listing = dirfd(directory);
+    struct dirent* entry;
+    while ( ( entry = readdir(directory) ) != NULL ) {
+        int fd = atoi(entry->d_name);
+        if ( fd <= STDERR_FILENO || fd == listing ) continue;
+        int flags = fcntl(fd, F_GETFD);
+        if ( flags != -1 && ( flags & FD_CLOEXEC ) ) close(fd);
+    }
+    closedir(directory);
+}
+
+/* spawnProgram() for a mysh script: a fork of this shell runs it. Returns the child's pid */
+pid_t spawnSubshell(char* path, char** argv, int fd_in, int fd_out) {
+
+    fflush(stdout);     // Otherwise the child would print our buffered output a second time
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        perror("fork");
+        return -1;
+    }
+    if ( pid == 0 ) {
+        // The zygote and the trace belong to the shell the user started, like with substitutions
+        if ( zygote_fd != -1 ) close(zygote_fd);
+        zygote_fd = -1;
+        if ( trace_fd != -1 ) close(trace_fd);
+        trace_fd = -1;
+        MAX_SUBSHELLS = 0;
+
+        childFds(fd_in, fd_out);
+        closeOnExecFds();
+
+        int argc = 0;
+        while ( argv[argc] != NULL ) argc++;
+        int status = runScript(path, argv, argc);
+
+        fflush(stdout);
+        _exit(status);
+    }
+
+    subshell_pids = (pid_t*)realloc(subshell_pids, (MAX_SUBSHELLS + 1) * sizeof(pid_t));
+    subshell_pids[MAX_SUBSHELLS++] = pid;
+    return pid;
+}
+
+/* Returns 1 (and forgets about it) if 'pid' is one of our subshells */
+int forgetSubshell(pid_t pid) {
+    for ( int i = 0; i < MAX_SUBSHELLS; i++ ) {
+        if ( subshell_pids[i] == pid ) {
+            subshell_pids[i] = subshell_pids[--MAX_SUBSHELLS];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sourceCommand() {
+    if ( MAX_TOKENS < 2 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: source <script> [argument...]\n");
+        return 1;
+    }
+    return runScript(tokens[1], &tokens[1], MAX_TOKENS - 1);
+}
+
+/* ============================================================ */
+// Command Cache //
+
+/* 'cache cmd args [< in] [> out]' remembers what a program printed, so the next time the
+exact same line runs against the exact same files, we just print it again instead of
+running anything. What counts as "the same" is the key: the resolved program (and its
+size, mtime and inode, in case it got rebuilt), every argument, the cwd, the locale and
+timezone variables plus anything named in MYSH_CACHE_ENV, and the size, mtime and inode
+of the '<' file and of every argument that names a file. An argument that doesn't name a
+file goes in as missing, so the result changes if it shows up later.
+
+A cached program gets /dev/null for stdin unless there's a '<', since we'd have no idea
+what it read otherwise. Its stderr goes straight through and isn't saved.
+
+Entries live in MYSH_CACHE_DIR, or $XDG_CACHE_HOME/mysh, or ~/.cache/mysh. Each one is a
+file named after the key's hash that holds the whole key (so a hash collision is just a
+miss), the exit status and the output. Every hit bumps the entry's mtime, and once the
+directory grows past MYSH_CACHE_SIZE bytes (64MB by default) the least recently used
+entries get deleted until we're back under 90% of that */
+
+#define CACHE_MAGIC "myshc01"
+#define CACHE_DEFAULT_SIZE (64LL << 20)
+
+typedef struct CacheHeader {
+    char magic[8];
+    int status;
+    int key_length;
+    long long out_length;
+} CacheHeader;
+
+typedef struct CacheKey {
+    char* text;
+    size_t length;
+    size_t capacity;
+} CacheKey;
+
+typedef struct CacheEntry {
+    char* name;
+    off_t size;
+    struct timespec used;
+} CacheEntry;
+
+MYSH_LOCAL long long cache_bytes = -1;     // Our best guess at how big the cache is, -1 until we look
+
+/* Adds a string to the key, NUL and all, so "ab" "c" and "a" "bc" don't look the same */
+void cacheKeyAdd(CacheKey* key, const char* text) {
+    size_t length = strlen(text) + 1;
+    if ( key->length + length > key->capacity ) {
+        while ( key->length + length > key->capacity ) key->capacity = key->capacity ? key->capacity * 2 : 256;
+        key->text = realloc(key->text, key->capacity);
+    }
+    memcpy(key->text + key->length, text, length);
+    key->length += length;
+}
+
+/* Adds what we know about the file at 'path', or that it isn't there */
+void cacheKeyAddFile(CacheKey* key, const char* kind, const char* path) {
+    struct stat info;
+    char fingerprint[96];
+    cacheKeyAdd(key, kind);
+    cacheKeyAdd(key, path);
+    if ( stat(path, &info) == 0 ) {
+        snprintf(fingerprint, sizeof(fingerprint), "%lld %lld.%09ld %llu", (long long)info.st_size,
+                 (long long)info.st_mtim.tv_sec, info.st_mtim.tv_nsec, (unsigned long long)info.st_ino);
+        cacheKeyAdd(key, fingerprint);
+    } else {
+        cacheKeyAdd(key, "missing");
+    }
+}
+
+void cacheKeyAddVariable(CacheKey* key, const char* name) {
+    char* value = getenv(name);
+    cacheKeyAdd(key, name);
+    cacheKeyAdd(key, value != NULL ? value : "(unset)");
+}
+
+/* 64 bit FNV-1a. Entries are named after it, and the full key inside settles any collision */
+unsigned long long cacheHash(CacheKey* key) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for ( size_t i = 0; i < key->length; i++ ) {
+        hash ^= (unsigned char)key->text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Where the entries go. Makes the directory if it has to. Returns a malloc'd path or NULL */
+char* cacheDirectory() {
+    char* directory = NULL;
+    if ( getenv("MYSH_CACHE_DIR") != NULL ) {
+        directory = strdup(getenv("MYSH_CACHE_DIR"));
+    } else if ( getenv("XDG_CACHE_HOME") != NULL ) {
+        directory = executablePathBuilder("mysh", getenv("XDG_CACHE_HOME"));
+    } else if ( getenv("HOME") != NULL ) {
+        char* parent = executablePathBuilder(".cache", getenv("HOME"));
+        mkdir(parent, 0700);
+        directory = executablePathBuilder("mysh", parent);
+        free(parent);
+    } else {
+        printf("Error: Nowhere to keep the cache. Set HOME or MYSH_CACHE_DIR\n");
+        return NULL;
+    }
+    if ( mkdir(directory, 0700) == -1 && errno != EEXIST ) {
+        perror("Error making the cache directory");
+        free(directory);
+        return NULL;
+    }
+    return directory;
+}
+
+/* Copies 'length' bytes from 'from' (starting at 'offset') to 'to'. sendfile() does it
+without a trip through our memory, but it won't write to everything (files opened for
+appending, for one), so those get plain reads and writes */
+int copyBytes(int from, off_t offset, long long length, int to) {
+    while ( length > 0 ) {
+        ssize_t bytes = sendfile(to, from, &offset, length > (1 << 30) ? (1 << 30) : length);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes == -1 && ( errno == EINVAL || errno == ENOSYS ) ) break;
+        if ( bytes <= 0 ) {
+            if ( bytes == -1 ) perror("sendfile");
+            return 1;
+        }
+        length -= bytes;
+    }
+
+    char buffer[BUFFSIZE];
+    while ( length > 0 ) {
+        ssize_t bytes = pread(from, buffer, length > BUFFSIZE ? BUFFSIZE : length, offset);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 || writeFully(to, buffer, bytes) == 1 ) {
+            perror("Error copying output");
+            return 1;
+        }
+        offset += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+int compareEntries(const void* a, const void* b) {
+    const struct timespec* left = &((const CacheEntry*)a)->used;
+    const struct timespec* right = &((const CacheEntry*)b)->used;
+    if ( left->tv_sec != right->tv_sec ) return left->tv_sec < right->tv_sec ? -1 : 1;
+    if ( left->tv_nsec != right->tv_nsec ) return left->tv_nsec < right->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Adds up the cache, and if it's too big, deletes the least recently used entries */
+void cacheEvict(char* directory) {
+
+    long long limit = CACHE_DEFAULT_SIZE;
+    if ( getenv("MYSH_CACHE_SIZE") != NULL && atoll(getenv("MYSH_CACHE_SIZE")) > 0 ) {
+        limit = atoll(getenv("MYSH_CACHE_SIZE"));
+    }
+    if ( cache_bytes != -1 && cache_bytes <= limit ) return;
+
+    DIR* folder = opendir(directory);
+    if ( folder == NULL ) return;
+    CacheEntry* entries = NULL;
+    int count = 0;
+    cache_bytes = 0;
+
+    struct dirent* file;
+    while ( ( file = readdir(folder) ) != NULL ) {
+        struct stat info;
+        if ( file->d_name[0] == '.' ) continue;     // Including the ones still being written
+        char* path = executablePathBuilder(file->d_name, directory);
+        if ( stat(path, &info) == 0 && S_ISREG(info.st_mode) ) {
+            entries = (CacheEntry*)realloc(entries, (count + 1) * sizeof(CacheEntry));
+            entries[count].name = path;
+            entries[count].size = info.st_size;
+            entries[count].used = info.st_mtim;
+            cache_bytes += info.st_size;
+            count++;
+        } else {
+            free(path);
+        }
+    }
+    closedir(folder);
+
+    // Oldest first. We go a bit under the limit so we aren't back here on the next store
+    if ( cache_bytes > limit ) {
+        qsort(entries, count, sizeof(CacheEntry), compareEntries);
+        for ( int i = 0; i < count && cache_bytes > limit / 10 * 9; i++ ) {
+            if ( unlink(entries[i].name) == 0 ) cache_bytes -= entries[i].size;
+        }
+    }
+    for ( int i = 0; i < count; i++ ) free(entries[i].name);
+    free(entries);
+}
+
+/* Looks for 'key' in the entry at 'path'. On a hit, sends the saved output to 'fd_out',
+sets 'status', and returns 1 */
+int cacheReplay(char* path, CacheKey* key, int fd_out, int* status) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) return 0;
+
+    CacheHeader header;
+    struct stat info;
+    char* saved = malloc(key->length);
+    int hit = readFully(fd, &header, sizeof(header)) == 0
+        && memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.key_length == (int)key->length
+        && readFully(fd, saved, key->length) == 0
+        && memcmp(saved, key->text, key->length) == 0
+        && fstat(fd, &info) == 0
+        && info.st_size == (off_t)( sizeof(header) + key->length + header.out_length );
+    free(saved);
+
+    if ( hit ) {
+        fflush(stdout);
+        copyBytes(fd, sizeof(header) + key->length, header.out_length, fd_out);
+        futimens(fd, NULL);     // Just used. That's what the LRU goes by
+        *status = header.status;
+    }
+    close(fd);
+    return hit;
+}
+
+/* Saves a fresh result. It's written off to the side and renamed into place, so a
+reader never sees half an entry */
+void cacheStore(char* directory, char* path, CacheKey* key, int status, int output, long long length) {
+
+    // Named after the thread, not the process, or two libmysh threads would share it
+    char temporary[64];
+    snprintf(temporary, sizeof(temporary), ".new.%d", (int)gettid());
+    char* staging = executablePathBuilder(temporary, directory);
+
+    int fd = open(staging, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if ( fd == -1 ) {
+        perror("Error writing to the cache");
+        free(staging);
+        return;
+    }
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.status = status;
+    header.key_length = key->length;
+    header.out_length = length;
+
+    int failed = writeFully(fd, &header, sizeof(header)) == 1 
+        || writeFully(fd, key->text, key->length) == 1
+        || copyBytes(output, 0, length, fd) == 1;
+    close(fd);
+
+    if ( failed || rename(staging, path) == -1 ) {
+        perror("Error writing to the cache");
+        unlink(staging);
+    } else if ( cache_bytes != -1 ) {
+        cache_bytes += sizeof(header) + key->length + length;
+    }
+    free(staging);
+    cacheEvict(directory);
+}
+
+/* Runs the program for real, with its output going into a memfd first so we can keep a
+copy. Returns its exit status, or -1 if it never got to run */
+int cacheMiss(char* executable, char** args, char* input, int fd_out, CacheKey* key,
+              char* directory, char* path) {
+
+    int fd_in = open(input != NULL ? input : "/dev/null", O_RDONLY | O_CLOEXEC);
+    if ( fd_in == -1 ) {
+        perror("open");
+        return -1;
+    }
+    int captured = memfd_create("mysh-cache", MFD_CLOEXEC);
+    if ( captured == -1 ) {
+        perror("memfd_create");
+        close(fd_in);
+        return -1;
+    }
+
+    int wstatus = 0;
+    pid_t pid = spawnProgram(executable, args, fd_in, captured);
+    close(fd_in);
+    if ( pid == -1 ) {
+        printf("Error forking\n");
+        close(captured);
+        return -1;
+    }
+    waitProgram(pid, &wstatus);
+
+    long long length = lseek(captured, 0, SEEK_END);
+    fflush(stdout);
+    copyBytes(captured, 0, length, fd_out);
+
+    // Something that got killed didn't finish its work, so don't keep what it printed
+    int status = programStatus(wstatus);
+    if ( path != NULL && WIFEXITED(wstatus) ) cacheStore(directory, path, key, status, captured, length);
+    close(captured);
+    return status;
+}
+
+int cacheCommand() {
+
+    if ( MAX_TOKENS < 2 ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: cache <program> [argument...] [< input] [> output]\n");
+        return 1;
+    }
+    if ( hasPipe() == 0 ) {
+        printf("Error: cache only works on a single program\n");
+        printf("Usage: cache <program> [argument...] [< input] [> output]\n");
+        return 1;
+    }
+    for ( int i = 1; i < MAX_TOKENS; i++ ) {
+        if ( isCaretSymbol(tokens[i]) && ( i == 1 || i == MAX_TOKENS - 1 || isCaretSymbol(tokens[i + 1]) ) ) {
+            printf("Error: Improper use of redirection symbol\n");
+            return 1;
+        }
+    }
+
+    // Split the line into the program's arguments and its redirections
+    char** args = (char**)malloc(MAX_TOKENS * sizeof(char*));
+    int count = 0;
+    char* input = NULL;
+    char* output = NULL;
+    for ( int i = 1; i < MAX_TOKENS; i++ ) {
+        if ( strcmp(tokens[i], "<") == 0 ) input = tokens[++i];
+        else if ( strcmp(tokens[i], ">") == 0 ) output = tokens[++i];
+        else args[count++] = tokens[i];
+    }
+    args[count] = NULL;
+
+    char* executable = findExecutable(args[0]);
+    if ( executable == NULL ) {
+        printf("Error: executable does not exist\n");
+        free(args);
+        return 1;
+    }
+
+    // Everything the output could depend on
+    CacheKey key = { NULL, 0, 0 };
+    char cwd[BUFFSIZE];
+    cacheKeyAdd(&key, CACHE_MAGIC);
+    cacheKeyAddFile(&key, "program", executable);
+    for ( int i = 1; i < count; i++ ) cacheKeyAddFile(&key, "argument", args[i]);
+    if ( input != NULL ) cacheKeyAddFile(&key, "input", input);
+    cacheKeyAdd(&key, "cwd");
+    cacheKeyAdd(&key, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "(unknown)");
+    char* locale[] = { "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "LC_NUMERIC", "LC_TIME", "TZ" };
+    for ( int i = 0; i < sizeof(locale) / sizeof(locale[0]); i++ ) cacheKeyAddVariable(&key, locale[i]);
+    if ( getenv("MYSH_CACHE_ENV") != NULL ) {
+        char* names = strdup(getenv("MYSH_CACHE_ENV"));
+        char* rest = NULL;
+        for ( char* name = strtok_r(names, " ,:", &rest); name != NULL; name = strtok_r(NULL, " ,:", &rest) ) {
+            cacheKeyAddVariable(&key, name);
+        }
+        free(names);
+    }
+
+    char* directory = cacheDirectory();
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", cacheHash(&key));
+    char* path = directory != NULL ? executablePathBuilder(hash, directory) : NULL;
+
+    int status = 0;
+    int fd_out = shell_fds[1];
+    if ( output != NULL ) fd_out = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+
+    // On a hit the output goes where it would have, and nothing runs
+    if ( fd_out == -1 ) {
+        perror("open");
+        status = -1;
+    } else if ( path == NULL || cacheReplay(path, &key, fd_out, &status) == 0 ) {
+        status = cacheMiss(executable, args, input, fd_out, &key, directory, path);
+    }
+
+    if ( fd_out != shell_fds[1] && fd_out != -1 ) close(fd_out);
+    free(key.text);
+    free(directory);
+    free(path);
+    free(executable);
+    free(args);
+    return status == -1 ? 1 : status;     // Whatever the program exited with, replayed or not
+}
+
+/* ============================================================ */
+// Bench //
+
+/* 'bench [-n N] [-w WARMUP] cmd ...' runs the rest of the line N times (10 by default)
+after WARMUP untimed runs (1 by default), and prints how long each run took: min, median,
+p90, p99 and max wall time. The line is anything masterDirectory() could run, pipes and
+redirections included, and it goes through the very same code every time. It's been
+through variable and wildcard expansion once already, up front, so those aren't timed.
+
+Next to the wall times we print the mean user and sys time of the programs it ran (from
+getrusage(), so it only sees programs we forked and waited for ourselves, not the zygote's)
+and what the shell itself spent per run: its own CPU time, syscalls and mallocs */
+
+#define BENCH_DEFAULT_RUNS 10
+#define BENCH_DEFAULT_WARMUP 1
+#define BENCH_MAX_RUNS 1000000
+
+int dispatchCommand();      // Down in Master Directory
+
+double timevalSeconds(struct timeval* time) {
+    return time->tv_sec + time->tv_usec / 1e6;
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return ( x > y ) - ( x < y );
+}
+
+/* Nearest rank: the smallest time at least 'percent' of the runs came in under */
+double percentile(double* sorted, int count, int percent) {
+    int rank = ( (long)percent * count + 99 ) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* 'seconds' in whichever unit keeps it readable */
+char* benchTime(double seconds, char* buffer, size_t size) {
+    if ( seconds < 1e-3 ) snprintf(buffer, size, "%.1fus", seconds * 1e6);
+    else if ( seconds < 1 ) snprintf(buffer, size, "%.3fms", seconds * 1e3);
+    else snprintf(buffer, size, "%.3fs", seconds);
+    return buffer;
+}
+
+/* Reads 'token' as a count for 'option'. Returns 1 if it isn't one */
+int benchCount(char* option, char* token, int minimum, int* count) {
+    char* end;
+    long value = ( token != NULL ) ? strtol(token, &end, 10) : -1;
+    if ( token == NULL || token[0] == '\0' || *end != '\0' || value < minimum || value > BENCH_MAX_RUNS ) {
+        printf("Error: Improper count for %s: \"%s\"\n", option, token != NULL ? token : "");
+        printf("Usage: bench [-n N] [-w WARMUP] <command> [argument...]\n");
+        return 1;
+    }
+    *count = value;
+    return 0;
+}
+
+int benchCommand() {
+
+    int runs = BENCH_DEFAULT_RUNS;
+    int warmup = BENCH_DEFAULT_WARMUP;
+    int start = 1;
+    while ( start < MAX_TOKENS && tokens[start][0] == '-' ) {
+        char* value = ( start + 1 < MAX_TOKENS ) ? tokens[start + 1] : NULL;
+        if ( strcmp(tokens[start], "-n") == 0 ) {
+            if ( benchCount("-n", value, 1, &runs) == 1 ) return 1;
+        } else if ( strcmp(tokens[start], "-w") == 0 ) {
+            if ( benchCount("-w", value, 0, &warmup) == 1 ) return 1;
+        } else {
+            break;  // Not ours. Must be the command's
+        }
+        start += 2;
+    }
+    if ( start == MAX_TOKENS ) {
+        printf("Error: Nothing to bench\n");
+        printf("Usage: bench [-n N] [-w WARMUP] <command> [argument...]\n");
+        return 1;
+    }
+
+    // Every run gets its own copy, since running a line takes its tokens apart
+    int count = MAX_TOKENS - start;
+    char** command = (char**)malloc(count * sizeof(char*));
+    size_t length = 1;
+    for ( int i = 0; i < count; i++ ) {
+        command[i] = strdup(tokens[start + i]);
+        length += strlen(command[i]) + 1;
+    }
+    char* text = malloc(length);
+    text[0] = '\0';
+    for ( int i = 0; i < count; i++ ) {
+        if ( i > 0 ) strcat(text, " ");
+        strcat(text, command[i]);
+    }
+
+    double* walls = (double*)malloc(runs * sizeof(double));
+    double childCpu[2] = { 0, 0 };  // User and sys
+    double shellCpu = 0;
+    unsigned long shellSyscalls = 0;
+    unsigned long shellMallocs = 0;
+    int failures = 0;
+
+    LineState state;
+    saveLineState(&state);
+
+    for ( int run = -warmup; run < runs; run++ ) {
+        tokens = (char**)malloc(count * sizeof(char*));
+        for ( int i = 0; i < count; i++ ) tokens[i] = strdup(command[i]);
+        MAX_TOKENS = count;
+        line = strdup(text);
+
+        struct rusage selfBefore, childBefore, selfAfter, childAfter;
+        PhaseStats statsBefore[MAX_PHASES];
+        memcpy(statsBefore, session_stats, sizeof(session_stats));
+        getrusage(RUSAGE_SELF, &selfBefore);
+        getrusage(RUSAGE_CHILDREN, &childBefore);
+        struct timespec began;
+        clock_gettime(CLOCK_MONOTONIC, &began);
+
+        int status = dispatchCommand();
+
+        double wall = secondsSince(&began);
+        getrusage(RUSAGE_SELF, &selfAfter);
+        getrusage(RUSAGE_CHILDREN, &childAfter);
+        inputReset();
+        if ( run < 0 ) continue;
+
+        walls[run] = wall;
+        failures += ( status != 0 );
+        childCpu[0] += timevalSeconds(&childAfter.ru_utime) - timevalSeconds(&childBefore.ru_utime);
+        childCpu[1] += timevalSeconds(&childAfter.ru_stime) - timevalSeconds(&childBefore.ru_stime);
+        shellCpu += timevalSeconds(&selfAfter.ru_utime) - timevalSeconds(&selfBefore.ru_utime)
+                  + timevalSeconds(&selfAfter.ru_stime) - timevalSeconds(&selfBefore.ru_stime);
+        for ( int i = 0; i < MAX_PHASES; i++ ) {
+            shellSyscalls += session_stats[i].syscalls - statsBefore[i].syscalls;
+            shellMallocs += session_stats[i].mallocs - statsBefore[i].mallocs;
+        }
+    }
+
+    restoreLineState(&state);
+
+    qsort(walls, runs, sizeof(double), compareDoubles);
+    char times[5][32];
+    fflush(stdout);     // The report goes after whatever the runs printed
+    printf("bench: %d runs of \"%.60s\" (%d warmup)\n", runs, text, warmup);
+    printf("  wall      min %s  median %s  p90 %s  p99 %s  max %s\n", 
+           benchTime(walls[0], times[0], sizeof(times[0])), 
+           benchTime(percentile(walls, runs, 50), times[1], sizeof(times[1])), 
+           benchTime(percentile(walls, runs, 90), times[2], sizeof(times[2])), 
+           benchTime(percentile(walls, runs, 99), times[3], sizeof(times[3])), 
+           benchTime(walls[runs - 1], times[4], sizeof(times[4])));
+    if ( zygote_fd != -1 ) {
+        // The zygote waits for the programs, so their time lands on its rusage, not ours
+        printf("  programs  n/a (zygote)\n");
+    } else {
+        printf("  programs  user %s  sys %s  (mean per run)\n", 
+               benchTime(childCpu[0] / runs, times[0], sizeof(times[0])), 
+               benchTime(childCpu[1] / runs, times[1], sizeof(times[1])));
+    }
+    printf("  shell     cpu %s  syscalls %.1f  mallocs %.1f  (mean per run)\n", 
+           benchTime(shellCpu / runs, times[0], sizeof(times[0])), 
+           (double)shellSyscalls / runs, (double)shellMallocs / runs);
+    if ( failures > 0 ) printf("  %d of %d runs failed\n", failures, runs);
+
+    for ( int i = 0; i < count; i++ ) free(command[i]);
+    free(command);
+    free(text);
+    free(walls);
+    return failures > 0 ? 1 : 0;
+}
+
+
+/* ============================================================ */
+// Master Directory //
+
+int masterDirectory() {
+
+    // Strip off a 'nosort' prefix before any wildcards get expanded
+    int prefixIndex = ( strcmp(tokens[0], "then") == 0 || strcmp(tokens[0], "else") == 0 ) ? 1 : 0;
+    if ( MAX_TOKENS > prefixIndex && strcmp(tokens[prefixIndex], "nosort") == 0 ) {
+        if ( nosortHandler(prefixIndex) == 1 ) {
+            exit_status = 1; return 1;
+        }
+    }
+
+    // Fill in $NAME and friends before the wildcards get a look at them
+    int previous = enterPhase(PHASE_LEX);
+    expandVariables();
+    leavePhase(previous, 0);
+    if ( MAX_TOKENS == 0 ) return 0;
+
+    /* We need to find the first match, and replace it with the token with the wildcard
+    character in the 'tokens' array */
+    previous = enterPhase(PHASE_GLOB);
+    int globbed = ( strcmp(tokens[0], "let") == 0 ) ? 0 : wildcard();   // A '*' in there means times
+    leavePhase(previous, 0);
+    if ( globbed == 1 ) { 
+        exit_status = 1; return 1; 
+    }
+
+    return dispatchCommand();
+}
+
+/* The rest of masterDirectory(), once the line's been expanded: works out what the line
+is and runs it. 'bench' comes straight here for each run */
+int dispatchCommand() {
+
+    // Get the first token
+    char* command = tokens[0];
+
+    if ( strcmp(command, "then") == 0 ) {
+        if ( thenHandler() == 1 ) return 1;
+        exit_status = 0;
+        command = tokens[0];
+    }
+
+    if ( strcmp(command, "else") == 0 ) {
+        if ( elseHandler() == 1 ) return 1;
+        exit_status = 0;
+        command = tokens[0];
+    }
+
+    // NAME=value [NAME=value...]
+    if ( isAssignment(command) ) {
+        int assignments = 1;
+        for ( int i = 1; i < MAX_TOKENS; i++ ) assignments += isAssignment(tokens[i]);
+        if ( assignments == MAX_TOKENS ) {
+            exit_status = assignVariables();
+            return exit_status;
+        }
+    }
+
+    // cache cmd args: replay the last run's output if nothing it depends on has changed
+    if ( strcmp(command, "cache") == 0 ) {
+        exit_status = cacheCommand();
+        return exit_status;
+    }
+
+    // bench cmd args: run the rest of the line over and over, and time it
+    if ( strcmp(command, "bench") == 0 ) {
+        exit_status = benchCommand();
+        return exit_status;
+    }
+
+    // Shell functions come before anything built in or on disk
+    Function* function = findFunction(command);
+    if ( function != NULL ) {
+        if ( hasCaret() == 0 || hasPipe() == 0 ) {
+            printf("Error: Functions can't be used with pipes or redirection\n");
+            return 1;
+        }
+        exit_status = callFunction(function);
+        return exit_status;
+    }
+
+    // split -jN: break up argument lists that are too big for execv()
+    if ( strcmp(command, "split") == 0 && MAX_TOKENS > 1 && strncmp(tokens[1], "-j", 2) == 0 
+        && hasCaret() == 1 && hasPipe() == 1 ) {
+        exit_status = splitCommand();   // The combined status of every batch
+        return exit_status;
+    }
+
+    if ( strcmp(command, "pwd") == 0 && hasCaret() == 1 ) {
+        if ( printCurrDirectory() == 1 ) return 1;
+        exit_status = 0;
+        return 0;
+    }
+
+    if ( strcmp(command, "cd") == 0 ) { // Change directories
+        if ( changeDirectory() == 1 ) return 1;
+        exit_status = 0;
+        return 0;
+    }
+    
+    if ( strcmp(command, "let") == 0 ) {
+        exit_status = letCommand();
+        return exit_status;
+    }
+
+    if ( strcmp(command, "unset") == 0 && hasCaret() == 1 && hasPipe() == 1 ) {
+        exit_status = unsetCommand();
+        return exit_status;
+    }
+
+    if ( strcmp(command, "source") == 0 && hasCaret() == 1 && hasPipe() == 1 ) {
+        exit_status = sourceCommand();
+        return exit_status;
+    }
+
+    if ( strcmp(command, "stats") == 0 && hasCaret() == 1 && hasPipe() == 1 ) {
+        if ( statsCommand() == 1 ) return 1;
+        exit_status = 0;
+        return 0;
+    }
+
+    if ( strcmp(command, "which") == 0 && hasCaret() == 1 ) {
+        if ( whichCommand() == 1 ) return 1;
+        exit_status = 0;
+        return 0;
+    }
+
+    /* If we get to this point, we are dealing with file paths or bare names.
+    This is the case where we don't have any carets or pipes, just a program name
+    and potentially some arguments */
+    // Ex.) ./foo arg1 arg2
+    if ( hasCaret() == 1 && hasPipe() == 1 ) {
+        exit_status = executeProgramWrapper();
+        return exit_status;
+    }
+
+    // If we get to this point, we are dealing with redirection and piping
+    if ( hasCaret() == 0 || hasPipe() == 0 ) {
+        // producer |+ consumer |+ consumer...
+        if ( fanOutCounter() > 0 ) {
+            exit_status = fanOut();
+            return exit_status;
+        }
+        int optimized = optimizePipeline();
+        if ( optimized != -1 ) {
+            exit_status = optimized;
+            return exit_status;
+        }
+        exit_status = caretPipeSwitch();
+        return exit_status;
+    }
+
+    // If we get to here, user erorr
+    else {
+        printf("Error: Command not found\n");
+        return 1;
+    }
+    return 0;
+
+}
+
+/* ============================================================ */
+// Here-Documents and Here-Strings //
+
+/* 'cmd <<EOF' takes the lines after it, up until one that's just EOF, and feeds them to
+cmd as its stdin. 'cmd <<- EOF' does the same but takes the leading tabs off each line,
+and 'cmd <<< word' feeds it just the one word (or "some quoted text"). Both get $NAME
+filled in, unless the word is in single quotes, or the delimiter is in any quotes at all.
+Either way the text never touches the disk: it goes into a pipe if it fits, or a memfd
+if it doesn't, and the whole thing gets swapped out for '< /dev/fd/N', just like a
+<(cmd). From there on it's plain old redirection.
+
+The body of a here-document is whatever lines come in next, wherever they come from.
+processLine() hands them to us until the delimiter shows up, so batch mode, scripts,
+function bodies and the prompt all get it for free. One here-document per line */
+
+MYSH_LOCAL char* heredoc_delimiter = NULL;
+MYSH_LOCAL int heredoc_start = 0;              // Where the '<<EOF' sits in 'heredoc_command'
+MYSH_LOCAL int heredoc_end = 0;
+MYSH_LOCAL int heredoc_strip_tabs = 0;         // Set by <<-
+MYSH_LOCAL int heredoc_quoted = 0;             // Set by <<'EOF' or <<"EOF", and the body stays as typed
+MYSH_LOCAL char* heredoc_body = NULL;
+MYSH_LOCAL size_t heredoc_length = 0;
+MYSH_LOCAL size_t heredoc_capacity = 0;
+
+/* Looks for a '<<WORD' in 'text' (but not a '<<<', or a shift in a $((...)) or a let). If
+there is one, returns its delimiter (malloc'd, quotes taken off) and where it starts and
+ends, and sets 'quoted' (if it isn't NULL) when the delimiter had quotes on it.
+Returns NULL if there isn't one */
+char* findHeredoc(char* text, int* start, int* end, int* stripTabs, int* quoted) {
+
+    for ( int i = 0; text[i] != '\0'; i++ ) {
+
+        // A command starts here, and a let command's '<<' is a shift
+        if ( i == 0 || strchr(";&|", text[i - 1]) != NULL ) {
+            int skip = letLength(text + i);
+            if ( skip > 0 ) {
+                i += skip - 1;
+                continue;
+            }
+        }
+
+        if ( text[i] == '$' && text[i + 1] == '(' && text[i + 2] == '(' ) {
+            int closing = matchingParen(text, i + 1);
+            if ( closing != -1 ) i = closing;
+            continue;
+        }
+        if ( text[i] != '<' || text[i + 1] != '<' ) continue;
+        if ( text[i + 2] == '<' ) {     // A here-string
+            i += 2;
+            continue;
+        }
+
+        *start = i;
+        int j = i + 2;
+        *stripTabs = ( text[j] == '-' );
+        if ( *stripTabs ) j++;
+        while ( text[j] == ' ' || text[j] == '\t' ) j++;
+
+        char quote = ( text[j] == '\'' || text[j] == '"' ) ? text[j] : '\0';
+        if ( quote ) j++;
+        if ( quoted != NULL ) *quoted = ( quote != '\0' );
+        int wordStart = j;
+        while ( text[j] != '\0' && ( quote ? text[j] != quote : strchr(" \t<>|", text[j]) == NULL ) ) j++;
+        char* delimiter = strndup(text + wordStart, j - wordStart);
+        if ( quote && text[j] == quote ) j++;
+        *end = j;
+        return delimiter;
+    }
+    return NULL;
+}
+
+/* Puts 'length' bytes of 'text' somewhere a program can read them as stdin. A pipe if they
+fit in one (so the write can't ever block), a memfd if they don't. Returns the read end */
+int heredocFd(char* text, size_t length) {
+
+    int pipefd[2];
+    if ( pipe2(pipefd, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        return -1;
+    }
+    if ( length <= (size_t)fcntl(pipefd[1], F_GETPIPE_SZ) ) {
+        int failed = writeFully(pipefd[1], text, length);
+        close(pipefd[1]);
+        if ( failed == 0 ) return pipefd[0];
+        close(pipefd[0]);
+        perror("Error writing here-document");
+        return -1;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    int memfd = memfd_create("mysh-heredoc", MFD_CLOEXEC);
+    if ( memfd == -1 || writeFully(memfd, text, length) == 1 ) {
+        perror("Error writing here-document");
+        if ( memfd != -1 ) close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+/* Replaces 'end - start' bytes of 'line' at 'start' with '< /dev/fd/N', where N is 'fd'.
+The fd belongs to the line from now on, and closeSubstitutions() closes it */
+void redirectFromFd(int start, int end, int fd) {
+
+    MAX_SUBSTITUTIONS++;
+    substitution_fds = (int*)realloc(substitution_fds, MAX_SUBSTITUTIONS * sizeof(int));
+    substitution_pids = (pid_t*)realloc(substitution_pids, MAX_SUBSTITUTIONS * sizeof(pid_t));
+    substitution_fds[MAX_SUBSTITUTIONS - 1] = fd;
+    substitution_pids[MAX_SUBSTITUTIONS - 1] = 0;     // Nothing to wait for
+
+    char path[32];
+    int pathLength = snprintf(path, sizeof(path), " < /dev/fd/%d ", fd);
+    int restLength = strlen(line + end);
+    char* replaced = malloc(start + pathLength + restLength + 1);
+    memcpy(replaced, line, start);
+    memcpy(replaced + start, path, pathLength);
+    memcpy(replaced + start + pathLength, line + end, restLength + 1);
+    free(line);
+    line = replaced;
+}
+
+void forgetHeredoc() {
+    free(heredoc_command);
+    free(heredoc_delimiter);
+    free(heredoc_body);
+    heredoc_command = NULL;
+    heredoc_delimiter = NULL;
+    heredoc_body = NULL;
+    heredoc_length = 0;
+    heredoc_capacity = 0;
+}
+
+/* For when the input runs out before the delimiter shows up */
+void unfinishedHeredoc() {
+    if ( heredoc_command == NULL ) return;
+    printf("Error: Here-document ended before its \"%s\"\n", heredoc_delimiter);
+    forgetHeredoc();
+}
+
+/* 'line' has a '<<WORD' in it. Hang on to it until we have the body */
+int startHeredoc() {
+
+    int start, end, stripTabs, quoted;
+    char* delimiter = findHeredoc(line, &start, &end, &stripTabs, &quoted);
+    if ( delimiter[0] == '\0' ) {
+        printf("Error: Missing here-document delimiter\n");
+        free(delimiter);
+        free(line);
+        return 1;
+    }
+    heredoc_command = line;
+    heredoc_delimiter = delimiter;
+    heredoc_start = start;
+    heredoc_end = end;
+    heredoc_strip_tabs = stripTabs;
+    heredoc_quoted = quoted;
+    heredoc_capacity = 256;
+    heredoc_body = malloc(heredoc_capacity);
+    heredoc_length = 0;
+    line = NULL;
+    return 0;
+}
+
+/* One more line of the body, or the delimiter. Once we have the delimiter, the command
+that asked for the here-document finally runs */
+int heredocLine() {
+
+    char* text = line;
+    if ( heredoc_strip_tabs ) while ( *text == '\t' ) text++;
+
+    if ( strcmp(text, heredoc_delimiter) != 0 ) {
+        // Like a here-string, the body gets its $NAME filled in, unless the delimiter was quoted
+        char* body = heredoc_quoted ? strdup(text) : expandToken(text);
+        size_t length = strlen(body);
+        while ( heredoc_length + length + 1 > heredoc_capacity ) heredoc_capacity *= 2;
+        heredoc_body = realloc(heredoc_body, heredoc_capacity);
+        memcpy(heredoc_body + heredoc_length, body, length);
+        heredoc_body[heredoc_length + length] = '\n';
+        heredoc_length += length + 1;
+        free(body);
+        free(line);
+        return 0;
+    }
+    free(line);
+
+    int fd = heredocFd(heredoc_body, heredoc_length);
+    line = heredoc_command;
+    heredoc_command = NULL;
+    if ( fd != -1 ) redirectFromFd(heredoc_start, heredoc_end, fd);
+    forgetHeredoc();
+    if ( fd == -1 ) {
+        free(line);
+        return 1;
+    }
+    return processLine();
+}
+
+/* Swaps every '<<< word' in the line for a '< /dev/fd/N' with the word (and a newline)
+waiting on the other end */
+int hereStrings() {
+
+    for ( int i = 0; line[i] != '\0'; i++ ) {
+
+        if ( line[i] != '<' || line[i + 1] != '<' || line[i + 2] != '<' ) continue;
+
+        int j = i + 3;
+        while ( line[j] == ' ' || line[j] == '\t' ) j++;
+        char quote = ( line[j] == '\'' || line[j] == '"' ) ? line[j] : '\0';
+        if ( quote ) j++;
+        int wordStart = j;
+        while ( line[j] != '\0' && ( quote ? line[j] != quote : strchr(" \t<>|", line[j]) == NULL ) ) j++;
+        if ( quote && line[j] != quote ) {
+            printf("Error: Missing %c in here-string\n", quote);
+            return 1;
+        }
+        if ( j == wordStart && !quote ) {
+            printf("Error: Missing here-string\n");
+            return 1;
+        }
+
+        // Single quotes keep it exactly as typed, anything else gets its $NAME filled in
+        char* word = strndup(line + wordStart, j - wordStart);
+        char* text = ( quote == '\'' ) ? strdup(word) : expandToken(word);
+        free(word);
+        size_t length = strlen(text);
+        text = realloc(text, length + 2);
+        text[length++] = '\n';
+        text[length] = '\0';
+
+        int fd = heredocFd(text, length);
+        free(text);
+        if ( fd == -1 ) return 1;
+        if ( quote ) j++;
+        redirectFromFd(i, j, fd);
+    }
+    return 0;
+}
+
+/* ============================================================ */
+// Process Substitution //
+
+int processLine();  // Down below. Substitutions run their commands through it too
+
+#define CAPTURE_MEMFD_SIZE (1 << 20)    // Output past this size goes in a memfd, not the heap
+#define SUBSTITUTION_MARK '\x01'        // Marks the spot where a $(cmd) used to be
+
+/* Given the index of an opening parenthesis, returns the index of the one that closes it, or -1 */
+int matchingParen(char* text, int open) {
+    int depth = 0;
+    for ( int i = open; text[i] != '\0'; i++ ) {
+        if ( text[i] == '(' ) depth++;
+        else if ( text[i] == ')' && --depth == 0 ) return i;
+    }
+    return -1;
+}
+
+/* Runs 'command' in a child shell. For <(cmd) its stdout is the write end of the pipe,
+and for >(cmd) its stdin is the read end. Returns the child's pid */
+pid_t spawnSubstitution(char* command, int pipefd[2], int isInput) {
+
+    fflush(stdout);     // Otherwise the child would print our buffered output a second time
+    int previous = enterPhase(PHASE_SPAWN);
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        perror("fork");
+        return leavePhase(previous, -1);
+    }
+    if ( pid == 0 ) {
+        /* Pipes from the other substitutions on this line aren't ours to hold on to.
+        A stray write end would keep some >(cmd) from ever seeing end of file */
+        for ( int i = 0; i < MAX_SUBSTITUTIONS; i++ ) close(substitution_fds[i]);
+        MAX_SUBSTITUTIONS = 0;
+        substitution_base = 0;
+
+        /* The zygote's socket is a conversation with the parent. If we talked on it too, the
+        two of us would get each other's replies, so we go back to forking for ourselves */
+        if ( zygote_fd != -1 ) close(zygote_fd);
+        zygote_fd = -1;
+
+        // Same goes for the trace. Only the shell the user started writes to it
+        if ( trace_fd != -1 ) close(trace_fd);
+        trace_fd = -1;
+
+        if ( isInput ) childFds(-1, pipefd[1]);
+        else childFds(pipefd[0], -1);
+        close(pipefd[0]);
+        close(pipefd[1]);
+
+        // The $(cmd) commands we know about belong to the parent's line, not this one
+        line = strdup(command);
+        command_substitutions = NULL;
+        MAX_COMMAND_SUBSTITUTIONS = 0;
+
+        if ( ifAllSpaces() == 1 ) _exit(EXIT_SUCCESS);
+        int status = processLine();
+
+        fflush(stdout);
+        _exit(status);
+    }
+    traceSpawned(pid, "substitution");
+    return leavePhase(previous, pid);
+}
+
+/* Finds every <(cmd) and >(cmd) in the line, starts 'cmd' on a pipe, and replaces the whole
+thing with a /dev/fd path to our end of that pipe. The program we run later inherits the
+pipe and opens it like any other file, with no temp files on disk, and the commands
+inside get to run right alongside it */
+int processSubstitution() {
+
+    for ( int i = 0; line[i] != '\0'; i++ ) {
+
+        if ( ( line[i] != '<' && line[i] != '>' ) || line[i + 1] != '(' ) continue;
+
+        int closing = matchingParen(line, i + 1);
+        if ( closing == -1 ) {
+            printf("Error: Missing ')' in process substitution\n");
+            return 1;
+        }
+
+        int isInput = ( line[i] == '<' );   // <(cmd) means we read what cmd writes
+        int pipefd[2];
+        if ( pipe2(pipefd, O_CLOEXEC) == -1 ) {
+            perror("pipe");
+            return 1;
+        }
+
+        char* command = strndup(line + i + 2, closing - i - 2);
+        pid_t pid = spawnSubstitution(command, pipefd, isInput);
+        free(command);
+
+        int ours = isInput ? pipefd[0] : pipefd[1];
+        close(isInput ? pipefd[1] : pipefd[0]);
+        if ( pid == -1 ) {
+            close(ours);
+            return 1;
+        }
+
+        // The program we run later opens /dev/fd/N on its own, so our end has to go across
+        fcntl(ours, F_SETFD, 0);
+
+        MAX_SUBSTITUTIONS++;
+        substitution_fds = (int*)realloc(substitution_fds, MAX_SUBSTITUTIONS * sizeof(int));
+        substitution_pids = (pid_t*)realloc(substitution_pids, MAX_SUBSTITUTIONS * sizeof(pid_t));
+        substitution_fds[MAX_SUBSTITUTIONS - 1] = ours;
+        substitution_pids[MAX_SUBSTITUTIONS - 1] = pid;
+
+        // Swap the substitution out for the path to our end of the pipe
+        char path[32];
+        int pathLength = snprintf(path, sizeof(path), "/dev/fd/%d", ours);
+        int restLength = strlen(line + closing + 1);
+
+        char* replaced = malloc(i + pathLength + restLength + 1);
+        memcpy(replaced, line, i);
+        memcpy(replaced + i, path, pathLength);
+        memcpy(replaced + i + pathLength, line + closing + 1, restLength + 1);
+        free(line);
+        line = replaced;
+
+        i += pathLength - 1;
+    }
+    return 0;
+}
+
+/* Once the command is finished, close our ends of the pipes (so every >(cmd) sees end of
+file) and wait for the substituted commands to finish up */
+void closeSubstitutions() {
+
+    // Only this line's own. Inside a function, the caller's are still in use
+    int waiting = ( MAX_SUBSTITUTIONS > substitution_base );
+    for ( int i = substitution_base; i < MAX_SUBSTITUTIONS; i++ ) {
+        close(substitution_fds[i]);
+    }
+    int previous = waiting ? enterPhase(PHASE_WAIT) : stat_phase;
+    for ( int i = substitution_base; i < MAX_SUBSTITUTIONS; i++ ) {
+        if ( substitution_pids[i] > 0 ) waitpid(substitution_pids[i], NULL, 0);
+        traceReaped(substitution_pids[i]);
+    }
+    if ( waiting ) leavePhase(previous, 0);
+
+    MAX_SUBSTITUTIONS = substitution_base;
+    if ( MAX_SUBSTITUTIONS > 0 ) return;
+    free(substitution_fds);
+    free(substitution_pids);
+    substitution_fds = NULL;
+    substitution_pids = NULL;
+}
+
+/* ============================================================ */
+// Command Substitution //
+
+/* Pulls every $(cmd) out of the line and leaves a mark in its place: \x01N\x01, where N is
+where we stashed 'cmd'. Doing this before anything else means the spacing and tokenizing
+can't pick apart what's inside the parentheses */
+int commandSubstitution() {
+
+    for ( int i = 0; line[i] != '\0'; i++ ) {
+
+        // Leave process substitutions alone. They run their whole command in a child
+        if ( ( line[i] == '<' || line[i] == '>' ) && line[i + 1] == '(' ) {
+            int closing = matchingParen(line, i + 1);
+            if ( closing == -1 ) break;     // processSubstitution() will complain about this
+            i = closing;
+            continue;
+        }
+
+        if ( line[i] != '$' || line[i + 1] != '(' ) continue;
+
+        int closing = matchingParen(line, i + 1);
+        if ( closing == -1 ) {
+            printf("Error: Missing ')' in command substitution\n");
+            return 1;
+        }
+
+        MAX_COMMAND_SUBSTITUTIONS++;
+        command_substitutions = (char**)realloc(command_substitutions, 
+                                                MAX_COMMAND_SUBSTITUTIONS * sizeof(char*));
+        command_substitutions[MAX_COMMAND_SUBSTITUTIONS - 1] = strndup(line + i + 2, closing - i - 2);
+
+        char mark[32];
+        int markLength = snprintf(mark, sizeof(mark), "%c%d%c", SUBSTITUTION_MARK, 
+                                  MAX_COMMAND_SUBSTITUTIONS - 1, SUBSTITUTION_MARK);
+        int restLength = strlen(line + closing + 1);
+
+        char* replaced = malloc(i + markLength + restLength + 1);
+        memcpy(replaced, line, i);
+        memcpy(replaced + i, mark, markLength);
+        memcpy(replaced + i + markLength, line + closing + 1, restLength + 1);
+        free(line);
+        line = replaced;
+
+        i += markLength - 1;
+    }
+    return 0;
+}
+
+/* Reads everything from 'fd' until end of file. Output starts out in a heap buffer that
+doubles when it fills up. If it grows past CAPTURE_MEMFD_SIZE, it moves into a memfd and
+the rest gets splice()'d in after it, then the whole thing is mapped back into memory.
+Returns the data, and sets 'length', and 'memfd' (-1 if the heap was big enough) */
+char* captureOutput(int fd, size_t* length, int* memfd) {
+
+    size_t capacity = 4096;
+    char* buffer = malloc(capacity);
+    *length = 0;
+    *memfd = -1;
+
+    while ( 1 ) {
+        if ( *length == capacity ) {
+            if ( capacity >= CAPTURE_MEMFD_SIZE ) break;    // Too big for the heap
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        ssize_t bytes = read(fd, buffer + *length, capacity - *length);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return buffer;
+        *length += bytes;
+    }
+
+    // Still going. Everything from here on out lives in a memfd
+    *memfd = memfd_create("mysh-capture", MFD_CLOEXEC);
+    if ( *memfd == -1 || write(*memfd, buffer, *length) != (ssize_t)*length ) {
+        perror("memfd_create");
+        if ( *memfd != -1 ) close(*memfd);
+        *memfd = -1;
+        return buffer;      // Settle for what we have so far
+    }
+    free(buffer);
+
+    ssize_t bytes;
+    while ( (bytes = splice(fd, NULL, *memfd, NULL, CAPTURE_MEMFD_SIZE, SPLICE_F_MOVE)) != 0 ) {
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes == -1 ) {
+            perror("splice");
+            break;
+        }
+        *length += bytes;
+    }
+
+    char* mapped = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, *memfd, 0);
+    if ( mapped == MAP_FAILED ) {
+        perror("mmap");
+        close(*memfd);
+        *memfd = -1;
+        *length = 0;
+        return malloc(1);
+    }
+    return mapped;
+}
+
+void releaseCapture(char* data, size_t length, int memfd) {
+    if ( memfd == -1 ) {
+        free(data);
+    } else {
+        munmap(data, length);
+        close(memfd);
+    }
+}
+
+int isSeparator(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* Runs the command behind the first mark in tokens[arrayIndex] and splits its output into
+words, right into the token list. Whatever was stuck to the front of the mark goes on the
+first word, and whatever was stuck to the back goes on the last. Returns the index of the
+token holding the last word, so the caller can look for more marks in it, or -1 if the
+whole token disappeared */
+int expandCommandSubstitution(int arrayIndex) {
+
+    char* token = tokens[arrayIndex];
+    char* start = strchr(token, SUBSTITUTION_MARK);
+    char* end = strchr(start + 1, SUBSTITUTION_MARK);
+    int which = atoi(start + 1);
+
+    int pipefd[2];
+    if ( pipe2(pipefd, O_CLOEXEC) == -1 ) {
+        perror("pipe");
+        return -2;
+    }
+    pid_t pid = spawnSubstitution(command_substitutions[which], pipefd, 1);
+    close(pipefd[1]);
+
+    size_t length;
+    int memfd;
+    char* output = captureOutput(pipefd[0], &length, &memfd);
+    close(pipefd[0]);
+    int previous = enterPhase(PHASE_WAIT);
+    if ( pid > 0 ) waitpid(pid, NULL, 0);
+    traceReaped(pid);
+    leavePhase(previous, 0);
+
+    // First pass: count the words so we can make room for all of them at once
+    size_t words = 0;
+    for ( size_t i = 0; i < length; i++ ) {
+        if ( !isSeparator(output[i]) && ( i == 0 || isSeparator(output[i - 1]) ) ) words++;
+    }
+
+    char* prefix = token;
+    size_t prefixLength = start - token;
+    char* suffix = end + 1;
+    size_t suffixLength = strlen(suffix);
+
+    if ( words == 0 ) {
+        releaseCapture(output, length, memfd);
+
+        if ( prefixLength + suffixLength > 0 ) {    // Only the mark goes away
+            memmove(start, suffix, suffixLength + 1);
+            return arrayIndex;
+        }
+
+        // Nothing left of the token at all
+        free(token);
+        memmove(&tokens[arrayIndex], &tokens[arrayIndex + 1], (MAX_TOKENS - arrayIndex - 1) * sizeof(char*));
+        MAX_TOKENS--;
+        return -1;
+    }
+
+    if ( words > 1 && makeRoomForTokens(arrayIndex + 1, words - 1) == 1 ) {
+        releaseCapture(output, length, memfd);
+        return -2;
+    }
+
+    // Second pass: each word gets copied exactly once, straight into its slot
+    size_t word = 0;
+    size_t i = 0;
+    while ( word < words ) {
+        while ( isSeparator(output[i]) ) i++;
+        size_t wordStart = i;
+        while ( i < length && !isSeparator(output[i]) ) i++;
+        size_t wordLength = i - wordStart;
+
+        size_t before = ( word == 0 ) ? prefixLength : 0;
+        size_t after = ( word == words - 1 ) ? suffixLength : 0;
+
+        char* fresh = malloc(before + wordLength + after + 1);
+        memcpy(fresh, prefix, before);
+        memcpy(fresh + before, output + wordStart, wordLength);
+        memcpy(fresh + before + wordLength, suffix, after);
+        fresh[before + wordLength + after] = '\0';
+
+        tokens[arrayIndex + word] = fresh;
+        word++;
+    }
+
+    free(token);
+    releaseCapture(output, length, memfd);
+    return arrayIndex + words - 1;
+}
+
+/* Goes through the tokens and replaces every $(cmd) mark with the words cmd printed */
+int expandCommandSubstitutions() {
+
+    if ( MAX_COMMAND_SUBSTITUTIONS == 0 ) return 0;
+
+    int status = 0;
+    for ( int i = 0; i < MAX_TOKENS; i++ ) {
+        while ( strchr(tokens[i], SUBSTITUTION_MARK) != NULL ) {
+            int last = expandCommandSubstitution(i);
+            if ( last == -2 ) { status = 1; break; }
+            if ( last == -1 ) { i--; break; }   // The token vanished, look at whoever took its place
+            i = last;
+        }
+        if ( status == 1 ) break;
+    }
+    return status;
+}
+
+void freeCommandSubstitutions() {
+    for ( int i = 0; i < MAX_COMMAND_SUBSTITUTIONS; i++ ) {
+        free(command_substitutions[i]);
+    }
+    free(command_substitutions);
+    command_substitutions = NULL;
+    MAX_COMMAND_SUBSTITUTIONS = 0;
+}
+
+/* Sends whatever is in 'line' through the whole works: substitutions, clean-up,
+tokenizing, the Master Directory, and the reset afterwards. Returns whatever the Master
+Directory returned */
+int processLine() {
+
+    int status;
+
+    // In the middle of a here-document, every line is part of its body until the delimiter
+    if ( heredoc_command != NULL ) return heredocLine();
+
+    // Comments (and a script's #! line) don't do anything, not even inside a function body
+    char* start = line;
+    while ( isspace(*start) ) start++;
+    if ( *start == '#' && inHeredoc() == 0 ) { free(line); return 0; }
+
+    // So do loops, until their 'done'. Inside a function body, the function plans them
+    if ( defining == NULL && ( inLoop() || startsLoop(line) ) ) return loopLine();
+
+    // Function definitions get collected, not run
+    char name[256];
+    if ( defining != NULL || isFunctionHeader(line, name, sizeof(name)) ) return defineFunctionLine();
+
+    // cmd <<EOF: the body is on the lines after this one, so this one has to wait
+    int heredocStart, heredocEnd, stripTabs;
+    char* delimiter = findHeredoc(line, &heredocStart, &heredocEnd, &stripTabs, NULL);
+    if ( delimiter != NULL ) {
+        free(delimiter);
+        return startHeredoc();
+    }
+
+    // cmd1 && cmd2 || cmd3 ; cmd4: split up once, and every command runs on its own
+    if ( findListOperator(line, NULL) != -1 ) return runCommandList();
+
+    int previous = enterPhase(PHASE_LEX);
+
+    // Work out any $((expression)) first, while "<" and ">" are still part of it
+    if ( arithmeticExpansion() == 1 ) {
+        free(line);
+        return leavePhase(previous, 1);
+    }
+
+    // A let's '<', '>' and '|' are all arithmetic, so only $(cmd) gets done to it below
+    int let = letLength(line) > 0;
+
+    // cmd <<< word
+    if ( let == 0 && hereStrings() == 1 ) {
+        closeSubstitutions();
+        free(line);
+        return leavePhase(previous, 1);
+    }
+
+    // Pull out any $(cmd) before anything else can pick it apart
+    if ( commandSubstitution() == 1 ) {
+        freeCommandSubstitutions();
+        free(line);
+        return leavePhase(previous, 1);
+    }
+
+    // Start up any <(cmd) or >(cmd), and swap them out for /dev/fd paths
+    if ( let == 0 && processSubstitution() == 1 ) {
+        closeSubstitutions();
+        freeCommandSubstitutions();
+        free(line);
+        return leavePhase(previous, 1);
+    }
+
+    // First, separate (with spaces) any input that looks like this: foo<bar
+    if ( let == 0 ) makeSpaceForJesus();
+
+    // Count the total amount of tokens entered by the user (including <, >, and |)
+    countTokens();
+
+    // Input all tokens into the global array called 'tokens'
+    stringToArrayWrapper();
+
+    // Run each $(cmd) and split what it printed into the token list
+    int expanded = expandCommandSubstitutions();
+    leavePhase(previous, 0);
+    if ( expanded == 1 ) status = 1;
+
+    // Now, we will enter the master directory (unless a substitution left us with nothing)
+    else if ( MAX_TOKENS == 0 ) status = 0;
+    else status = masterDirectory();
+
+    previous = enterPhase(PHASE_REAP);
+    inputReset();
+
+    // The command is done with any substitution pipes, so let them go
+    closeSubstitutions();
+    freeCommandSubstitutions();
+    leavePhase(previous, 0);
+
+    return status;
+}
 
-    int insertionPoint = arrayIndex + 1;
-    tokens = (char**)realloc(tokens, (MAX_TOKENS + 1) * sizeof(char*)); // Make space for another token
+void readTextFileLine(char* inputLine) {
+    line = malloc(strlen(inputLine) + 1);
+    memcpy(line, inputLine, strlen(inputLine) + 1);
 
-    // Shift elements to the right
-    for ( int i = MAX_TOKENS; i > insertionPoint; i-- ) {
-        tokens[i] = tokens[i - 1];
+    // Inside a here-document, blank lines and 'exit' are just more of its body
+    if ( inHeredoc() == 0 ) {
+        if ( line[0] == '\0' ) { free(line); exit(EXIT_FAILURE); }
+        if ( ifAllSpaces() == 1 ) { free(line); exit(EXIT_FAILURE); }
     }
 
-    // Allocate memory for the new string
-    tokens[insertionPoint] = (char *)malloc((strlen(token) + 1) * sizeof(char));
-    if ( tokens[insertionPoint] == 0 ) {
-        printf("Memory allocation failed for new string.\n");
-        return;
+    if ( strcmp(line, "exit") == 0 && defining == NULL && heredoc_command == NULL && inLoop() == 0 ) {
+        printf("Now leaving myshell\n");
+        exit(EXIT_SUCCESS);
     }
 
-    // Copy the new string into the array
-    strcpy(tokens[insertionPoint], token);
-    MAX_TOKENS++;
+    char command[64];
+    snprintf(command, sizeof(command), "%s", line);
+    commandStatsStart();
+    int status = processLine();
+    if ( status != 0 ) exit_status = status;
+    commandStatsEnd(command);
 }
 
-int globIt(char* token, int arrayIndex) {
 
-    char* file_match = NULL;
-    glob_t glob_result;
+/* ============================================================ */
+// Command Server //
+
+/* mysh --serve SOCKET listens on a Unix socket and runs the lines clients send it, so
+they don't have to start a whole shell for every command. Each client gets its own
+forked copy of the server, which already has the warm caches: resolved paths, functions,
+variables, and plans for lines it has seen before. A client's copy goes away with the
+client though, so whenever one plans a line the server hasn't seen, it tells the server
+about it down a pipe. The server plans the line too and looks up its programs, and from
+then on every client (a one-shot 'myshc SOCKET cmd' included) starts out with both. A
+request is a ServeRequest followed by the line. Without SERVE_CAPTURE, the client's
+stdin, stdout and stderr come along with it (SCM_RIGHTS) and the line runs right on
+them. With it, output goes into memfds and comes back in the reply, after the
+ServeReply. myshc.c has to agree with all this */
+
+#define SERVE_CAPTURE 1
+#define SERVED_PLANS 256
+#define MAX_SERVE_LINE ( 1 << 20 )      // Bytes. Anything longer and the client gets hung up on
+
+typedef struct ServeRequest {
+    int flags;
+    int length;         // Bytes in the line that follows
+} ServeRequest;
+
+typedef struct ServeReply {
+    int status;
+    int out_length;     // Bytes of captured stdout that follow, then stderr
+    int err_length;
+} ServeReply;
+
+typedef struct ServedPlan {
+    char* text;         // The line, exactly as the client sent it
+    Plan plan;
+} ServedPlan;
+
+ServedPlan served_plans[SERVED_PLANS];  // By the hash of the line. Newcomers take the slot
+char* serve_path = NULL;
+pid_t serve_pid = 0;
+int serve_learn[2] = { -1, -1 };        // Clients -> server: lines it should plan for everybody
+
+/* send() instead of write(), so a client that hangs up early can't kill us with SIGPIPE */
+int sendFully(int socket, const void* buffer, size_t length) {
+    size_t done = 0;
+    while ( done < length ) {
+        ssize_t bytes = send(socket, (const char*)buffer + done, length - done, MSG_NOSIGNAL);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return 1;
+        done += bytes;
+    }
+    return 0;
+}
 
-    int glob_status = glob(token, 0, 0, &glob_result);
-    if (glob_status == 0) {
+/* The plan for 'text', made if it isn't there already. 'made' says whether it had to be */
+Plan* servedPlan(char* text, int* made) {
+    ServedPlan* served = &served_plans[hashName(text, strlen(text)) % SERVED_PLANS];
+    *made = ( served->text == NULL || strcmp(served->text, text) != 0 );
+    if ( *made ) {
+        free(served->text);
+        planFree(&served->plan);
+        served->text = strdup(text);
+        planAddLine(&served->plan, text);
+    }
+    return &served->plan;
+}
 
-        // Successfully found matching files
-        for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
-        
-            file_match = malloc(strlen(glob_result.gl_pathv[i]) + 1);
-            memcpy(file_match, glob_result.gl_pathv[i], strlen(glob_result.gl_pathv[i]) + 1);
-            file_match[strlen(glob_result.gl_pathv[i])] = '\0';
-            
-            /* If this is the first match, we want to first completely replace 
-            the token with the wildcard character, then we'll add on its other matches */
-            if ( i == 0 ) {
-                tokens[arrayIndex] = realloc(tokens[arrayIndex], strlen(file_match) + 1);
-                memcpy(tokens[arrayIndex], file_match, strlen(file_match) + 1);
-                tokens[arrayIndex][strlen(file_match)] = '\0';
-            }    
-            /* If there is more than one match, tack it to the array on after 
-            the original wildcard token */
-            else addGlob(file_match, arrayIndex);
-            free(file_match);
+/* Looks up every program in 'plan', so they land in the path cache */
+void serveResolve(Plan* plan) {
+    for ( int i = 0; i < plan->MAX_LINES; i++ ) {
+        PlanLine* planLine = &plan->lines[i];
+        if ( planLine->list != NULL ) serveResolve(&planLine->list->plan);
+        for ( int j = 0; j < planLine->MAX_TOKENS; j++ ) {
+            if ( j == 0 || isPipeSymbol(planLine->tokens[j - 1]) || strcmp(planLine->tokens[j - 1], "|+") == 0 ) {
+                free(findExecutable(planLine->tokens[j]));
+            }
         }
+    }
+}
 
-        globfree(&glob_result);
+/* A client's copy tells the server about a line it just planned. One write() of less than
+PIPE_BUF can't get mixed up with anybody else's, and if the pipe's full, we just don't */
+void serveTeach(char* text) {
+    char message[PIPE_BUF];
+    int length = strlen(text);
+    if ( serve_learn[1] == -1 || sizeof(int) + length > sizeof(message) ) return;
+    memcpy(message, &length, sizeof(int));
+    memcpy(message + sizeof(int), text, length);
+    if ( write(serve_learn[1], message, sizeof(int) + length) == -1 ) return;
+}
 
-    } else if (glob_status == GLOB_NOMATCH) {
-        // printf("No files found matching the pattern.\n");
-        // If there are no matches, we do nothing. The token remains the same.
-        return 1;
-    } else {
-        printf("Error in glob.\n");
-        return 1;
+/* The server side: plans every line the clients have told us about since last time */
+void serveLearn() {
+    struct pollfd waiting = { serve_learn[0], POLLIN, 0 };
+    while ( poll(&waiting, 1, 0) > 0 ) {
+        int length;
+        char text[PIPE_BUF];
+        if ( readFully(serve_learn[0], &length, sizeof(int)) == 1 || length < 0
+          || length >= (int)sizeof(text) || readFully(serve_learn[0], text, length) == 1 ) return;
+        text[length] = '\0';
+
+        int made;
+        Plan* plan = servedPlan(text, &made);
+        if ( made ) serveResolve(plan);
     }
-    return 0;
 }
 
-void bareGlob(char* token, int arrayIndex) {
+/* Runs one line from a client. Lines we've seen before skip straight to their plan.
+Returns the line's status, or -1 if it was 'exit' */
+int serveLine(char* text) {
+
+    line = text;
+    if ( inHeredoc() == 0 && ifAllSpaces() == 1 ) { free(line); return 0; }
+    if ( strcmp(line, "exit") == 0 && defining == NULL && heredoc_command == NULL && inLoop() == 0 ) { free(line); return -1; }
+
+    char command[64];
+    snprintf(command, sizeof(command), "%s", line);
+    commandStatsStart();
+
+    // Anything that has to go through processLine() every time can't use a plan
+    char name[256];
+    int status;
+    if ( defining != NULL || heredoc_command != NULL || inLoop() || startsLoop(line) 
+      || isFunctionHeader(line, name, sizeof(name)) 
+      || strstr(line, "$(") != NULL || strstr(line, "<(") != NULL || strstr(line, ">(") != NULL 
+      || strstr(line, "<<") != NULL ) {
+        status = processLine();
+    } else {
+        int made;
+        Plan* plan = servedPlan(text, &made);
+        if ( made ) serveTeach(text);
+        free(text);
+        line = NULL;
+        status = runPlanLine(&plan->lines[0]);
+    }
 
-    char cwd[4096];
-    getcwd(cwd, sizeof(cwd));
+    commandStatsEnd(command);
+    return status;
+}
 
-    char original_token[strlen(token) + 1];
-    memcpy(original_token, token, strlen(token) + 1);
-    original_token[strlen(token)] = '\0';
+/* Reads back what a captured line wrote into 'fd', and puts it in 'length' */
+char* readCapture(int fd, int* length) {
+    struct stat info;
+    *length = ( fstat(fd, &info) == 0 ) ? info.st_size : 0;
+    char* data = malloc(*length + 1);
+    if ( *length > 0 && pread(fd, data, *length, 0) != *length ) *length = 0;
+    return data;
+}
 
-    char* directory;
+/* Everything one client gets. Runs in its own forked copy of the server */
+void serveClient(int client) {
 
-    directory = "/usr/local/bin";  chdir(directory);
-    globIt(token, arrayIndex);
-    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+    /* Our siblings are talking to the zygote too, and we'd end up with each other's
+    replies. Same goes for the trace. So this copy forks for itself and doesn't trace */
+    if ( zygote_fd != -1 ) close(zygote_fd);
+    zygote_fd = -1;
+    if ( trace_fd != -1 ) close(trace_fd);
+    trace_fd = -1;
 
-    directory = "/usr/bin";  chdir(directory);
-    globIt(token, arrayIndex);
-    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+    int saved[3] = { dup(STDIN_FILENO), dup(STDOUT_FILENO), dup(STDERR_FILENO) };
 
-    directory = "/bin";  chdir(directory);
-    globIt(token, arrayIndex);
-    if ( strcmp(original_token, tokens[arrayIndex]) != 0 ) { chdir(cwd); return; }
+    while ( 1 ) {
+        ServeRequest request;
+        int fds[ZYGOTE_MAX_FDS];
+        int count = receiveWithFds(client, &request, sizeof(request), fds);
+        if ( count == -1 ) break;
 
-    chdir(cwd);
-}
+        if ( request.length < 0 || request.length > MAX_SERVE_LINE ) {
+            for ( int i = 0; i < count; i++ ) close(fds[i]);
+            break;
+        }
+        char* text = malloc(request.length + 1);
+        if ( readFully(client, text, request.length) == 1 ) {
+            free(text);
+            for ( int i = 0; i < count; i++ ) close(fds[i]);
+            break;
+        }
+        text[request.length] = '\0';
+
+        // Point our stdin, stdout and stderr wherever this line's output is supposed to go
+        int out = -1;
+        int err = -1;
+        if ( request.flags & SERVE_CAPTURE ) {
+            int devnull = open("/dev/null", O_RDONLY);
+            out = memfd_create("mysh-stdout", MFD_CLOEXEC);
+            err = memfd_create("mysh-stderr", MFD_CLOEXEC);
+            dup2(devnull, STDIN_FILENO);
+            dup2(out, STDOUT_FILENO);
+            dup2(err, STDERR_FILENO);
+            close(devnull);
+        } else if ( count == 3 ) {
+            for ( int i = 0; i < 3; i++ ) dup2(fds[i], i);
+        }
+        for ( int i = 0; i < count; i++ ) close(fds[i]);
+
+        int status = serveLine(text);
+
+        fflush(stdout);
+        fflush(stderr);
+        for ( int i = 0; i < 3; i++ ) dup2(saved[i], i);
+
+        ServeReply reply = { status == -1 ? 0 : status, 0, 0 };
+        char* outData = NULL;
+        char* errData = NULL;
+        if ( request.flags & SERVE_CAPTURE ) {
+            outData = readCapture(out, &reply.out_length);
+            errData = readCapture(err, &reply.err_length);
+            close(out);
+            close(err);
+        }
 
-/* Check if any wildcard characters exist, and if they do, send that token to 'glob()' */
-int wildcard() {
+        int lost = sendFully(client, &reply, sizeof(reply)) 
+                || sendFully(client, outData, reply.out_length) 
+                || sendFully(client, errData, reply.err_length);
+        free(outData);
+        free(errData);
+        if ( lost || status == -1 ) break;
+    }
 
-    char* token;
-    int status = 0;
+    close(client);
+    _exit(EXIT_SUCCESS);
+}
 
-    for ( int i = 0; i < MAX_TOKENS; i++ ) { // Iterate through the entire array
-        token = tokens[i];
-        char original_token[strlen(token) + 1];
-        memcpy(original_token, token, strlen(token) + 1);
-        original_token[strlen(token)] = '\0';
+void stopServing(int signum) {
+    if ( getpid() == serve_pid ) unlink(serve_path);    // Only the server, not a client's copy
+    _exit(EXIT_SUCCESS);
+}
 
-        for ( int j = 0; j < strlen(token); j++ ) { // Iterate through each, individual token
+/* Listens on 'path' forever, forking a copy of ourselves for each client */
+int runServer(char* path) {
 
-            if ( token[j] == '*' ) { // Wildcard found!
-                if ( wildcardCriteria(token) == 1 ) return 1; // Must pass criteria
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(address.sun_path) ) {
+        printf("Error: Socket path too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, path);
 
-                // If a match is found, return 0, if no match return 1.
-                status = globIt(token, i);
+    // A socket left over from a server that's gone can go, but nothing else gets clobbered
+    struct stat info;
+    if ( stat(path, &info) == 0 && S_ISSOCK(info.st_mode) ) unlink(path);
 
-                /* If we have a bare name that is not in the cwd, we need to go into 
-                the three bin directories to see if the file is in there */
-                int bare = 0;
-                for ( int ch = 0; ch < strlen(tokens[i]); ch++ ) {
-                    if ( ch == '/' ) bare = 1;
-                }
-                if ( bare == 0 && access(token, F_OK) != 0 && status == 1 ) 
-                bareGlob(token, i); 
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( server == -1 || bind(server, (struct sockaddr*)&address, sizeof(address)) == -1 
+      || listen(server, 128) == -1 ) {
+        perror("Error starting server");
+        return 1;
+    }
 
-                status = 0;
-                break; // Go to the next token
-            }
-        }
+    // Clients' copies write lines for us to learn here. They never wait on us
+    if ( pipe2(serve_learn, O_CLOEXEC) == -1 ) {
+        perror("Error starting server");
+        return 1;
     }
-    return status;
-}
+    fcntl(serve_learn[1], F_SETFL, O_NONBLOCK);
 
+    serve_path = path;
+    serve_pid = getpid();
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+    fprintf(stderr, "mysh: serving on %s\n", path);
 
-/* ============================================================ */
-// Input Processing Functions //
+    while ( 1 ) {
+        // Whatever the last clients planned goes into our caches before the next one forks
+        struct pollfd ready[2] = { { server, POLLIN, 0 }, { serve_learn[0], POLLIN, 0 } };
+        if ( poll(ready, 2, -1) == -1 && errno != EINTR ) perror("poll");
+        if ( ready[1].revents & POLLIN ) serveLearn();
+        if ( ( ready[0].revents & POLLIN ) == 0 ) continue;
 
-/* This function takes the user input as a string, and indexes each token in 'tokens[]' */
-void stringToArray(const char *originalString, const char *delimiter, char **stringArray, int *numSubstrings) {
+        int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
 
-    char *token;
-    *numSubstrings = 0;
-    int MAX_SUBSTRINGS = MAX_TOKENS;
+        // Clean up after any clients that have left
+        while ( waitpid(-1, NULL, WNOHANG) > 0 );
 
-    // Tokenize the string based on the delimiter
-    token = strtok((char *)originalString, delimiter);
-    
-    // Store each token as a substring in the string array
-    while ( token != NULL && *numSubstrings < MAX_SUBSTRINGS ) {
+        if ( client == -1 ) {
+            if ( errno != EINTR ) perror("accept");
+            continue;
+        }
 
-        stringArray[*numSubstrings] = (char *)malloc(((strlen(token)+1)) * sizeof(char));
+        fflush(stdout);
+        pid_t pid = fork();
+        if ( pid == 0 ) {
+            close(server);
+            close(serve_learn[0]);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            serveClient(client);
+        }
+        if ( pid == -1 ) perror("fork");
+        close(client);
+    }
+    return 0;
+}
 
-        if ( stringArray[*numSubstrings] == NULL ) {
-            perror("Memory allocation failed");
-            exit(EXIT_FAILURE);
+
+/* ============================================================ */
+// Prefetch //
+
+/* 'mysh --prefetch script' reads the whole script once before it runs any of it, and
+hands every command word it finds to a few threads. Each one gets looked up the same way
+findExecutable() always does, and then posix_fadvise(WILLNEED) tells the kernel to start
+reading it in. The same happens for the shared libraries it asks for (its DT_NEEDED
+entries) and for its loader. On a cold machine the disk is then busy with programs the
+script needs later while its first lines are still running, instead of every program's
+first run sitting through its own page faults.
+
+It's only a guess. Words that come from variables, wildcards or anything quoted don't
+exist until the line runs, so they get skipped. A builtin that also has a program by the
+same name, like pwd, gets its program read in for nothing. Nothing the threads find gets
+used for anything else, so a bad guess costs a lookup and some readahead. Libraries only
+get looked for in the usual places, not LD_LIBRARY_PATH or a program's own RUNPATH */
+
+#define MAX_PREFETCH_THREADS 8
+
+char* library_directories[] = { "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu", 
+    "/lib/aarch64-linux-gnu", "/usr/lib/aarch64-linux-gnu", "/lib64", "/usr/lib64", 
+    "/lib", "/usr/lib", "/usr/local/lib" };
+#define MAX_LIBRARY_DIRECTORIES 9
+
+typedef struct PrefetchItem {
+    char* name;         // A command word, or the full path of a library
+    int is_path;
+} PrefetchItem;
+
+/* Shared by the threads, so everything in here goes under 'lock' */
+typedef struct Prefetch {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    PrefetchItem* items;        // Everything ever queued, so nothing gets done twice
+    int count;
+    int capacity;
+    int next;                   // The first one no thread has taken yet
+    int busy;                   // Threads working on something that might queue more
+    int stop;
+    pthread_t threads[MAX_PREFETCH_THREADS];
+    int thread_count;
+    int files;                  // What got advised, for --stats
+    unsigned long long bytes;
+} Prefetch;
+
+Prefetch prefetch = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Adds 'name' to the queue unless it's been there before. Takes the lock itself */
+void prefetchQueue(const char* name, int is_path) {
+    pthread_mutex_lock(&prefetch.lock);
+    for ( int i = 0; i < prefetch.count; i++ ) {
+        if ( strcmp(prefetch.items[i].name, name) == 0 ) {
+            pthread_mutex_unlock(&prefetch.lock);
+            return;
         }
+    }
+    if ( prefetch.count == prefetch.capacity ) {
+        prefetch.capacity = prefetch.capacity == 0 ? 64 : prefetch.capacity * 2;
+        prefetch.items = realloc(prefetch.items, prefetch.capacity * sizeof(PrefetchItem));
+    }
+    prefetch.items[prefetch.count].name = strdup(name);
+    prefetch.items[prefetch.count].is_path = is_path;
+    prefetch.count++;
+    pthread_cond_signal(&prefetch.changed);
+    pthread_mutex_unlock(&prefetch.lock);
+}
 
-        strncpy(stringArray[*numSubstrings], token, (strlen(token)+1) - 1);
-        stringArray[*numSubstrings][(strlen(token)+1) - 1] = '\0'; // Null-terminate the substring
-        (*numSubstrings)++;
-        token = strtok(NULL, delimiter);
+/* Where 'address' in the program's memory comes from in the file. 0 if it doesn't */
+size_t prefetchOffset(Elf64_Phdr* segments, int count, Elf64_Addr address) {
+    for ( int i = 0; i < count; i++ ) {
+        if ( segments[i].p_type == PT_LOAD && address >= segments[i].p_vaddr 
+            && address < segments[i].p_vaddr + segments[i].p_filesz ) {
+            return segments[i].p_offset + ( address - segments[i].p_vaddr );
+        }
     }
+    return 0;
 }
 
-/* This function just sets things up before calling 'stringToArray()' */
-void stringToArrayWrapper() {
+/* Queues the loader and the shared libraries the ELF file in 'map' asks for. Anything
+that isn't a 64-bit ELF file with all its pieces where they should be gets left alone */
+void prefetchLibraries(unsigned char* map, size_t size) {
+
+    Elf64_Ehdr* header = (Elf64_Ehdr*)map;
+    if ( size < sizeof(Elf64_Ehdr) || memcmp(map, ELFMAG, SELFMAG) != 0 
+        || map[EI_CLASS] != ELFCLASS64 || header->e_phentsize != sizeof(Elf64_Phdr) 
+        || header->e_phoff > size || header->e_phnum > ( size - header->e_phoff ) / sizeof(Elf64_Phdr) ) return;
+
+    Elf64_Phdr* segments = (Elf64_Phdr*)(map + header->e_phoff);
+    Elf64_Dyn* dynamic = NULL;
+    size_t dynamic_count = 0;
+    for ( int i = 0; i < header->e_phnum; i++ ) {
+        Elf64_Phdr* segment = &segments[i];
+        if ( segment->p_offset > size || segment->p_filesz > size - segment->p_offset ) continue;
+        if ( segment->p_type == PT_INTERP && segment->p_filesz > 0 
+            && map[segment->p_offset + segment->p_filesz - 1] == '\0' ) {
+            prefetchQueue((char*)map + segment->p_offset, 1);
+        }
+        if ( segment->p_type == PT_DYNAMIC ) {
+            dynamic = (Elf64_Dyn*)(map + segment->p_offset);
+            dynamic_count = segment->p_filesz / sizeof(Elf64_Dyn);
+        }
+    }
+    if ( dynamic == NULL ) return;  // Static, nothing else to load
+
+    // The names are in the string table, which the dynamic section only gives us an address for
+    Elf64_Addr strtab_address = 0;
+    size_t strtab_size = 0;
+    for ( size_t i = 0; i < dynamic_count && dynamic[i].d_tag != DT_NULL; i++ ) {
+        if ( dynamic[i].d_tag == DT_STRTAB ) strtab_address = dynamic[i].d_un.d_ptr;
+        if ( dynamic[i].d_tag == DT_STRSZ ) strtab_size = dynamic[i].d_un.d_val;
+    }
+    size_t strtab = prefetchOffset(segments, header->e_phnum, strtab_address);
+    if ( strtab == 0 || strtab > size || strtab_size > size - strtab ) return;
 
-    int numSubstrings;
-    const char delimiter[] = " ";
-    char originalString[strlen(line) + 1];
-    memcpy(originalString, line, strlen(line) + 1);
+    for ( size_t i = 0; i < dynamic_count && dynamic[i].d_tag != DT_NULL; i++ ) {
+        if ( dynamic[i].d_tag != DT_NEEDED || dynamic[i].d_un.d_val >= strtab_size ) continue;
+        char* name = (char*)map + strtab + dynamic[i].d_un.d_val;
+        if ( memchr(name, '\0', strtab_size - dynamic[i].d_un.d_val) == NULL ) continue;
 
-    // Create space for each token in 'line'
-    // 'tokens' is a global array that can be accessed anywhere
-    tokens = (char**)malloc(MAX_TOKENS * sizeof(char *));
-    
-    stringToArray(originalString, delimiter, tokens, &numSubstrings);
+        if ( strchr(name, '/') != NULL ) {
+            prefetchQueue(name, 1);
+            continue;
+        }
+        for ( int j = 0; j < MAX_LIBRARY_DIRECTORIES; j++ ) {
+            char* path = executablePathBuilder(name, library_directories[j]);
+            int found = access(path, F_OK) == 0;
+            if ( found ) prefetchQueue(path, 1);
+            free(path);
+            if ( found ) break;
+        }
+    }
 }
 
-/* This is an important function. If there are any carets or pipes that rub up 
-against a token, it will separate them with a space */
-void makeSpaceForJesus() {
+/* Starts the kernel reading 'path' in, and queues whatever it's going to load along with it */
+void prefetchFile(char* path) {
 
-    int len = strlen(line);
-    int newSize = len + 2; // Increase the size of the string by 2 for two spaces
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) return;
 
-    for (int i = 0; i < len; i++) {
-        if (line[i] == '<' || line[i] == '>' || line[i] == '|') {
-            newSize += 2; // Increase the size by 2 for two spaces around the target character
+    struct stat info;
+    if ( fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 ) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        unsigned char* map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( map != MAP_FAILED ) {
+            prefetchLibraries(map, info.st_size);
+            munmap(map, info.st_size);
         }
+        pthread_mutex_lock(&prefetch.lock);
+        prefetch.files++;
+        prefetch.bytes += info.st_size;
+        pthread_mutex_unlock(&prefetch.lock);
     }
+    close(fd);
+}
 
-    char *temp = (char *)malloc(newSize * sizeof(char));
-    if (temp == NULL) {
-        perror("Memory allocation failed");
-        return;
-    }
+void* prefetchThread(void* unused) {
 
-    int j = 0;
-    for (int i = 0; i < len; i++) {
-        if (line[i] == '<' || line[i] == '>' || line[i] == '|') {
-            temp[j++] = ' ';      // Add space before the target character
-            temp[j++] = line[i];  // Add the target character
-            temp[j++] = ' ';      // Add space after the target character
-        } else {
-            temp[j++] = line[i];  // Copy other characters as they are
+    untraced = 1;   // The trace only follows the script
+    pthread_mutex_lock(&prefetch.lock);
+    while ( 1 ) {
+        // Nothing to do, but somebody else might still find more
+        while ( prefetch.stop == 0 && prefetch.next == prefetch.count && prefetch.busy > 0 ) {
+            pthread_cond_wait(&prefetch.changed, &prefetch.lock);
         }
+        if ( prefetch.stop || prefetch.next == prefetch.count ) break;
+
+        PrefetchItem item = prefetch.items[prefetch.next++];
+        prefetch.busy++;
+        pthread_mutex_unlock(&prefetch.lock);
+
+        char* path = item.is_path ? strdup(item.name) : findExecutable(item.name);
+        if ( path != NULL ) prefetchFile(path);
+        free(path);
+
+        pthread_mutex_lock(&prefetch.lock);
+        prefetch.busy--;
+        pthread_cond_broadcast(&prefetch.changed);
     }
-    temp[j] = '\0'; // Add null terminator to mark the end of the new string
-    line = realloc(line, strlen(temp) + 1);
+    pthread_mutex_unlock(&prefetch.lock);
 
-    strcpy(line, temp); // Copy the modified string back to the original
+    forgetPathCache();  // This thread's own, which nobody else will ever read
+    return NULL;
+}
 
-    free(temp); // Free the dynamically allocated memory
+int prefetchIsWordEnd(char ch) {
+    return ch == '\0' || isspace(ch) || strchr("|;&<>()", ch) != NULL;
 }
 
-/* Convert user input to a char array and store in memory */
-char* readInput() {
+/* Queues the first word of every command in 'text'. Returns the delimiter of a
+here-document it starts, or NULL. The delimiter points into 'text' */
+char* prefetchLine(char* text, int* tabs) {
+
+    char* delimiter = NULL;
+    int command = 1;        // Whether the next word we see runs something
+    int options = 0;        // 1 right after 'split', 2 after 'bench', 3 for the count after bench's -n or -w
+    char* c = text;
+    while ( *c != '\0' ) {
+
+        if ( isspace(*c) ) { c++; continue; }
+        if ( *c == '#' && command ) break;
+
+        // Anything after one of these is a command of its own: | |! |+ || ; && $( <( >(
+        if ( *c == '|' || *c == ';' || *c == '&' ) {
+            command = 1;
+            options = 0;
+            c += ( *c == '|' && ( c[1] == '!' || c[1] == '+' ) ) ? 2 : 1;
+            continue;
+        }
+        if ( *c == '(' ) {
+            command = c[1] != ')';  // Not for a function's '()'
+            c++;
+            continue;
+        }
+        if ( *c == '<' && c[1] == '<' && c[2] != '<' ) {
+            c += 2;
+            *tabs = *c == '-';
+            if ( *tabs ) c++;
+            while ( *c == ' ' || *c == '\t' ) c++;
+            if ( *c == '\'' || *c == '"' ) c++;
+            delimiter = c;
+            while ( prefetchIsWordEnd(*c) == 0 && *c != '\'' && *c != '"' ) c++;
+            if ( *c != '\0' ) *c++ = '\0';
+            command = 0;
+            continue;
+        }
+        if ( *c == ')' || *c == '<' || *c == '>' ) {
+            command = 0;    // A file name comes next, not a program
+            c++;
+            continue;
+        }
 
-    char buffer[BUFFSIZE];
-    int bytes;
+        char* word = c;
+        while ( prefetchIsWordEnd(*c) == 0 ) c++;
+        if ( command == 0 ) continue;
+
+        char saved = *c;
+        *c = '\0';
+        if ( options == 3 ) {
+            options = 2;    // bench's count, which we've already stepped past the option for
+        } else if ( options == 1 && strncmp(word, "-j", 2) == 0 ) {
+            options = 0;
+        } else if ( options == 2 && ( strcmp(word, "-n") == 0 || strcmp(word, "-w") == 0 ) ) {
+            options = 3;
+        } else if ( strcmp(word, "then") == 0 || strcmp(word, "else") == 0 || strcmp(word, "do") == 0 
+            || strcmp(word, "while") == 0 || strcmp(word, "nosort") == 0 || strcmp(word, "cache") == 0 ) {
+            // The command comes right after these
+            options = 0;
+        } else if ( strcmp(word, "split") == 0 || strcmp(word, "bench") == 0 ) {
+            options = ( word[0] == 's' ) ? 1 : 2;  // Their options come first, then the command
+        } else {
+            options = 0;
+            // 'for' is no program and neither is '}'. Variables, wildcards and quotes aren't ready yet
+            int skip = strcmp(word, "for") == 0 || strcmp(word, "done") == 0 || strpbrk(word, "$*?[`'\"={}") != NULL;
+            if ( skip == 0 && saved != '(' ) prefetchQueue(word, 0);
+            command = 0;
+        }
+        *c = saved;
+    }
+    return delimiter;
+}
 
-    bytes = read(STDIN_FILENO, buffer, BUFFSIZE);
+/* Reads the whole script at 'path' and starts the threads on it. Returns right away */
+void prefetchStart(const char* path) {
 
-    if ( bytes == -1 ) {
-        perror("Error reading input");
-        exit(EXIT_FAILURE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) return;
+    struct stat info;
+    if ( fstat(fd, &info) == -1 ) {
+        close(fd);
+        return;
+    }
+    char* text = malloc(info.st_size + 1);
+    size_t length = 0;
+    ssize_t bytes;
+    while ( length < info.st_size && ( bytes = read(fd, text + length, info.st_size - length) ) > 0 ) {
+        length += bytes;
+    }
+    text[length] = '\0';
+    close(fd);
+
+    // One line at a time, skipping here-document bodies the same way the script will
+    char* delimiter = NULL;
+    int tabs = 0;
+    char* next = text;
+    while ( next != NULL ) {
+        char* current = next;
+        next = strchr(current, '\n');
+        if ( next != NULL ) *next++ = '\0';
+
+        if ( delimiter != NULL ) {
+            char* body = current;
+            while ( tabs && *body == '\t' ) body++;
+            if ( strcmp(body, delimiter) == 0 ) delimiter = NULL;
+            continue;
+        }
+        delimiter = prefetchLine(current, &tabs);
     }
+    free(text);
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = processors < 1 ? 1 : processors > MAX_PREFETCH_THREADS ? MAX_PREFETCH_THREADS : processors;
+    if ( wanted > prefetch.count ) wanted = prefetch.count;
+    for ( int i = 0; i < wanted; i++ ) {
+        if ( pthread_create(&prefetch.threads[prefetch.thread_count], NULL, prefetchThread, NULL) != 0 ) break;
+        prefetch.thread_count++;
+    }
+}
 
-    buffer[bytes - 1] = '\0';
+/* Stops whatever the threads haven't gotten to yet and waits for them. The script is done,
+so there's no point reading anything else in */
+void prefetchFinish() {
 
-    line = malloc(bytes);
-    memcpy(line, buffer, bytes);
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.stop = 1;
+    pthread_cond_broadcast(&prefetch.changed);
+    pthread_mutex_unlock(&prefetch.lock);
 
-    return line;
+    for ( int i = 0; i < prefetch.thread_count; i++ ) pthread_join(prefetch.threads[i], NULL);
+    if ( show_stats && prefetch.count > 0 ) {
+        fprintf(stderr, "prefetch: %d of %d queued files read ahead, %.1f MB\n", prefetch.files, 
+                prefetch.count, prefetch.bytes / 1e6);
+    }
+
+    for ( int i = 0; i < prefetch.count; i++ ) free(prefetch.items[i].name);
+    free(prefetch.items);
+    prefetch.items = NULL;
+    prefetch.count = 0;
+    prefetch.capacity = 0;
+    prefetch.next = 0;
+    prefetch.thread_count = 0;
 }
 
 
 /* ============================================================ */
-// Master Directory //
+// Library //
+
+/* Everything mysh.h promises. The interpreter works on its thread-local globals just like
+it always has, so a context is a place to keep one shell's copy of them in between calls.
+A call swaps its context's copy in, runs, and swaps it back out again. It's the same
+trick saveLineState() plays for function calls, only with everything that lasts longer
+than a line. Each thread's own (stats, the path cache and so on) stay with the thread */
+
+struct MyshContext {
+    char* line;
+    char** tokens;
+    char** arguments;
+    int MAX_TOKENS;
+    int MAX_ARGUMENTS;
+    int exit_status;
+    int unsorted_glob;
+
+    int* substitution_fds;
+    pid_t* substitution_pids;
+    int MAX_SUBSTITUTIONS;
+    int substitution_base;
+    char** command_substitutions;
+    int MAX_COMMAND_SUBSTITUTIONS;
+
+    char* heredoc_command;
+    char* heredoc_delimiter;
+    int heredoc_start;
+    int heredoc_end;
+    int heredoc_strip_tabs;
+    char* heredoc_body;
+    size_t heredoc_length;
+    size_t heredoc_capacity;
+
+    Variable* variables;
+    int MAX_VARIABLES;
+    int variable_count;
+
+    Function* functions;
+    int MAX_FUNCTIONS;
+    Function* defining;
+    Plan loop_plan;
+    int call_depth;
+    char** positional;
+    int MAX_POSITIONAL;
+
+    pid_t* subshell_pids;
+    int MAX_SUBSHELLS;
+    int script_depth;
+};
+
+#define CONTEXT_SWAP(field) { __typeof__(field) swapped = field; field = context->field; context->field = swapped; }
+
+/* Trades this thread's globals for the ones in 'context'. Calling it again trades them back */
+void contextSwap(MyshContext* context) {
+    CONTEXT_SWAP(line);
+    CONTEXT_SWAP(tokens);
+    CONTEXT_SWAP(arguments);
+    CONTEXT_SWAP(MAX_TOKENS);
+    CONTEXT_SWAP(MAX_ARGUMENTS);
+    CONTEXT_SWAP(exit_status);
+    CONTEXT_SWAP(unsorted_glob);
+
+    CONTEXT_SWAP(substitution_fds);
+    CONTEXT_SWAP(substitution_pids);
+    CONTEXT_SWAP(MAX_SUBSTITUTIONS);
+    CONTEXT_SWAP(substitution_base);
+    CONTEXT_SWAP(command_substitutions);
+    CONTEXT_SWAP(MAX_COMMAND_SUBSTITUTIONS);
+
+    CONTEXT_SWAP(heredoc_command);
+    CONTEXT_SWAP(heredoc_delimiter);
+    CONTEXT_SWAP(heredoc_start);
+    CONTEXT_SWAP(heredoc_end);
+    CONTEXT_SWAP(heredoc_strip_tabs);
+    CONTEXT_SWAP(heredoc_body);
+    CONTEXT_SWAP(heredoc_length);
+    CONTEXT_SWAP(heredoc_capacity);
+
+    CONTEXT_SWAP(variables);
+    CONTEXT_SWAP(MAX_VARIABLES);
+    CONTEXT_SWAP(variable_count);
+
+    CONTEXT_SWAP(functions);
+    CONTEXT_SWAP(MAX_FUNCTIONS);
+    CONTEXT_SWAP(defining);
+    CONTEXT_SWAP(loop_plan);
+    CONTEXT_SWAP(call_depth);
+    CONTEXT_SWAP(positional);
+    CONTEXT_SWAP(MAX_POSITIONAL);
+
+    CONTEXT_SWAP(subshell_pids);
+    CONTEXT_SWAP(MAX_SUBSHELLS);
+    CONTEXT_SWAP(script_depth);
+
+    forgetLineMap();    // It was about the other 'line'
+}
 
-int masterDirectory() {
+MyshContext* myshNew(void) {
+    MyshContext* context = (MyshContext*)calloc(1, sizeof(MyshContext));
+    if ( context != NULL ) context->exit_status = -1;
+    return context;
+}
 
-    /* We need to find the first match, and replace it with the token with the wildcard
-    character in the 'tokens' array */
-    if ( wildcard() == 1 ) { 
-        exit_status = 1; return 1; 
+void myshFree(MyshContext* context) {
+    if ( context == NULL ) return;
+    contextSwap(context);
+
+    forgetHeredoc();
+    for ( int i = 0; i < MAX_VARIABLES; i++ ) {
+        if ( variables[i].name == NULL ) continue;  // An unset one's value is already gone
+        free(variables[i].name);
+        free(variables[i].value);
+    }
+    free(variables);
+    for ( int i = 0; i < MAX_FUNCTIONS; i++ ) {
+        free(functions[i].name);
+        planFree(&functions[i].body);
     }
+    free(functions);
+    if ( defining != NULL ) {
+        free(defining->name);
+        planFree(&defining->body);
+        free(defining);
+    }
+    planFree(&loop_plan);
+    for ( int i = 0; i < MAX_POSITIONAL; i++ ) free(positional[i]);
+    free(positional);
+    free(subshell_pids);
+    free(substitution_fds);
+    free(substitution_pids);
+
+    contextSwap(context);
+    free(context);
+}
 
-    // Get the first token
-    char* command = tokens[0];
+/* Gets this thread ready to run 'context': stdin from /dev/null, and stdout and stderr
+into a pair of memfds. Returns 1 if it can't, or if this thread is already running one */
+int contextEnter(MyshContext* context, MyshResult* result) {
 
-    if ( strcmp(command, "then") == 0 ) {
-        if ( thenHandler() == 1 ) return 1;
-        exit_status = 0;
-        command = tokens[1];
-    }
+    memset(result, 0, sizeof(MyshResult));
+    result->status = -1;
+    if ( context == NULL || embedded ) return 1;
 
-    if ( strcmp(command, "else") == 0 ) {
-        if ( elseHandler() == 1 ) return 1;
-        exit_status = 0;
-        command = tokens[1];
+    int fds[3] = { open("/dev/null", O_RDONLY | O_CLOEXEC), memfd_create("mysh-stdout", MFD_CLOEXEC), 
+                   memfd_create("mysh-stderr", MFD_CLOEXEC) };
+    if ( fds[0] == -1 || fds[1] == -1 || fds[2] == -1 ) {
+        for ( int i = 0; i < 3; i++ ) if ( fds[i] != -1 ) close(fds[i]);
+        return 1;
     }
+    memcpy(shell_fds, fds, sizeof(fds));
+    embedded = 1;
+    leaving = 0;
+    contextSwap(context);
+    return 0;
+}
 
-    if ( strcmp(command, "pwd") == 0 && hasCaret() == 1 ) {
-        if ( printCurrDirectory() == 1 ) return 1;
-        exit_status = 0;
-        return 0;
+/* The other end of contextEnter(). Hands 'status' and the captured output over in 'result' */
+int contextLeave(MyshContext* context, int status, MyshResult* result) {
+
+    contextSwap(context);
+    int lengths[2];
+    result->status = status;
+    result->out = readCapture(shell_fds[1], &lengths[0]);
+    result->err = readCapture(shell_fds[2], &lengths[1]);
+    result->out_length = lengths[0];
+    result->err_length = lengths[1];
+    result->out[lengths[0]] = '\0';
+    result->err[lengths[1]] = '\0';
+
+    for ( int i = 0; i < 3; i++ ) {
+        close(shell_fds[i]);
+        shell_fds[i] = i;
     }
 
-    if ( strcmp(command, "cd") == 0 ) { // Change directories
-        if ( changeDirectory() == 1 ) return 1;
-        exit_status = 0;
-        return 0;
-    }
-    
-    if ( strcmp(command, "which") == 0 && hasCaret() == 1 ) {
-        if ( whichCommand() == 1 ) return 1;
-        exit_status = 0;
-        return 0;
-    }
+    /* The thread might never run another one, and nobody frees a thread's globals when it
+    goes. The path cache stays, it's bounded and it's the whole point of a warm thread */
+    charMapFree(&line_map);
+    embedded = 0;
+    leaving = 0;
+    return status;
+}
 
-    /* If we get to this point, we are dealing with file paths or bare names.
-    This is the case where we don't have any carets or pipes, just a program name
-    and potentially some arguments */
-    // Ex.) ./foo arg1 arg2
-    if ( hasCaret() == 1 && hasPipe() == 1 ) {
-        if ( executeProgramWrapper() == 1 ) return 1;
-        exit_status = 0;
-        return 0;
-    }
+int myshRunLine(MyshContext* context, const char* text, MyshResult* result) {
 
-    // If we get to this point, we are dealing with redirection and piping
-    if ( hasCaret() == 0 || hasPipe() == 0 ) {
-        if ( caretPipeSwitch() == 1 ) return 1;
-        exit_status = 0;
-        return 0;
-    }
+    if ( contextEnter(context, result) == 1 ) return -1;
 
-    // If we get to here, user erorr
-    else {
-        printf("Error: Command not found\n");
-        return 1;
+    // Just like a line typed at the prompt, except 'exit' has nowhere to go
+    int status = 0;
+    line = strdup(text);
+    if ( inHeredoc() == 0 && ( line[0] == '\0' || ifAllSpaces() == 1 ) ) {
+        free(line);
+    } else if ( strcmp(line, "exit") == 0 && defining == NULL && heredoc_command == NULL && inLoop() == 0 ) {
+        free(line);
+    } else {
+        status = processLine();
+        if ( status != 0 ) exit_status = status;
     }
-    return 0;
+    line = NULL;
 
+    return contextLeave(context, status, result);
 }
 
-void readTextFileLine(char* inputLine) {
-    line = malloc(strlen(inputLine) + 1);
-    memcpy(line, inputLine, strlen(inputLine) + 1);
+int myshRunScript(MyshContext* context, const char* path, char* const* argv, MyshResult* result) {
 
-    if ( line[0] == '\0' ) { free(line); exit(EXIT_FAILURE); }
-    if ( ifAllSpaces() == 1 ) { free(line); exit(EXIT_FAILURE); }
+    if ( contextEnter(context, result) == 1 ) return -1;
 
-    if ( strcmp(line, "exit") == 0 ) {
-        printf("Now leaving myshell\n");
-        exit(EXIT_SUCCESS);
-    }
-    makeSpaceForJesus();
-    countTokens();
-    stringToArrayWrapper();
-    masterDirectory();
-    inputReset();
+    char* only[2] = { (char*)path, NULL };
+    char** args = ( argv != NULL ) ? (char**)argv : only;
+    int argc = 0;
+    while ( args[argc] != NULL ) argc++;
+    int status = runScript((char*)path, args, argc);
+
+    return contextLeave(context, status, result);
+}
+
+void myshResultFree(MyshResult* result) {
+    free(result->out);
+    free(result->err);
+    result->out = NULL;
+    result->err = NULL;
 }
 
 
 /* ============================================================ */
 // Program Start //
 
+#ifndef MYSH_LIBRARY    // libmysh leaves the program out
+
 int main(int argc, char const *argv[])
 {   
 
     int status = 0;
-    if ( argc > 2 ) {
-        printf("Error: Too many arguments! \n"); 
-        exit(EXIT_FAILURE);
-    } 
+    const char* script = NULL;
+    const char* trace_path = NULL;
+    char* serve_socket = NULL;
+    int use_zygote = 0;
+    int use_prefetch = 0;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "--zygote") == 0 ) use_zygote = 1;
+        else if ( strcmp(argv[i], "--stats") == 0 ) show_stats = 1;
+        else if ( strcmp(argv[i], "--no-optimize") == 0 ) optimize_pipelines = 0;
+        else if ( strcmp(argv[i], "--prefetch") == 0 ) use_prefetch = 1;
+        else if ( strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--serve") == 0 ) {
+            if ( i + 1 == argc ) {
+                printf("Error: Missing %s file\n", argv[i] + 2);
+                printf("Usage: mysh [--zygote] [--stats] [--no-optimize] [--prefetch] [--trace FILE] [--serve SOCKET] [script]\n");
+                exit(EXIT_FAILURE);
+            }
+            if ( strcmp(argv[i], "--trace") == 0 ) trace_path = argv[++i];
+            else serve_socket = (char*)argv[++i];
+        }
+        else if ( script == NULL ) script = argv[i];
+        else {
+            printf("Error: Too many arguments! \n"); 
+            printf("Usage: mysh [--zygote] [--stats] [--no-optimize] [--prefetch] [--trace FILE] [--serve SOCKET] [script]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The zygote has to be forked now, while the shell is as small as it will ever be
+    if ( use_zygote ) startZygote();
+    if ( trace_path != NULL && traceOpen(trace_path) == 1 ) exit(EXIT_FAILURE);
 
     /* ===================================== Batch mode: */
-    if ( argc == 2 ) {
+    if ( script != NULL ) {
                 
         // Make sure the file exists
-        int fd = open(argv[1], O_RDONLY);
+        int fd = open(script, O_RDONLY | O_CLOEXEC);    // Not something the script's programs need
             if (fd == -1) {
             perror("Error opening file");
             return 1;
         }
+        // Gets the disk going on the script's programs while its first lines run
+        if ( use_prefetch ) prefetchStart(script);
         char buffer[BUFFSIZE];
         int index = 0;
         int bytes;
         char ch;
         
+        int previous = enterPhase(PHASE_READ);
         while ( ( bytes = read(fd, &ch, 1)) > 0 ) {
             if ( ch == '\n' || index >= BUFFSIZE - 1 ) {
                 buffer[index] = '\0';
+                trace_line++;
+                leavePhase(previous, 0);
                 readTextFileLine(buffer);
+                previous = enterPhase(PHASE_READ);
                 index = 0;
             } else {
                 buffer[index++] = ch;
             }
         }
+        if ( index > 0 ) trace_line++;
+        leavePhase(previous, 0);
         if ( index > 0 ) {
             buffer[index] = '\0';
             readTextFileLine(buffer);
         }
         close(fd);
-        exit(EXIT_SUCCESS);
+        unfinishedHeredoc();
+        unfinishedLoop();
+        prefetchFinish();
+        if ( serve_socket == NULL ) exit(EXIT_SUCCESS);
     } 
     /* ================================================= */
 
+    /* ===================================== Server mode: */
+    // With a script too, the script runs first. Handy for defining functions and variables
+    if ( serve_socket != NULL ) {
+        if ( runServer(serve_socket) == 1 ) exit(EXIT_FAILURE);
+    }
+    /* ================================================= */
+
     /* =============================== Interactive mode: */
     int input = 1;
     char prompt[] = "mysh> ";
@@ -1215,37 +7334,36 @@ int main(int argc, char const *argv[])
     startup();
     while (input) {
         
-        write(STDOUT_FILENO, prompt, strlen(prompt));
-
         // readInput() should be called every iteration 
-        line = readInput();
+        int previous = enterPhase(PHASE_READ);
+        // "> " while reading a function, a here-document or a loop
+        line = readInput(defining != NULL || inHeredoc() || inLoop() ? "> " : prompt);
+        trace_line++;
+        leavePhase(previous, 0);
 
-        // Edge cases
-        if ( line[0] == '\0' ) { free(line); continue; }
-        if ( ifAllSpaces() == 1 ) { free(line); continue; }
+        // Edge cases. A here-document can have blank lines in it though
+        if ( inHeredoc() == 0 && line[0] == '\0' ) { free(line); continue; }
+        if ( inHeredoc() == 0 && ifAllSpaces() == 1 ) { free(line); continue; }
 
         // We don't want to do anything else if the input is 'exit', so check that first
-        if ( strcmp(line, "exit") == 0 ) {
+        if ( strcmp(line, "exit") == 0 && ( ( defining == NULL && heredoc_command == NULL && inLoop() == 0 ) || input_ended ) ) {
+            unfinishedHeredoc();
+            unfinishedLoop();
+            if ( defining != NULL ) printf("Error: Unfinished function \"%s\"\n", defining->name);
             printf("Now leaving myshell\n");
             exit(EXIT_SUCCESS);
         }
 
-        // First, separate (with spaces) any input that looks like this: foo<bar
-        makeSpaceForJesus();
-
-        // Count the total amount of tokens entered by the user (including <, >, and |)
-        countTokens();
-
-        // Input all tokens into the global array called 'tokens'
-        stringToArrayWrapper();
-
-        // Now, we will enter the master directory
-        status = masterDirectory();
-        if (status == 1) exit_status = 1;
-
-        inputReset();
+        // Now, send it through the Master Directory
+        char command[64];
+        snprintf(command, sizeof(command), "%s", line);
+        commandStatsStart();
+        status = processLine();
+        commandStatsEnd(command);
+        if (status != 0) exit_status = status;
     }
     /* ================================================= */
     
     return 0;
-}
\ No newline at end of file
+}
+#endif
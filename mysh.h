@@ -0,0 +1,56 @@
+#ifndef MYSH_H
+#define MYSH_H
+
+#include <stddef.h>
+
+/* libmysh: the mysh interpreter, for programs that want to run shell lines themselves
+
+    make libmysh.a libmysh.so
+
+A context is one shell of its own: its variables, functions and anything it's halfway
+through reading, like a function body or a here-document. Lines run in a context the
+same way they would typed into mysh, except stdin is /dev/null and whatever the line
+writes to stdout and stderr comes back in a MyshResult instead of being printed.
+
+Every thread can run a context at the same time as the others, as long as no two threads
+use the same context at once. Not everything can be split up though: the current
+directory belongs to the whole process, so 'cd' in one context moves all of them */
+
+// Only these get exported. The rest of the interpreter stays inside the library
+#define MYSH_API __attribute__((visibility("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct MyshContext MyshContext;
+
+typedef struct MyshResult {
+    int status;         // Like $?: 0 if it worked, the failing status if it didn't, -1 if it never got to run
+    char* out;          // Everything written to stdout, with a '\0' on the end
+    size_t out_length;
+    char* err;          // and to stderr
+    size_t err_length;
+} MyshResult;
+
+/* A fresh shell, with nothing defined. NULL if there's no memory for one */
+MYSH_API MyshContext* myshNew(void);
+
+/* Throws away everything 'context' has defined, and 'context' itself */
+MYSH_API void myshFree(MyshContext* context);
+
+/* Runs one line in 'context'. Fills in 'result' and returns its status */
+MYSH_API int myshRunLine(MyshContext* context, const char* line, MyshResult* result);
+
+/* Runs the script at 'path' in 'context', like 'source' would. 'argv' is $0, $1 and so on,
+with a NULL on the end. If it's NULL, $0 is 'path' and there are no arguments */
+MYSH_API int myshRunScript(MyshContext* context, const char* path, char* const* argv, MyshResult* result);
+
+/* Frees what a run put in 'result' */
+MYSH_API void myshResultFree(MyshResult* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <unistd.h>     // Unix standard library
+#include <stdlib.h>     // C standard library
+#include <stdio.h>      // Standard input and output
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* myshc: the client for 'mysh --serve SOCKET'
+
+    myshc [-c] [-n count] SOCKET [command]
+
+Sends 'command' to the server, or every line of stdin if there isn't one, and exits with
+the status of the last line. Normally the lines run right on our own stdin, stdout and
+stderr. With -c, the server captures the output and sends it back instead, and we print
+it. -n sends the same command 'count' times and reports how many lines per second the
+server got through, for benchmarking */
+
+// These have to match the Command Server section in mysh.c
+#define SERVE_CAPTURE 1
+
+typedef struct ServeRequest {
+    int flags;
+    int length;
+} ServeRequest;
+
+typedef struct ServeReply {
+    int status;
+    int out_length;
+    int err_length;
+} ServeReply;
+
+int readFully(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while ( done < length ) {
+        ssize_t bytes = read(fd, (char*)buffer + done, length - done);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return 1;
+        done += bytes;
+    }
+    return 0;
+}
+
+int writeFully(int fd, const void* buffer, size_t length) {
+    size_t done = 0;
+    while ( done < length ) {
+        ssize_t bytes = write(fd, (const char*)buffer + done, length - done);
+        if ( bytes == -1 && errno == EINTR ) continue;
+        if ( bytes <= 0 ) return 1;
+        done += bytes;
+    }
+    return 0;
+}
+
+/* Sends one line and waits for it to finish. Returns its status, or -1 if the server went away */
+int runLine(int server, char* line, int capture) {
+
+    ServeRequest request = { capture ? SERVE_CAPTURE : 0, strlen(line) };
+
+    // Our stdin, stdout and stderr ride along, unless the server is capturing
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &request, sizeof(request) };
+    struct msghdr header = { 0 };
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if ( !capture ) {
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    if ( sendmsg(server, &header, MSG_NOSIGNAL) != sizeof(request) ) return -1;
+    if ( writeFully(server, line, request.length) == 1 ) return -1;
+
+    ServeReply reply;
+    if ( readFully(server, &reply, sizeof(reply)) == 1 ) return -1;
+
+    // Anything captured comes right after the reply, stdout first
+    int lengths[2] = { reply.out_length, reply.err_length };
+    for ( int i = 0; i < 2; i++ ) {
+        char* data = malloc(lengths[i] + 1);
+        if ( readFully(server, data, lengths[i]) == 1 ) { free(data); return -1; }
+        writeFully(i == 0 ? STDOUT_FILENO : STDERR_FILENO, data, lengths[i]);
+        free(data);
+    }
+    return reply.status;
+}
+
+int main(int argc, char* argv[]) {
+
+    int capture = 0;
+    long count = 0;
+    int option;
+    while ( ( option = getopt(argc, argv, "cn:") ) != -1 ) {
+        if ( option == 'c' ) capture = 1;
+        else if ( option == 'n' ) count = atol(optarg);
+        else {
+            printf("Usage: myshc [-c] [-n count] SOCKET [command]\n");
+            return 2;
+        }
+    }
+    if ( optind >= argc || ( count > 0 && optind + 1 >= argc ) ) {
+        printf("Error: Unexpected number of arguments\n");
+        printf("Usage: myshc [-c] [-n count] SOCKET [command]\n");
+        return 2;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", argv[optind]);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( server == -1 || connect(server, (struct sockaddr*)&address, sizeof(address)) == -1 ) {
+        perror("Error connecting to mysh");
+        return 2;
+    }
+
+    int status = 0;
+
+    // Benchmark: the same line over and over
+    if ( count > 0 ) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for ( long i = 0; i < count && status != -1; i++ ) status = runLine(server, argv[optind + 1], capture);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%ld lines in %.3fs (%.0f lines/s)\n", count, elapsed, count / elapsed);
+    }
+    // Just the one line
+    else if ( optind + 1 < argc ) {
+        status = runLine(server, argv[optind + 1], capture);
+    }
+    // Every line of stdin
+    else {
+        char* line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ( ( length = getline(&line, &size, stdin) ) != -1 && status != -1 ) {
+            if ( length > 0 && line[length - 1] == '\n' ) line[length - 1] = '\0';
+            status = runLine(server, line, capture);
+        }
+        free(line);
+    }
+
+    close(server);
+    if ( status == -1 ) {
+        printf("Error: Lost the connection to mysh\n");
+        return 2;
+    }
+    return status;
+}
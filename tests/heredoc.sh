@@ -0,0 +1,16 @@
+# Here-documents: $NAME gets filled in, unless the delimiter is quoted
+# Run with 'make check'. The output has to match heredoc.expected
+name=world
+cat <<EOF
+hello $name ${name}
+EOF
+cat <<'EOF'
+hello $name
+EOF
+cat <<- "END"
+	tabs $name
+	END
+for i in 1 2; do cat <<EOF
+row $i
+EOF
+done
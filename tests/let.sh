@@ -0,0 +1,31 @@
+# let with the operators the tokenizer would otherwise take for redirection, pipes and lists
+# Run with 'make check'. The output has to match let.expected
+i=2
+let j=i<5
+echo lt $? $j
+let j=i>5
+echo gt $? $j
+let j=i<=2
+echo le $? $j
+let j=i>=3
+echo ge $? $j
+let j=i==2
+echo eq $? $j
+let j=i!=2
+echo ne $? $j
+let j=0||i
+echo or $? $j
+let j=0||0
+echo or $? $j
+let j=i&&0
+echo and $? $j
+let i<3 && echo and-list
+let i>3 || echo or-list
+let i+=1; echo after $i
+double() {
+    let n=$1*2>5
+    echo double $1 $n
+}
+double 2
+double 3
+for w in 1 2 3; do let s=w*w>=4; echo loop $w $s; done
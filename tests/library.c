@@ -0,0 +1,64 @@
+/* libmysh with a few threads going at once, each in a context of its own. Every thread sets
+a variable, reads it back, and makes sure a failing command's status comes through.
+Run with 'make check' */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mysh.h"
+
+#define THREADS 4
+#define ROUNDS 50
+
+/* Runs 'text' in 'context'. Returns 1 if its status or stdout isn't what we expected */
+int expect(MyshContext* context, const char* text, int status, const char* out) {
+    MyshResult result;
+    int failed = 0;
+    if ( myshRunLine(context, text, &result) != status || result.status != status ) {
+        printf("Error: \"%s\" gave status %d, not %d\n", text, result.status, status);
+        failed = 1;
+    } else if ( out != NULL && strcmp(result.out, out) != 0 ) {
+        printf("Error: \"%s\" printed \"%s\", not \"%s\"\n", text, result.out, out);
+        failed = 1;
+    }
+    myshResultFree(&result);
+    return failed;
+}
+
+void* thread(void* argument) {
+    int which = *(int*)argument;
+    MyshContext* context = myshNew();
+    if ( context == NULL ) return (void*)1;
+
+    char set[64], want[64];
+    snprintf(set, sizeof(set), "name=thread%d", which);
+    snprintf(want, sizeof(want), "thread%d\n", which);
+
+    long failed = 0;
+    for ( int i = 0; i < ROUNDS && failed == 0; i++ ) {
+        failed |= expect(context, set, 0, "");
+        failed |= expect(context, "echo $name", 0, want);
+        failed |= expect(context, "grep -s nothing /nonexistent", 2, "");
+        failed |= expect(context, "echo $?", 0, "2\n");
+    }
+    myshFree(context);
+    return (void*)failed;
+}
+
+int main() {
+    pthread_t threads[THREADS];
+    int which[THREADS];
+    for ( int i = 0; i < THREADS; i++ ) {
+        which[i] = i;
+        pthread_create(&threads[i], NULL, thread, &which[i]);
+    }
+
+    int failed = 0;
+    for ( int i = 0; i < THREADS; i++ ) {
+        void* result;
+        pthread_join(threads[i], &result);
+        if ( result != NULL ) failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,45 @@
+/* mysh.h from C++: the same threads and contexts as library.c, built with g++ so the
+header has to link the way a C++ service would use it. Run with 'make check' */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mysh.h"
+
+static const int THREADS = 4;
+static const int ROUNDS = 50;
+
+/* Runs 'text' in 'context'. Returns false if its status or stdout isn't what we expected */
+static bool expect(MyshContext* context, const std::string& text, int status, const std::string& out) {
+    MyshResult result;
+    bool worked = myshRunLine(context, text.c_str(), &result) == status && result.status == status
+               && out == result.out;
+    if ( !worked ) printf("Error: \"%s\" gave %d \"%s\"\n", text.c_str(), result.status, result.out);
+    myshResultFree(&result);
+    return worked;
+}
+
+int main() {
+    std::vector<std::thread> threads;
+    std::vector<int> failed(THREADS, 0);
+
+    for ( int which = 0; which < THREADS; which++ ) {
+        threads.emplace_back([which, &failed] {
+            MyshContext* context = myshNew();
+            std::string name = "thread" + std::to_string(which);
+            for ( int i = 0; i < ROUNDS && failed[which] == 0; i++ ) {
+                if ( !expect(context, "name=" + name, 0, "")
+                  || !expect(context, "echo $name", 0, name + "\n")
+                  || !expect(context, "grep -s nothing /nonexistent", 2, "") ) failed[which] = 1;
+            }
+            myshFree(context);
+        });
+    }
+    for ( std::thread& thread : threads ) thread.join();
+
+    for ( int which = 0; which < THREADS; which++ ) if ( failed[which] ) return 1;
+    return 0;
+}
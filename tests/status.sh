@@ -0,0 +1,17 @@
+# $? is the real exit status, and everything that isn't 0 counts as a failure
+# Run with 'make check'. The output has to match status.expected
+grep -s nothing /nonexistent
+echo exit $?
+timeout -s KILL 0.1 sleep 5
+echo killed $?
+grep -s nothing /nonexistent && echo and
+grep -s nothing /nonexistent || echo or $?
+grep -s nothing /nonexistent ; echo list $?
+grep -s nothing /nonexistent
+else echo else
+echo hi | grep -s nothing /nonexistent
+echo pipe $?
+grep -s nothing /nonexistent > /dev/null
+echo redirected $?
+let x=1&&0
+echo let $? $x